@@ -0,0 +1,49 @@
+// Effective memory bandwidth of add_tensor on the CPU across sizes, counting
+// two reads and one write per element. Compare VKGRAD_CPU_ISA=scalar and
+// VKGRAD_CPU_THREADS=1 against the defaults to see what each part buys.
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "../cpp/tensor.h"
+#include "../cpp/cpu.h"
+#include "../cpp/threadpool.h"
+
+int main(int argc, char** argv) {
+    long long max_size = argc > 1 ? atoll(argv[1]) : (1ll << 26);
+    char device[] = "cpu";
+
+    printf("isa %s, %d threads, grain %d\n", cpu_kernel_isa(), cpu_thread_count(), CPU_PARALLEL_GRAIN);
+    printf("%12s %12s %12s\n", "size", "us/op", "GB/s");
+    for (long long size = 1024; size <= max_size; size *= 4) {
+        float* data = (float*)malloc(size * sizeof(float));
+        for (long long i = 0; i < size; i++) {
+            data[i] = (float)i;
+        }
+        // create_tensor takes ownership of the shape; data stays borrowed
+        int* shape_a = (int*)malloc(sizeof(int));
+        int* shape_b = (int*)malloc(sizeof(int));
+        shape_a[0] = shape_b[0] = (int)size;
+        Tensor* a = create_tensor(data, shape_a, 1, device);
+        Tensor* b = create_tensor(data, shape_b, 1, device);
+        destroy_tensor(add_tensor(a, b));
+
+        // Repeat until roughly 0.2 s has passed so small sizes are measurable
+        int iters = 0;
+        double elapsed = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        while (elapsed < 0.2) {
+            destroy_tensor(add_tensor(a, b));
+            iters++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        double seconds = elapsed / iters;
+        printf("%12lld %12.2f %12.2f\n", size, seconds * 1e6, 3.0 * size * sizeof(float) / seconds * 1e-9);
+
+        free_tensor(a);
+        free_tensor(b);
+        free(data);
+    }
+
+    return 0;
+}
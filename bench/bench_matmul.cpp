@@ -0,0 +1,74 @@
+// GFLOP/s of matmul on square matrices from 64 to 4096, on the CPU and on
+// Vulkan. Usage: bench_matmul [max size] [cpu|vulkan|all]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "../cpp/tensor.h"
+#include "../cpp/vulkan.h"
+
+// Average seconds per matmul, repeating until at least min_seconds have passed
+static double time_matmul(Tensor* a, Tensor* b, bool vulkan, double min_seconds) {
+    int iters = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0.0;
+    while (elapsed < min_seconds || iters < 3) {
+        Tensor* result = matmul(a, b);
+        if (vulkan) {
+            wait_tensor(result);
+        }
+        destroy_tensor(result);
+        iters++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return elapsed / iters;
+}
+
+int main(int argc, char** argv) {
+    int max_size = argc > 1 ? atoi(argv[1]) : 4096;
+    const char* which = argc > 2 ? argv[2] : "all";
+    bool run_cpu = strcmp(which, "vulkan") != 0;
+    bool run_vulkan = strcmp(which, "cpu") != 0;
+    char cpu[] = "cpu";
+    char vulkan[] = "vulkan";
+
+    printf("%8s %14s %14s\n", "size", "cpu GFLOP/s", "vulkan GFLOP/s");
+    for (int size = 64; size <= max_size; size *= 2) {
+        float* data = (float*)malloc((size_t)size * size * sizeof(float));
+        for (int i = 0; i < size * size; i++) {
+            data[i] = (float)(i % 17) / 17.0f;
+        }
+        double flops = 2.0 * size * size * size;
+
+        // create_tensor takes ownership of the shape; data stays borrowed
+        int* shape_a = (int*)malloc(2 * sizeof(int));
+        int* shape_b = (int*)malloc(2 * sizeof(int));
+        shape_a[0] = shape_a[1] = shape_b[0] = shape_b[1] = size;
+        Tensor* a = create_tensor(data, shape_a, 2, cpu);
+        Tensor* b = create_tensor(data, shape_b, 2, cpu);
+
+        double cpu_gflops = 0.0;
+        if (run_cpu) {
+            destroy_tensor(matmul(a, b));
+            cpu_gflops = flops / time_matmul(a, b, false, 0.5) * 1e-9;
+        }
+
+        double vulkan_gflops = 0.0;
+        if (run_vulkan) {
+            to_device(a, vulkan);
+            to_device(b, vulkan);
+            // Warm up so pipeline creation is not timed
+            Tensor* warmup = matmul(a, b);
+            wait_tensor(warmup);
+            destroy_tensor(warmup);
+            vulkan_gflops = flops / time_matmul(a, b, true, 0.5) * 1e-9;
+        }
+
+        printf("%8d %14.2f %14.2f\n", size, cpu_gflops, vulkan_gflops);
+        destroy_tensor(a);
+        destroy_tensor(b);
+        free(data);
+    }
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+// Per-op latency of add_tensor on small Vulkan tensors, with and without the
+// pipeline registry. "rebuild" drops every cached pipeline before each op,
+// which is what compute_shader used to do; "cached" is the steady state.
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "../cpp/tensor.h"
+#include "../cpp/vulkan.h"
+
+static double time_add(Tensor* a, Tensor* b, int iters, bool rebuild) {
+    VulkanContext* context = getVulkanContext();
+    VkPipelineCache pipelineCache = context->pipelineCache;
+    if (rebuild) {
+        context->pipelineCache = VK_NULL_HANDLE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; i++) {
+        if (rebuild) {
+            destroyComputeKernels(context);
+        }
+        free_tensor(add_tensor(a, b));
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    context->pipelineCache = pipelineCache;
+    return std::chrono::duration<double, std::micro>(end - start).count() / iters;
+}
+
+int main(int argc, char** argv) {
+    int iters = argc > 1 ? atoi(argv[1]) : 200;
+    int sizes[] = {1, 64, 1024, 16384};
+    char device[] = "cpu";
+    char vulkan[] = "vulkan";
+
+    printf("%10s %14s %14s %10s\n", "size", "rebuild (us)", "cached (us)", "speedup");
+    for (int size : sizes) {
+        float* data = (float*)malloc(size * sizeof(float));
+        for (int i = 0; i < size; i++) {
+            data[i] = (float)i;
+        }
+        // create_tensor takes ownership of the shape; data stays borrowed
+        int* shape_a = (int*)malloc(sizeof(int));
+        int* shape_b = (int*)malloc(sizeof(int));
+        shape_a[0] = shape_b[0] = size;
+
+        Tensor* a = create_tensor(data, shape_a, 1, device);
+        Tensor* b = create_tensor(data, shape_b, 1, device);
+        to_device(a, vulkan);
+        to_device(b, vulkan);
+
+        // Warm up so both columns measure steady-state behaviour
+        free_tensor(add_tensor(a, b));
+
+        double rebuild = time_add(a, b, iters, true);
+        double cached = time_add(a, b, iters, false);
+        printf("%10d %14.1f %14.1f %9.1fx\n", size, rebuild, cached, rebuild / cached);
+
+        free_tensor(a);
+        free_tensor(b);
+        free(data);
+    }
+
+    printDeviceAllocatorStats(&getVulkanContext()->allocator);
+
+    return 0;
+}
@@ -0,0 +1,232 @@
+// Throughput and latency of the core tensor API on each device across a sweep
+// of sizes: allocating a tensor, to_device in both directions, loading from a
+// tensor file, add/sub into new results and in place, and an empty dispatch.
+// Results are written as JSON so runs can be diffed in CI; point
+// VK_ICD_FILENAMES at lavapipe to run the Vulkan half without a GPU.
+//
+//   bench_suite [--devices cpu,vulkan] [--max-size N] [--min-time S] [--json PATH]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include "../cpp/tensor.h"
+#include "../cpp/vulkan.h"
+#include "../cpp/tensor_file.h"
+#include "../cpp/threadpool.h"
+
+typedef struct {
+    const char* device;
+    const char* op;
+    long long size;   // Elements per tensor; 0 for size-independent ops
+    long long iters;
+    double seconds;   // Mean time per op
+    double bytes;     // Bytes moved per op; 0 when bandwidth is meaningless
+} BenchResult;
+
+static std::vector<BenchResult> results;
+static double min_time = 0.2;
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void record(const char* device, const char* op, long long size, long long iters, double elapsed, double bytes) {
+    BenchResult result = {device, op, size, iters, elapsed / iters, bytes};
+    results.push_back(result);
+    fprintf(stderr, "%-7s %-26s %10lld %12.2f %14.0f", device, op, size, result.seconds * 1e6, 1.0 / result.seconds);
+    if (bytes > 0) {
+        fprintf(stderr, " %10.2f", bytes / result.seconds * 1e-9);
+    }
+    fprintf(stderr, "\n");
+}
+
+// Call op after one warm-up until min_time has passed, then call finish so
+// work still queued on the device is counted
+static void measure(const char* device, const char* name, long long size, double bytes, const std::function<void()>& op,
+                    const std::function<void()>& finish) {
+    op();
+    finish();
+
+    long long iters = 0;
+    double start = now();
+    double elapsed = 0.0;
+    while (elapsed < min_time) {
+        op();
+        iters++;
+        elapsed = now() - start;
+    }
+    finish();
+    record(device, name, size, iters, now() - start, bytes);
+}
+
+static Tensor* filled_tensor(long long size, char* device) {
+    int shape[] = {(int)size};
+    Tensor* tensor = empty_tensor(shape, 1, "cpu", DTYPE_FLOAT32);
+    float* data = (float*)tensor->data;
+    for (long long i = 0; i < size; i++) {
+        data[i] = (float)(i % 1024);
+    }
+    if (strcmp(device, "cpu") != 0) {
+        to_device(tensor, device);
+    }
+    return tensor;
+}
+
+static void bench_size(char* device, long long size) {
+    bool vulkan = strcmp(device, "vulkan") == 0;
+    double tensor_bytes = (double)size * sizeof(float);
+    int shape[] = {(int)size};
+    std::function<void()> finish = [&]() {
+        if (vulkan) {
+            synchronize();
+        }
+    };
+
+    // Step 1: A fresh uninitialised tensor, as every op result needs
+    measure(device, "create_tensor", size, 0, [&]() { destroy_tensor(empty_tensor(shape, 1, device, DTYPE_FLOAT32)); }, finish);
+
+    // Step 2: Transfers each way, timed separately from one round trip per iteration
+    if (vulkan) {
+        char cpu[] = "cpu";
+        Tensor* tensor = filled_tensor(size, cpu);
+        long long iters = 0;
+        double upload = 0.0;
+        double download = 0.0;
+        while (upload + download < 2 * min_time) {
+            double start = now();
+            to_device(tensor, device);
+            synchronize();
+            double middle = now();
+            to_device(tensor, cpu);
+            upload += middle - start;
+            download += now() - middle;
+            iters++;
+        }
+        record(device, "to_device:cpu->vulkan", size, iters, upload, tensor_bytes);
+        record(device, "to_device:vulkan->cpu", size, iters, download, tensor_bytes);
+        destroy_tensor(tensor);
+    }
+
+    // Step 3: Loading from a tensor file whose pages are already cached: a mapping
+    // on the CPU, a streamed upload on Vulkan
+    {
+        char cpu[] = "cpu";
+        const char* path = "bench_suite.vkt";
+        const char* name = "x";
+        Tensor* tensor = filled_tensor(size, cpu);
+        if (save_tensors(path, &tensor, &name, 1) == 0) {
+            TensorFile* file = open_tensor_file(path);
+            measure(device, "load_tensor", size, tensor_bytes, [&]() { destroy_tensor(load_tensor(file, 0, device)); }, finish);
+            close_tensor_file(file);
+            remove(path);
+        }
+        destroy_tensor(tensor);
+    }
+
+    // Step 4: Elementwise ops read two operands and write one result
+    Tensor* a = filled_tensor(size, device);
+    Tensor* b = filled_tensor(size, device);
+    measure(device, "add_tensor", size, 3 * tensor_bytes, [&]() { destroy_tensor(add_tensor(a, b)); }, finish);
+    measure(device, "sub_tensor", size, 3 * tensor_bytes, [&]() { destroy_tensor(sub_tensor(a, b)); }, finish);
+    // In place they allocate nothing, as optimizer updates and accumulators run
+    measure(device, "add_", size, 3 * tensor_bytes, [&]() { add_(a, b); }, finish);
+    measure(device, "sub_", size, 3 * tensor_bytes, [&]() { sub_(a, b); }, finish);
+    destroy_tensor(a);
+    destroy_tensor(b);
+}
+
+// Fixed cost of launching work: one workgroup of a kernel that does nothing on
+// Vulkan, waited for each time, and a fork/join of the thread pool on the CPU
+static void bench_empty_dispatch(char* device) {
+    if (strcmp(device, "vulkan") != 0) {
+        int64_t count = (int64_t)cpu_thread_count() * CPU_PARALLEL_GRAIN;
+        measure(device, "empty_dispatch", 0, 0, [&]() { parallel_for(count, CPU_PARALLEL_GRAIN, [](int64_t, int64_t) {}); }, []() {});
+        return;
+    }
+
+    VulkanContext* context = getVulkanContext();
+    int shape[] = {1};
+    Tensor* target = empty_tensor(shape, 1, device, DTYPE_FLOAT32);
+    ComputeKernel* kernel = getComputeKernel(context, "cpp/noop.spv", 1);
+    measure(device, "empty_dispatch", 0, 0, [&]() {
+        waitForSerial(context, dispatchKernel(context, kernel, &target->buffer, 1, NULL, 1));
+    }, []() {});
+    destroy_tensor(target);
+}
+
+static void write_json(FILE* file, const char* vulkan_device) {
+    fprintf(file, "{\n  \"vulkan_device\": ");
+    if (vulkan_device != NULL) {
+        fprintf(file, "\"%s\",\n", vulkan_device);
+    } else {
+        fprintf(file, "null,\n");
+    }
+    fprintf(file, "  \"cpu_threads\": %d,\n  \"results\": [", cpu_thread_count());
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        fprintf(file, "%s\n    {\"device\": \"%s\", \"op\": \"%s\", \"size\": %lld, \"iters\": %lld, \"us_per_op\": %.3f, \"ops_per_s\": %.1f, \"gb_per_s\": ",
+                i == 0 ? "" : ",", r.device, r.op, r.size, r.iters, r.seconds * 1e6, 1.0 / r.seconds);
+        if (r.bytes > 0) {
+            fprintf(file, "%.3f}", r.bytes / r.seconds * 1e-9);
+        } else {
+            fprintf(file, "null}");
+        }
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+    const char* devices = "cpu,vulkan";
+    long long max_size = 1ll << 24;
+    const char* json_path = NULL;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--devices") == 0) {
+            devices = argv[i + 1];
+        } else if (strcmp(argv[i], "--max-size") == 0) {
+            max_size = atoll(argv[i + 1]);
+        } else if (strcmp(argv[i], "--min-time") == 0) {
+            min_time = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json_path = argv[i + 1];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    char cpu[] = "cpu";
+    char vulkan[] = "vulkan";
+    bool run_vulkan = strstr(devices, "vulkan") != NULL;
+    char vulkan_device[VK_MAX_PHYSICAL_DEVICE_NAME_SIZE] = "";
+    if (run_vulkan) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(getVulkanContext()->physicalDevice, &properties);
+        strcpy(vulkan_device, properties.deviceName);
+    }
+
+    fprintf(stderr, "%-7s %-26s %10s %12s %14s %10s\n", "device", "op", "size", "us/op", "ops/s", "GB/s");
+    char* sweep[] = {cpu, vulkan};
+    for (char* device : sweep) {
+        if (strstr(devices, device) == NULL) {
+            continue;
+        }
+        bench_empty_dispatch(device);
+        for (long long size = 1024; size <= max_size; size *= 4) {
+            bench_size(device, size);
+        }
+    }
+
+    FILE* file = json_path != NULL ? fopen(json_path, "w") : stdout;
+    if (!file) {
+        fprintf(stderr, "Failed to write results: %s\n", json_path);
+        return 1;
+    }
+    write_json(file, run_vulkan ? vulkan_device : NULL);
+    if (file != stdout) {
+        fclose(file);
+    }
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Stress test and scaling benchmark for calling the tensor API from several
+// threads at once. Each thread uploads its own operands, runs add/sub chains on
+// them and downloads the result, which must match what it started with; the
+// ops/s at each thread count show how far recording scales past the shared
+// submission lock.
+//
+//   bench_threads [--devices cpu,vulkan] [--size N] [--ops N] [--max-threads T]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../cpp/tensor.h"
+
+static long long size = 1 << 16;
+static int ops = 200;
+static std::atomic<int> failures(0);
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static Tensor* filled_tensor(int seed, char* device) {
+    int shape[] = {(int)size};
+    Tensor* tensor = empty_tensor(shape, 1, "cpu", DTYPE_FLOAT32);
+    float* data = (float*)tensor->data;
+    for (long long i = 0; i < size; i++) {
+        data[i] = (float)((i + seed) % 1024);
+    }
+    if (strcmp(device, "cpu") != 0) {
+        to_device(tensor, device);
+    }
+    return tensor;
+}
+
+// (a + b) - b, ops times over, must give back a exactly: every value is a small
+// integer, so float32 holds each intermediate without rounding
+static void worker(char* device, int index) {
+    char cpu[] = "cpu";
+    Tensor* a = filled_tensor(index, device);
+    Tensor* b = filled_tensor(index * 7 + 3, device);
+
+    Tensor* result = NULL;
+    for (int i = 0; i < ops; i += 2) {
+        Tensor* sum = add_tensor(result != NULL ? result : a, b);
+        if (result != NULL) {
+            destroy_tensor(result);
+        }
+        result = sub_tensor(sum, b);
+        destroy_tensor(sum);
+    }
+
+    if (strcmp(device, "cpu") != 0) {
+        to_device(result, cpu);
+    }
+    float* data = (float*)result->data;
+    for (long long i = 0; i < size; i++) {
+        if (data[i] != (float)((i + index) % 1024)) {
+            fprintf(stderr, "Thread %d: element %lld is %f, expected %f\n", index, i, data[i], (float)((i + index) % 1024));
+            failures++;
+            break;
+        }
+    }
+
+    destroy_tensor(result);
+    destroy_tensor(a);
+    destroy_tensor(b);
+}
+
+int main(int argc, char** argv) {
+    const char* devices = "cpu,vulkan";
+    int max_threads = (int)std::thread::hardware_concurrency();
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--devices") == 0) {
+            devices = argv[i + 1];
+        } else if (strcmp(argv[i], "--size") == 0) {
+            size = atoll(argv[i + 1]);
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            ops = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--max-threads") == 0) {
+            max_threads = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+
+    char cpu[] = "cpu";
+    char vulkan[] = "vulkan";
+    char* sweep[] = {cpu, vulkan};
+    printf("%-7s %8s %12s %10s\n", "device", "threads", "ops/s", "speedup");
+    for (char* device : sweep) {
+        if (strstr(devices, device) == NULL) {
+            continue;
+        }
+
+        // Step 1: Warm up, so kernel compilation is not timed
+        worker(device, 0);
+
+        // Step 2: Double the thread count up to the limit
+        double single = 0.0;
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            double start = now();
+            std::vector<std::thread> pool;
+            for (int t = 0; t < threads; t++) {
+                pool.emplace_back(worker, device, t);
+            }
+            for (std::thread& thread : pool) {
+                thread.join();
+            }
+            double rate = (double)threads * ops / (now() - start);
+            if (threads == 1) {
+                single = rate;
+            }
+            printf("%-7s %8d %12.0f %9.2fx\n", device, threads, rate, rate / single);
+        }
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d threads produced wrong results\n", failures.load());
+        return 1;
+    }
+    return 0;
+}
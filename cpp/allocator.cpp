@@ -0,0 +1,291 @@
+#include "allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Smallest order whose block holds size bytes
+static uint32_t orderForSize(VkDeviceSize size) {
+    uint32_t order = 0;
+    while ((ALLOCATOR_MIN_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+static MemoryBlock* createMemoryBlock(VkDevice device, VkDeviceSize blockSize, uint32_t memoryTypeIndex, bool hostVisible) {
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = blockSize;
+    allocInfo.memoryTypeIndex = memoryTypeIndex;
+
+    VkDeviceMemory memory;
+    if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+        return NULL;
+    }
+
+    MemoryBlock* block = new MemoryBlock();
+    block->memory = memory;
+    block->memoryTypeIndex = memoryTypeIndex;
+    block->mapped = NULL;
+    block->size = blockSize;
+    block->freeBytes = blockSize;
+
+    // Host-visible memory can only be mapped once, so keep the whole block mapped
+    if (hostVisible && vkMapMemory(device, memory, 0, blockSize, 0, &block->mapped) != VK_SUCCESS) {
+        vkFreeMemory(device, memory, nullptr);
+        delete block;
+        return NULL;
+    }
+
+    // The whole block starts out as one free buddy of the top order
+    block->freeLists.resize(orderForSize(blockSize) + 1);
+    block->freeLists.back().insert(0);
+
+    return block;
+}
+
+static void destroyMemoryBlock(VkDevice device, MemoryBlock* block) {
+    if (block->mapped != NULL) {
+        vkUnmapMemory(device, block->memory);
+    }
+    vkFreeMemory(device, block->memory, nullptr);
+    delete block;
+}
+
+// Take a free buddy of the given order, splitting larger ones as needed
+static bool allocateFromBlock(MemoryBlock* block, uint32_t order, VkDeviceSize* offset) {
+    uint32_t available = order;
+    while (available < block->freeLists.size() && block->freeLists[available].empty()) {
+        available++;
+    }
+    if (available >= block->freeLists.size()) {
+        return false;
+    }
+
+    VkDeviceSize start = *block->freeLists[available].begin();
+    block->freeLists[available].erase(block->freeLists[available].begin());
+
+    // Return the upper halves to the free lists until the block is the right size
+    while (available > order) {
+        available--;
+        block->freeLists[available].insert(start + (ALLOCATOR_MIN_SIZE << available));
+    }
+
+    block->freeBytes -= ALLOCATOR_MIN_SIZE << order;
+    *offset = start;
+    return true;
+}
+
+// Give a buddy back, merging with its neighbour while the neighbour is free
+static void freeToBlock(MemoryBlock* block, VkDeviceSize offset, uint32_t order) {
+    block->freeBytes += ALLOCATOR_MIN_SIZE << order;
+
+    while (order + 1 < block->freeLists.size()) {
+        VkDeviceSize buddy = offset ^ (ALLOCATOR_MIN_SIZE << order);
+        auto it = block->freeLists[order].find(buddy);
+        if (it == block->freeLists[order].end()) {
+            break;
+        }
+        block->freeLists[order].erase(it);
+        offset = offset < buddy ? offset : buddy;
+        order++;
+    }
+
+    block->freeLists[order].insert(offset);
+}
+
+VkResult allocateDeviceMemory(DeviceAllocator* allocator, VkDevice device, VkMemoryRequirements requirements,
+                              uint32_t memoryTypeIndex, bool hostVisible, DeviceAllocation* allocation) {
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    if (allocator->blockSize == 0) {
+        allocator->blockSize = ALLOCATOR_BLOCK_SIZE;
+    }
+
+    // Buddies are aligned to their own size, so rounding up to the alignment is enough
+    VkDeviceSize size = requirements.size > requirements.alignment ? requirements.size : requirements.alignment;
+    uint32_t order = orderForSize(size);
+    VkDeviceSize rounded = ALLOCATOR_MIN_SIZE << order;
+
+    memset(allocation, 0, sizeof(DeviceAllocation));
+    allocation->requested = requirements.size;
+
+    if (rounded <= allocator->blockSize) {
+        // Step 1: Try every existing block of the right memory type
+        MemoryBlock* block = NULL;
+        VkDeviceSize offset = 0;
+        for (MemoryBlock* candidate : allocator->blocks) {
+            if (candidate->memoryTypeIndex == memoryTypeIndex && (candidate->mapped != NULL) == hostVisible &&
+                allocateFromBlock(candidate, order, &offset)) {
+                block = candidate;
+                break;
+            }
+        }
+
+        // Step 2: Grow the pool by one block
+        if (block == NULL) {
+            block = createMemoryBlock(device, allocator->blockSize, memoryTypeIndex, hostVisible);
+            if (block != NULL) {
+                allocator->blocks.push_back(block);
+                allocateFromBlock(block, order, &offset);
+            }
+        }
+
+        if (block != NULL) {
+            allocation->memory = block->memory;
+            allocation->offset = offset;
+            allocation->size = rounded;
+            allocation->mapped = block->mapped != NULL ? (char*)block->mapped + offset : NULL;
+            allocation->block = block;
+        }
+    }
+
+    // Step 3: Oversized requests, or a heap too small for a full block, get their own memory
+    if (allocation->block == NULL) {
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = requirements.size;
+        allocInfo.memoryTypeIndex = memoryTypeIndex;
+
+        if (vkAllocateMemory(device, &allocInfo, nullptr, &allocation->memory) != VK_SUCCESS) {
+            return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+        }
+        if (hostVisible && vkMapMemory(device, allocation->memory, 0, requirements.size, 0, &allocation->mapped) != VK_SUCCESS) {
+            vkFreeMemory(device, allocation->memory, nullptr);
+            return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+        }
+
+        allocation->offset = 0;
+        allocation->size = requirements.size;
+        allocator->dedicatedCount++;
+        allocator->dedicatedBytes += requirements.size;
+    }
+
+    allocator->allocationCount++;
+    allocator->allocatedBytes += allocation->size;
+    allocator->requestedBytes += allocation->requested;
+    if (allocator->allocatedBytes > allocator->highWaterBytes) {
+        allocator->highWaterBytes = allocator->allocatedBytes;
+    }
+
+    return VK_SUCCESS;
+}
+
+// Wrap host memory in a VkDeviceMemory of its own. It takes no device memory, so
+// the allocator does not count it; the host memory must outlive the import.
+VkResult importHostMemory(VkDevice device, void* pointer, VkDeviceSize size, uint32_t memoryTypeIndex, DeviceAllocation* allocation) {
+    VkImportMemoryHostPointerInfoEXT importInfo{};
+    importInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+    importInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    importInfo.pHostPointer = pointer;
+
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.pNext = &importInfo;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memoryTypeIndex;
+
+    memset(allocation, 0, sizeof(DeviceAllocation));
+    VkResult result = vkAllocateMemory(device, &allocInfo, nullptr, &allocation->memory);
+    if (result != VK_SUCCESS) {
+        allocation->memory = VK_NULL_HANDLE;
+        return result;
+    }
+
+    allocation->size = size;
+    allocation->requested = size;
+    allocation->mapped = pointer;
+    allocation->imported = true;
+    return VK_SUCCESS;
+}
+
+void freeDeviceMemory(DeviceAllocator* allocator, VkDevice device, DeviceAllocation* allocation) {
+    if (allocation->memory == VK_NULL_HANDLE) {
+        return;
+    }
+    if (allocation->imported) {
+        vkFreeMemory(device, allocation->memory, nullptr);
+        memset(allocation, 0, sizeof(DeviceAllocation));
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    allocator->allocationCount--;
+    allocator->allocatedBytes -= allocation->size;
+    allocator->requestedBytes -= allocation->requested;
+
+    MemoryBlock* block = allocation->block;
+    if (block == NULL) {
+        if (allocation->mapped != NULL) {
+            vkUnmapMemory(device, allocation->memory);
+        }
+        vkFreeMemory(device, allocation->memory, nullptr);
+        allocator->dedicatedCount--;
+        allocator->dedicatedBytes -= allocation->size;
+    } else {
+        freeToBlock(block, allocation->offset, orderForSize(allocation->size));
+
+        // Release empty blocks, keeping one per memory type around for reuse
+        if (block->freeBytes == block->size) {
+            int emptyBlocks = 0;
+            for (MemoryBlock* candidate : allocator->blocks) {
+                if (candidate->memoryTypeIndex == block->memoryTypeIndex && candidate->freeBytes == candidate->size) {
+                    emptyBlocks++;
+                }
+            }
+            if (emptyBlocks > 1) {
+                for (size_t i = 0; i < allocator->blocks.size(); i++) {
+                    if (allocator->blocks[i] == block) {
+                        allocator->blocks.erase(allocator->blocks.begin() + i);
+                        break;
+                    }
+                }
+                destroyMemoryBlock(device, block);
+            }
+        }
+    }
+
+    memset(allocation, 0, sizeof(DeviceAllocation));
+}
+
+DeviceAllocatorStats getDeviceAllocatorStats(DeviceAllocator* allocator) {
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    DeviceAllocatorStats stats{};
+    stats.blockCount = allocator->blocks.size();
+    stats.dedicatedCount = allocator->dedicatedCount;
+    stats.allocationCount = allocator->allocationCount;
+    stats.reservedBytes = allocator->dedicatedBytes;
+    stats.allocatedBytes = allocator->allocatedBytes;
+    stats.requestedBytes = allocator->requestedBytes;
+    stats.highWaterBytes = allocator->highWaterBytes;
+
+    uint64_t freeBytes = 0;
+    for (MemoryBlock* block : allocator->blocks) {
+        stats.reservedBytes += block->size;
+        freeBytes += block->freeBytes;
+
+        for (size_t order = block->freeLists.size(); order-- > 0;) {
+            if (!block->freeLists[order].empty()) {
+                uint64_t largest = ALLOCATOR_MIN_SIZE << order;
+                if (largest > stats.largestFreeBytes) {
+                    stats.largestFreeBytes = largest;
+                }
+                break;
+            }
+        }
+    }
+
+    stats.fragmentation = freeBytes > 0 ? 1.0 - (double)stats.largestFreeBytes / freeBytes : 0.0;
+    return stats;
+}
+
+void printDeviceAllocatorStats(DeviceAllocator* allocator) {
+    DeviceAllocatorStats stats = getDeviceAllocatorStats(allocator);
+    printf("Vulkan memory: %llu blocks, %llu dedicated, %llu allocations\n",
+           (unsigned long long)stats.blockCount, (unsigned long long)stats.dedicatedCount,
+           (unsigned long long)stats.allocationCount);
+    printf("  reserved %llu B, allocated %llu B (requested %llu B), high water %llu B\n",
+           (unsigned long long)stats.reservedBytes, (unsigned long long)stats.allocatedBytes,
+           (unsigned long long)stats.requestedBytes, (unsigned long long)stats.highWaterBytes);
+    printf("  largest free %llu B, fragmentation %.1f%%\n",
+           (unsigned long long)stats.largestFreeBytes, stats.fragmentation * 100.0);
+}
@@ -0,0 +1,65 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <vulkan/vulkan.h>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#define ALLOCATOR_BLOCK_SIZE (64ull << 20)  // Size of each VkDeviceMemory block
+#define ALLOCATOR_MIN_SIZE 256ull           // Smallest sub-allocation handed out
+
+// Buddy allocator over a single VkDeviceMemory block
+struct MemoryBlock {
+    VkDeviceMemory memory;
+    uint32_t memoryTypeIndex;
+    void* mapped;  // Persistent mapping for host-visible blocks, NULL otherwise
+    VkDeviceSize size;
+    VkDeviceSize freeBytes;
+    std::vector<std::set<VkDeviceSize>> freeLists;  // Free offsets per order (ALLOCATOR_MIN_SIZE << order)
+};
+
+// A sub-range of device memory owned by a buffer
+typedef struct {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;       // Bytes reserved, rounded up to a power of two inside blocks
+    VkDeviceSize requested;  // Bytes asked for by the caller
+    void* mapped;            // Host pointer to offset for host-visible memory
+    MemoryBlock* block;      // NULL for dedicated and imported allocations
+    bool imported;           // Host memory imported through VK_EXT_external_memory_host
+} DeviceAllocation;
+
+typedef struct {
+    uint64_t blockCount;        // Pooled VkDeviceMemory blocks
+    uint64_t dedicatedCount;    // Allocations too large for a block
+    uint64_t allocationCount;   // Live sub-allocations
+    uint64_t reservedBytes;     // Bytes obtained from vkAllocateMemory
+    uint64_t allocatedBytes;    // Bytes handed out, including rounding
+    uint64_t requestedBytes;    // Bytes asked for by callers
+    uint64_t highWaterBytes;    // Peak of allocatedBytes
+    uint64_t largestFreeBytes;  // Largest allocation that fits without a new block
+    double fragmentation;       // 1 - largestFreeBytes / free bytes in blocks
+    uint64_t cachedBytes;       // Part of allocatedBytes held by freed tensor buffers kept for reuse
+} DeviceAllocatorStats;
+
+typedef struct {
+    std::mutex mutex;  // Tensors are created and destroyed from any thread
+    VkDeviceSize blockSize;
+    std::vector<MemoryBlock*> blocks;
+    uint64_t dedicatedCount;
+    uint64_t dedicatedBytes;
+    uint64_t allocationCount;
+    uint64_t allocatedBytes;
+    uint64_t requestedBytes;
+    uint64_t highWaterBytes;
+} DeviceAllocator;
+
+VkResult allocateDeviceMemory(DeviceAllocator* allocator, VkDevice device, VkMemoryRequirements requirements,
+                              uint32_t memoryTypeIndex, bool hostVisible, DeviceAllocation* allocation);
+VkResult importHostMemory(VkDevice device, void* pointer, VkDeviceSize size, uint32_t memoryTypeIndex, DeviceAllocation* allocation);
+void freeDeviceMemory(DeviceAllocator* allocator, VkDevice device, DeviceAllocation* allocation);
+DeviceAllocatorStats getDeviceAllocatorStats(DeviceAllocator* allocator);
+void printDeviceAllocatorStats(DeviceAllocator* allocator);
+
+#endif /* ALLOCATOR_H */
@@ -0,0 +1,342 @@
+#include "autograd.h"
+#include "vulkan.h"
+#include "profiler.h"
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+static int grad_enabled = 1;
+
+static bool is_vulkan(Tensor* tensor) {
+    return strcmp(tensor->device, "vulkan") == 0;
+}
+
+static bool same_shape(Tensor* tensor1, Tensor* tensor2) {
+    if (tensor1->ndim != tensor2->ndim) {
+        return false;
+    }
+    for (int i = 0; i < tensor1->ndim; i++) {
+        if (tensor1->shape[i] != tensor2->shape[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// New tensor with every element set to value
+static Tensor* full_tensor(const int* shape, int ndim, const char* device, DType dtype, float value) {
+    Tensor* tensor = empty_tensor(shape, ndim, device, dtype);
+
+    // The element's bits, repeated to fill a 32-bit word
+    size_t element = dtype_size(dtype);
+    uint32_t bits = 0;
+    store_from_float(dtype, &value, &bits, 1);
+    for (size_t filled = element; filled < sizeof(bits); filled *= 2) {
+        bits |= bits << (8 * filled);
+    }
+
+    if (is_vulkan(tensor)) {
+        tensor->ready_serial = fillBuffer(getVulkanContext(), tensor->buffer, tensorBufferSize(tensor), bits);
+    } else {
+        for (int i = 0; i < tensor->size; i++) {
+            memcpy((char*)tensor->data + i * element, &bits, element);
+        }
+    }
+    return tensor;
+}
+
+static Tensor* full_like(Tensor* like, float value) {
+    return full_tensor(like->shape, like->ndim, like->device, like->dtype, value);
+}
+
+// dst += src (or dst -= src when negate is set), in place on the tensors' device.
+// dst may be a strided view.
+static void accumulate(Tensor* dst, Tensor* src, bool negate) {
+    if (is_vulkan(dst) && negate) {
+        sub_tensor_vulkan(dst, src, dst);
+    } else if (is_vulkan(dst)) {
+        add_tensor_vulkan(dst, src, dst);
+    } else if (negate) {
+        sub_tensor_cpu(dst, src, dst);
+    } else {
+        add_tensor_cpu(dst, src, dst);
+    }
+}
+
+// Add a contribution to the gradient slot of a tensor. When owned is set the
+// contribution may be adopted as the slot itself instead of being copied.
+// Gradients are kept in the dtype of the tensor they belong to.
+static void add_to_grad(std::unordered_map<Tensor*, Tensor*>& grads, Tensor* tensor, Tensor* contribution,
+                        bool negate, bool* owned) {
+    if (contribution->dtype != tensor->dtype) {
+        bool converted_owned = true;
+        Tensor* converted = convert_tensor(contribution, tensor->dtype);
+        add_to_grad(grads, tensor, converted, negate, &converted_owned);
+        if (converted_owned) {
+            destroy_tensor(converted);
+        }
+        return;
+    }
+
+    auto it = grads.find(tensor);
+    if (it != grads.end()) {
+        accumulate(it->second, contribution, negate);
+    } else if (!negate && *owned) {
+        grads[tensor] = contribution;
+        *owned = false;
+    } else {
+        Tensor* slot = full_like(contribution, 0.0f);
+        accumulate(slot, contribution, negate);
+        grads[tensor] = slot;
+    }
+}
+
+// Post-order over the tape so every tensor comes after the tensors it produced
+static void topo_sort(Tensor* tensor, std::unordered_set<Tensor*>& visited, std::vector<Tensor*>& order) {
+    if (!visited.insert(tensor).second) {
+        return;
+    }
+    if (tensor->grad_fn != NULL) {
+        for (int i = 0; i < tensor->grad_fn->input_count; i++) {
+            if (tensor->grad_fn->inputs[i]->requires_grad) {
+                topo_sort(tensor->grad_fn->inputs[i], visited, order);
+            }
+        }
+    }
+    order.push_back(tensor);
+}
+
+bool records_grad(Tensor* input1, Tensor* input2) {
+    return grad_enabled && (input1->requires_grad || (input2 != NULL && input2->requires_grad));
+}
+
+void record_grad(Tensor* result, GradOp op, Tensor* input1, Tensor* input2) {
+    if (!records_grad(input1, input2)) {
+        return;
+    }
+
+    GradNode* node = (GradNode*)malloc(sizeof(GradNode));
+    if (node == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    node->op = op;
+    node->inputs[0] = input1;
+    node->inputs[1] = input2;
+    node->input_count = input2 != NULL ? 2 : 1;
+    for (int i = 0; i < node->input_count; i++) {
+        retain_tensor(node->inputs[i]);  // Backward reads the inputs after the caller may have freed them
+        node->input_versions[i] = node->inputs[i]->storage->version;
+    }
+    node->view_strides = NULL;
+    node->view_offset = 0;
+    node->scale = 1.0f;
+
+    result->requires_grad = 1;
+    result->grad_fn = node;
+}
+
+void record_view_grad(Tensor* result, Tensor* input, const int* strides, int offset) {
+    record_grad(result, GRAD_VIEW, input, NULL);
+    if (result->grad_fn == NULL) {
+        return;
+    }
+
+    int* copy = (int*)malloc((result->ndim > 0 ? result->ndim : 1) * sizeof(int));
+    if (copy == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(copy, strides, result->ndim * sizeof(int));
+    result->grad_fn->view_strides = copy;
+    result->grad_fn->view_offset = offset;
+}
+
+void record_reduce_grad(Tensor* result, Tensor* input, const int* strides, float scale) {
+    record_grad(result, GRAD_REDUCE, input, NULL);
+    if (result->grad_fn == NULL) {
+        return;
+    }
+
+    int* copy = (int*)malloc((input->ndim > 0 ? input->ndim : 1) * sizeof(int));
+    if (copy == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(copy, strides, input->ndim * sizeof(int));
+    result->grad_fn->view_strides = copy;
+    result->grad_fn->scale = scale;
+}
+
+void free_grad_node(GradNode* node) {
+    if (node != NULL) {
+        for (int i = 0; i < node->input_count; i++) {
+            destroy_tensor(node->inputs[i]);
+        }
+        free(node->view_strides);
+        free(node);
+    }
+}
+
+// Gradient of a view's input: the view's gradient scattered into zeros through
+// the same view of a contiguous tensor shaped like the input
+static Tensor* view_backward(GradNode* node, Tensor* grad) {
+    Tensor* input = node->inputs[0];
+    Tensor* contribution = full_tensor(input->shape, input->ndim, input->device, grad->dtype, 0.0f);
+
+    Tensor* window = make_view(contribution, grad->shape, node->view_strides, grad->ndim, node->view_offset);
+    accumulate(window, grad, false);
+    contribution->ready_serial = window->ready_serial;
+    destroy_tensor(window);
+
+    return contribution;
+}
+
+// Gradient of a sum or mean's input: the output's gradient, scaled for a mean,
+// repeated along the reduced dimensions
+static Tensor* reduce_backward(GradNode* node, Tensor* grad) {
+    Tensor* input = node->inputs[0];
+    Tensor* scaled = node->scale != 1.0f ? scale_tensor(grad, node->scale) : grad;
+
+    Tensor* window = make_view(scaled, input->shape, node->view_strides, input->ndim, scaled->offset);
+    Tensor* contribution = copy_tensor(window);
+    destroy_tensor(window);
+
+    if (scaled != grad) {
+        destroy_tensor(scaled);
+    }
+    return contribution;
+}
+
+extern "C" {
+    void set_requires_grad(Tensor* tensor, int requires_grad) {
+        tensor->requires_grad = requires_grad;
+    }
+
+    // Ops run while disabled (e.g. optimizer updates) are not recorded
+    void set_grad_enabled(int enabled) {
+        grad_enabled = enabled;
+    }
+
+    // Propagate d(tensor)/d(leaf) to every leaf that requires grad, seeding with ones.
+    // Gradients of intermediate tensors are freed as soon as they have been propagated.
+    void backward(Tensor* tensor) {
+        PROFILE_SCOPE("backward");
+
+        if (!tensor->requires_grad) {
+            fprintf(stderr, "Tensor does not require grad\n");
+            exit(1);
+        }
+
+        std::unordered_set<Tensor*> visited;
+        std::vector<Tensor*> order;
+        topo_sort(tensor, visited, order);
+
+        std::unordered_map<Tensor*, Tensor*> grads;
+        grads[tensor] = full_like(tensor, 1.0f);
+
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            Tensor* current = *it;
+            auto slot = grads.find(current);
+            if (slot == grads.end()) {
+                continue;
+            }
+            Tensor* grad = slot->second;
+            grads.erase(slot);
+
+            // Leaves keep their gradient, accumulating across backward calls
+            if (current->grad_fn == NULL) {
+                if (current->grad == NULL) {
+                    current->grad = grad;
+                } else {
+                    accumulate(current->grad, grad, false);
+                    destroy_tensor(grad);
+                }
+                continue;
+            }
+
+            GradNode* node = current->grad_fn;
+            bool owned = true;
+            if (node->op == GRAD_MATMUL) {
+                // The only backward that reads input values; the others need shapes alone
+                for (int i = 0; i < node->input_count; i++) {
+                    if (node->inputs[i]->storage->version != node->input_versions[i]) {
+                        fprintf(stderr, "A tensor matmul saved for backward has been modified by an in-place op\n");
+                        exit(1);
+                    }
+                }
+
+                // C = A @ B: dA = dC @ B^T and dB = A^T @ dC
+                Tensor* a = node->inputs[0];
+                Tensor* b = node->inputs[1];
+                if (a->requires_grad) {
+                    bool contribution_owned = true;
+                    Tensor* contribution = gemm_tensor(grad, b, false, true);
+                    add_to_grad(grads, a, contribution, false, &contribution_owned);
+                    if (contribution_owned) {
+                        destroy_tensor(contribution);
+                    }
+                }
+                if (b->requires_grad) {
+                    bool contribution_owned = true;
+                    Tensor* contribution = gemm_tensor(a, grad, true, false);
+                    add_to_grad(grads, b, contribution, false, &contribution_owned);
+                    if (contribution_owned) {
+                        destroy_tensor(contribution);
+                    }
+                }
+            } else if (node->op == GRAD_VIEW || node->op == GRAD_EXPAND || node->op == GRAD_REDUCE) {
+                // Expanded elements were read several times, so their gradients are summed
+                Tensor* input = node->inputs[0];
+                bool contribution_owned = true;
+                Tensor* contribution = node->op == GRAD_VIEW     ? view_backward(node, grad)
+                                       : node->op == GRAD_REDUCE ? reduce_backward(node, grad)
+                                                                 : sum_to_shape(grad, input->shape, input->ndim);
+                add_to_grad(grads, input, contribution, false, &contribution_owned);
+                if (contribution_owned) {
+                    destroy_tensor(contribution);
+                }
+            } else {
+                // Add, sub and casts are linear, so each input receives +grad or -grad,
+                // summed over the dimensions it was broadcast along. add_to_grad casts
+                // the gradient back to the input's dtype.
+                for (int i = 0; i < node->input_count; i++) {
+                    Tensor* input = node->inputs[i];
+                    if (!input->requires_grad) {
+                        continue;
+                    }
+                    bool negate = node->op == GRAD_SUB && i == 1;
+                    if (same_shape(input, grad)) {
+                        add_to_grad(grads, input, grad, negate, &owned);
+                    } else {
+                        bool reduced_owned = true;
+                        Tensor* reduced = sum_to_shape(grad, input->shape, input->ndim);
+                        add_to_grad(grads, input, reduced, negate, &reduced_owned);
+                        if (reduced_owned) {
+                            destroy_tensor(reduced);
+                        }
+                    }
+                }
+            }
+
+            if (owned) {
+                destroy_tensor(grad);
+            }
+        }
+    }
+
+    Tensor* get_grad(Tensor* tensor) {
+        return tensor->grad;
+    }
+
+    void zero_grad(Tensor* tensor) {
+        if (tensor->grad != NULL) {
+            destroy_tensor(tensor->grad);
+            tensor->grad = NULL;
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef AUTOGRAD_H
+#define AUTOGRAD_H
+
+#include "tensor.h"
+
+#define GRAD_MAX_INPUTS 2
+
+typedef enum {
+    GRAD_ADD,
+    GRAD_SUB,
+    GRAD_MATMUL,  // matmul and bmm
+    GRAD_VIEW,    // slice, transpose, permute, reshape, contiguous
+    GRAD_EXPAND,
+    GRAD_REDUCE,  // sum and mean
+    GRAD_CAST,    // to_dtype between floating point types
+} GradOp;
+
+// Tape entry: the op that produced a tensor and the tensors it read
+typedef struct GradNode {
+    GradOp op;
+    Tensor* inputs[GRAD_MAX_INPUTS];
+    unsigned input_versions[GRAD_MAX_INPUTS];  // Storage versions of the inputs when recorded
+    int input_count;
+
+    // GRAD_VIEW: where the output sits in a contiguous tensor shaped like the input.
+    // GRAD_REDUCE: strides that read the output at every input element.
+    int* view_strides;
+    int view_offset;
+    float scale;  // GRAD_REDUCE: d(output)/d(input), 1 for sum and 1/count for mean
+} GradNode;
+
+extern "C" {
+    void set_requires_grad(Tensor* tensor, int requires_grad);
+    void set_grad_enabled(int enabled);
+    void backward(Tensor* tensor);
+    Tensor* get_grad(Tensor* tensor);
+    void zero_grad(Tensor* tensor);
+}
+
+// Whether an op reading these tensors (input2 may be NULL) is recorded for backward
+bool records_grad(Tensor* input1, Tensor* input2);
+
+// Called by ops after computing their result
+void record_grad(Tensor* result, GradOp op, Tensor* input1, Tensor* input2);
+void record_view_grad(Tensor* result, Tensor* input, const int* strides, int offset);
+void record_reduce_grad(Tensor* result, Tensor* input, const int* strides, float scale);
+void free_grad_node(GradNode* node);
+
+#endif /* AUTOGRAD_H */
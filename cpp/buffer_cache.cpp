@@ -0,0 +1,58 @@
+#include "buffer_cache.h"
+
+// Size a request is rounded up to. Buffers that fit in a pooled block get a power
+// of two, which the buddy allocator reserves anyway; larger ones round to a
+// multiple of BUFFER_CACHE_LARGE_ROUNDING so a slightly smaller tensor still hits.
+VkDeviceSize bufferCacheBucket(VkDeviceSize size) {
+    if (size > ALLOCATOR_BLOCK_SIZE) {
+        return (size + BUFFER_CACHE_LARGE_ROUNDING - 1) / BUFFER_CACHE_LARGE_ROUNDING * BUFFER_CACHE_LARGE_ROUNDING;
+    }
+    VkDeviceSize bucket = BUFFER_CACHE_MIN_BUCKET;
+    while (bucket < size) {
+        bucket <<= 1;
+    }
+    return bucket;
+}
+
+bool takeCachedBuffer(BufferCache* cache, VkDeviceSize bucket, VkBuffer& buffer, DeviceAllocation& allocation) {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    auto it = cache->buckets.find(bucket);
+    if (it == cache->buckets.end() || it->second.empty()) {
+        return false;
+    }
+
+    CachedBuffer cached = it->second.back();
+    it->second.pop_back();
+    cache->cachedBytes -= bucket;
+    buffer = cached.buffer;
+    allocation = cached.allocation;
+    return true;
+}
+
+// Record the bucket a newly created buffer was sized for, so it can be cached when freed
+void trackCachedBuffer(BufferCache* cache, VkBuffer buffer, VkDeviceSize bucket) {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->bucketOf[buffer] = bucket;
+}
+
+void putCachedBuffer(BufferCache* cache, VkBuffer buffer, const DeviceAllocation& allocation) {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    VkDeviceSize bucket = cache->bucketOf.at(buffer);
+    cache->buckets[bucket].push_back({buffer, allocation});
+    cache->cachedBytes += bucket;
+}
+
+// Empty the cache, handing its buffers to the caller to destroy
+std::vector<CachedBuffer> drainBufferCache(BufferCache* cache) {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    std::vector<CachedBuffer> drained;
+    for (auto& bucket : cache->buckets) {
+        for (const CachedBuffer& cached : bucket.second) {
+            cache->bucketOf.erase(cached.buffer);
+            drained.push_back(cached);
+        }
+    }
+    cache->buckets.clear();
+    cache->cachedBytes = 0;
+    return drained;
+}
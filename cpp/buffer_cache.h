@@ -0,0 +1,38 @@
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include <vulkan/vulkan.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "allocator.h"
+
+#define BUFFER_CACHE_MIN_BUCKET 512ull        // Smallest bucket; tiny tensors share it
+#define BUFFER_CACHE_LARGE_ROUNDING (2ull << 20)  // Granularity of buckets too large for a block
+
+// A tensor buffer that is no longer used, bound to its memory and ready to hand out again
+typedef struct {
+    VkBuffer buffer;
+    DeviceAllocation allocation;
+} CachedBuffer;
+
+// Tensor buffers freed by their last user are kept, still bound to their
+// memory, instead of being destroyed. A new tensor of a size in the same bucket
+// takes one back without vkCreateBuffer or the allocator, and descriptor sets
+// cached for it stay valid. A loop that allocates the same shapes every
+// iteration therefore runs in constant memory once the first iteration is done.
+typedef struct {
+    std::mutex mutex;
+    bool enabled;
+    std::unordered_map<VkDeviceSize, std::vector<CachedBuffer>> buckets;  // Keyed by bucket size
+    std::unordered_map<VkBuffer, VkDeviceSize> bucketOf;  // Every buffer created for the cache, in use or not
+    VkDeviceSize cachedBytes;
+} BufferCache;
+
+VkDeviceSize bufferCacheBucket(VkDeviceSize size);
+bool takeCachedBuffer(BufferCache* cache, VkDeviceSize bucket, VkBuffer& buffer, DeviceAllocation& allocation);
+void trackCachedBuffer(BufferCache* cache, VkBuffer buffer, VkDeviceSize bucket);
+void putCachedBuffer(BufferCache* cache, VkBuffer buffer, const DeviceAllocation& allocation);
+std::vector<CachedBuffer> drainBufferCache(BufferCache* cache);
+
+#endif /* BUFFER_CACHE_H */
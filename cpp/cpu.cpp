@@ -1,17 +1,954 @@
 #include "tensor.h"
+#include "cpu.h"
+#include "threadpool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <algorithm>
+#include <vector>
 
-void add_tensor_cpu(Tensor* tensor1, Tensor* tensor2, float* result_data) {
-    for (int i = 0; i < tensor1->size; i++) {
-        result_data[i] = tensor1->data[i] + tensor2->data[i];
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define CPU_NEON 1
+#endif
+
+// Kernels for each instruction set are compiled with target attributes, so the
+// library itself needs no -m flags and picks the widest set the host supports
+// at runtime. Every kernel handles any length; tails fall back to scalar code.
+typedef void (*BinaryKernel)(const float* a, const float* b, float* c, int64_t n);
+typedef void (*Axpy4Kernel)(const float* a, const float* b, float* c0, float* c1, float* c2, float* c3, int64_t n);
+typedef float (*SumKernel)(const float* a, int64_t n);
+typedef void (*WidenKernel)(const uint16_t* src, float* dst, int64_t n);
+typedef void (*NarrowKernel)(const float* src, uint16_t* dst, int64_t n);
+
+typedef struct {
+    const char* isa;
+    BinaryKernel add;
+    BinaryKernel sub;
+    Axpy4Kernel axpy4;  // c_r[j] += a[r] * b[j] for four rows of C
+    SumKernel sum;      // Sum of a short block; long rows are split pairwise first
+
+    // 16-bit storage conversions; narrowing rounds to nearest even
+    WidenKernel widen_f16;
+    NarrowKernel narrow_f16;
+    WidenKernel widen_bf16;
+    NarrowKernel narrow_bf16;
+} CpuKernels;
+
+static void add_scalar(const float* a, const float* b, float* c, int64_t n) {
+    for (int64_t i = 0; i < n; i++) {
+        c[i] = a[i] + b[i];
+    }
+}
+
+static void sub_scalar(const float* a, const float* b, float* c, int64_t n) {
+    for (int64_t i = 0; i < n; i++) {
+        c[i] = a[i] - b[i];
+    }
+}
+
+static void axpy4_scalar(const float* a, const float* b, float* c0, float* c1, float* c2, float* c3, int64_t n) {
+    for (int64_t j = 0; j < n; j++) {
+        c0[j] += a[0] * b[j];
+        c1[j] += a[1] * b[j];
+        c2[j] += a[2] * b[j];
+        c3[j] += a[3] * b[j];
+    }
+}
+
+static float sum_scalar(const float* a, int64_t n) {
+    float sum = 0.0f;
+    for (int64_t i = 0; i < n; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+static float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13);  // Inf or NaN
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else {
+        // Zero or subnormal: mantissa * 2^-24 is exact in fp32
+        float value = (float)mantissa * (1.0f / 16777216.0f);
+        memcpy(&bits, &value, sizeof(bits));
+        bits |= sign;
+    }
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+static uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t magnitude = bits & 0x7FFFFFFF;
+
+    if (magnitude > 0x7F800000) {
+        return sign | 0x7E00;  // NaN
+    }
+    if (magnitude >= 0x477FF000) {
+        return sign | 0x7C00;  // Rounds past 65504 to infinity
+    }
+    if (magnitude < 0x38800000) {
+        // Below the smallest normal half: the subnormal mantissa is value * 2^24
+        float scaled;
+        memcpy(&scaled, &magnitude, sizeof(scaled));
+        return sign | (uint16_t)rintf(scaled * 16777216.0f);
+    }
+    // Rebias the exponent and round the mantissa to 10 bits; a carry bumps the exponent
+    uint32_t rounded = magnitude + 0xFFF + ((magnitude >> 13) & 1);
+    return sign | (uint16_t)((rounded - (112u << 23)) >> 13);
+}
+
+static float bfloat16_to_float(uint16_t h) {
+    uint32_t bits = (uint32_t)h << 16;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+static uint16_t float_to_bfloat16(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) {
+        return (uint16_t)((bits >> 16) | 0x40);  // Keep NaNs quiet
+    }
+    return (uint16_t)((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+static void widen_f16_scalar(const uint16_t* src, float* dst, int64_t n) {
+    for (int64_t i = 0; i < n; i++) {
+        dst[i] = half_to_float(src[i]);
+    }
+}
+
+static void narrow_f16_scalar(const float* src, uint16_t* dst, int64_t n) {
+    for (int64_t i = 0; i < n; i++) {
+        dst[i] = float_to_half(src[i]);
+    }
+}
+
+static void widen_bf16_scalar(const uint16_t* src, float* dst, int64_t n) {
+    for (int64_t i = 0; i < n; i++) {
+        dst[i] = bfloat16_to_float(src[i]);
+    }
+}
+
+static void narrow_bf16_scalar(const float* src, uint16_t* dst, int64_t n) {
+    for (int64_t i = 0; i < n; i++) {
+        dst[i] = float_to_bfloat16(src[i]);
+    }
+}
+
+#ifdef CPU_X86
+__attribute__((target("avx2"))) static void add_avx2(const float* a, const float* b, float* c, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(c + i, _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    add_scalar(a + i, b + i, c + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void sub_avx2(const float* a, const float* b, float* c, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(c + i, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    sub_scalar(a + i, b + i, c + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) static void axpy4_avx2(const float* a, const float* b, float* c0, float* c1, float* c2,
+                                                           float* c3, int64_t n) {
+    __m256 a0 = _mm256_set1_ps(a[0]);
+    __m256 a1 = _mm256_set1_ps(a[1]);
+    __m256 a2 = _mm256_set1_ps(a[2]);
+    __m256 a3 = _mm256_set1_ps(a[3]);
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m256 bv = _mm256_loadu_ps(b + j);
+        _mm256_storeu_ps(c0 + j, _mm256_fmadd_ps(a0, bv, _mm256_loadu_ps(c0 + j)));
+        _mm256_storeu_ps(c1 + j, _mm256_fmadd_ps(a1, bv, _mm256_loadu_ps(c1 + j)));
+        _mm256_storeu_ps(c2 + j, _mm256_fmadd_ps(a2, bv, _mm256_loadu_ps(c2 + j)));
+        _mm256_storeu_ps(c3 + j, _mm256_fmadd_ps(a3, bv, _mm256_loadu_ps(c3 + j)));
+    }
+    axpy4_scalar(a, b + j, c0 + j, c1 + j, c2 + j, c3 + j, n - j);
+}
+
+__attribute__((target("avx2"))) static float sum_avx2(const float* a, int64_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(a + i));
+        acc1 = _mm256_add_ps(acc1, _mm256_loadu_ps(a + i + 8));
     }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_movehdup_ps(half));
+    return _mm_cvtss_f32(half) + sum_scalar(a + i, n - i);
 }
 
-void sub_tensor_cpu(Tensor* tensor1, Tensor* tensor2, float* result_data) {
-    for (int i = 0; i < tensor1->size; i++) {
-        result_data[i] = tensor1->data[i] - tensor2->data[i];
+__attribute__((target("avx2,f16c"))) static void widen_f16_avx2(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
     }
-}
\ No newline at end of file
+    widen_f16_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2,f16c"))) static void narrow_f16_avx2(const float* src, uint16_t* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    narrow_f16_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void widen_bf16_avx2(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16)));
+    }
+    widen_bf16_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void narrow_bf16_avx2(const float* src, uint16_t* dst, int64_t n) {
+    const __m256i bias = _mm256_set1_epi32(0x7FFF);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i quiet_nan = _mm256_set1_epi32(0x7FC0);
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 value = _mm256_loadu_ps(src + i);
+        __m256i bits = _mm256_castps_si256(value);
+        __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+        __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(bias, lsb)), 16);
+        __m256 nan = _mm256_cmp_ps(value, value, _CMP_UNORD_Q);
+        rounded = _mm256_blendv_epi8(rounded, quiet_nan, _mm256_castps_si256(nan));
+        __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1));
+        _mm_storeu_si128((__m128i*)(dst + i), packed);
+    }
+    narrow_bf16_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void add_avx512(const float* a, const float* b, float* c, int64_t n) {
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(c + i, _mm512_add_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+    }
+    add_scalar(a + i, b + i, c + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void sub_avx512(const float* a, const float* b, float* c, int64_t n) {
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(c + i, _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+    }
+    sub_scalar(a + i, b + i, c + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void axpy4_avx512(const float* a, const float* b, float* c0, float* c1, float* c2,
+                                                            float* c3, int64_t n) {
+    __m512 a0 = _mm512_set1_ps(a[0]);
+    __m512 a1 = _mm512_set1_ps(a[1]);
+    __m512 a2 = _mm512_set1_ps(a[2]);
+    __m512 a3 = _mm512_set1_ps(a[3]);
+    int64_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m512 bv = _mm512_loadu_ps(b + j);
+        _mm512_storeu_ps(c0 + j, _mm512_fmadd_ps(a0, bv, _mm512_loadu_ps(c0 + j)));
+        _mm512_storeu_ps(c1 + j, _mm512_fmadd_ps(a1, bv, _mm512_loadu_ps(c1 + j)));
+        _mm512_storeu_ps(c2 + j, _mm512_fmadd_ps(a2, bv, _mm512_loadu_ps(c2 + j)));
+        _mm512_storeu_ps(c3 + j, _mm512_fmadd_ps(a3, bv, _mm512_loadu_ps(c3 + j)));
+    }
+    axpy4_scalar(a, b + j, c0 + j, c1 + j, c2 + j, c3 + j, n - j);
+}
+
+__attribute__((target("avx512f"))) static float sum_avx512(const float* a, int64_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int64_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_add_ps(acc0, _mm512_loadu_ps(a + i));
+        acc1 = _mm512_add_ps(acc1, _mm512_loadu_ps(a + i + 16));
+    }
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, _mm512_add_ps(acc0, acc1));
+    return sum_scalar(lanes, 16) + sum_scalar(a + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void widen_f16_avx512(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(src + i))));
+    }
+    widen_f16_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void narrow_f16_avx512(const float* src, uint16_t* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    narrow_f16_scalar(src + i, dst + i, n - i);
+}
+#endif
+
+#ifdef CPU_NEON
+static void add_neon(const float* a, const float* b, float* c, int64_t n) {
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(c + i, vaddq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+    }
+    add_scalar(a + i, b + i, c + i, n - i);
+}
+
+static void sub_neon(const float* a, const float* b, float* c, int64_t n) {
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(c + i, vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+    }
+    sub_scalar(a + i, b + i, c + i, n - i);
+}
+
+static void axpy4_neon(const float* a, const float* b, float* c0, float* c1, float* c2, float* c3, int64_t n) {
+    int64_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        float32x4_t bv = vld1q_f32(b + j);
+        vst1q_f32(c0 + j, vfmaq_n_f32(vld1q_f32(c0 + j), bv, a[0]));
+        vst1q_f32(c1 + j, vfmaq_n_f32(vld1q_f32(c1 + j), bv, a[1]));
+        vst1q_f32(c2 + j, vfmaq_n_f32(vld1q_f32(c2 + j), bv, a[2]));
+        vst1q_f32(c3 + j, vfmaq_n_f32(vld1q_f32(c3 + j), bv, a[3]));
+    }
+    axpy4_scalar(a, b + j, c0 + j, c1 + j, c2 + j, c3 + j, n - j);
+}
+
+static float sum_neon(const float* a, int64_t n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vaddq_f32(acc0, vld1q_f32(a + i));
+        acc1 = vaddq_f32(acc1, vld1q_f32(a + i + 4));
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + sum_scalar(a + i, n - i);
+}
+
+static void widen_f16_neon(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+    }
+    widen_f16_scalar(src + i, dst + i, n - i);
+}
+
+static void narrow_f16_neon(const float* src, uint16_t* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+    }
+    narrow_f16_scalar(src + i, dst + i, n - i);
+}
+
+static void widen_bf16_neon(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i, vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(src + i), 16)));
+    }
+    widen_bf16_scalar(src + i, dst + i, n - i);
+}
+
+static void narrow_bf16_neon(const float* src, uint16_t* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t value = vld1q_f32(src + i);
+        uint32x4_t bits = vreinterpretq_u32_f32(value);
+        uint32x4_t lsb = vandq_u32(vshrq_n_u32(bits, 16), vdupq_n_u32(1));
+        uint32x4_t rounded = vshrq_n_u32(vaddq_u32(bits, vaddq_u32(lsb, vdupq_n_u32(0x7FFF))), 16);
+        rounded = vbslq_u32(vceqq_f32(value, value), rounded, vdupq_n_u32(0x7FC0));
+        vst1_u16(dst + i, vmovn_u32(rounded));
+    }
+    narrow_bf16_scalar(src + i, dst + i, n - i);
+}
+#endif
+
+// Pick the widest supported kernels. VKGRAD_CPU_ISA=scalar|avx2|avx512|neon
+// caps the choice, e.g. to compare against the scalar path.
+static CpuKernels select_kernels() {
+    const char* cap = getenv("VKGRAD_CPU_ISA");
+
+#ifdef CPU_X86
+    __builtin_cpu_init();
+    bool allow_avx512 = cap == NULL || strcmp(cap, "avx512") == 0;
+    bool allow_avx2 = allow_avx512 || strcmp(cap, "avx2") == 0;
+    if (allow_avx512 && __builtin_cpu_supports("avx512f")) {
+        return {"avx512", add_avx512, sub_avx512, axpy4_avx512, sum_avx512, widen_f16_avx512, narrow_f16_avx512, widen_bf16_avx2,
+                narrow_bf16_avx2};
+    }
+    if (allow_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+        return {"avx2", add_avx2, sub_avx2, axpy4_avx2, sum_avx2, widen_f16_avx2, narrow_f16_avx2, widen_bf16_avx2, narrow_bf16_avx2};
+    }
+#endif
+#ifdef CPU_NEON
+    if (cap == NULL || strcmp(cap, "neon") == 0) {
+        return {"neon", add_neon, sub_neon, axpy4_neon, sum_neon, widen_f16_neon, narrow_f16_neon, widen_bf16_neon, narrow_bf16_neon};
+    }
+#endif
+    return {"scalar", add_scalar, sub_scalar, axpy4_scalar, sum_scalar, widen_f16_scalar, narrow_f16_scalar, widen_bf16_scalar,
+            narrow_bf16_scalar};
+}
+
+static const CpuKernels* get_cpu_kernels() {
+    static CpuKernels kernels = select_kernels();
+    return &kernels;
+}
+
+const char* cpu_kernel_isa() {
+    return get_cpu_kernels()->isa;
+}
+
+void load_as_float(DType dtype, const void* src, float* dst, int64_t n) {
+    const CpuKernels* kernels = get_cpu_kernels();
+    switch (dtype) {
+    case DTYPE_FLOAT32:
+        memcpy(dst, src, n * sizeof(float));
+        break;
+    case DTYPE_FLOAT16:
+        kernels->widen_f16((const uint16_t*)src, dst, n);
+        break;
+    case DTYPE_BFLOAT16:
+        kernels->widen_bf16((const uint16_t*)src, dst, n);
+        break;
+    case DTYPE_INT32:
+        for (int64_t i = 0; i < n; i++) {
+            dst[i] = (float)((const int32_t*)src)[i];
+        }
+        break;
+    case DTYPE_INT8:
+        for (int64_t i = 0; i < n; i++) {
+            dst[i] = (float)((const int8_t*)src)[i];
+        }
+        break;
+    }
+}
+
+// Integer targets truncate toward zero and saturate; NaN becomes 0
+void store_from_float(DType dtype, const float* src, void* dst, int64_t n) {
+    const CpuKernels* kernels = get_cpu_kernels();
+    switch (dtype) {
+    case DTYPE_FLOAT32:
+        memcpy(dst, src, n * sizeof(float));
+        break;
+    case DTYPE_FLOAT16:
+        kernels->narrow_f16(src, (uint16_t*)dst, n);
+        break;
+    case DTYPE_BFLOAT16:
+        kernels->narrow_bf16(src, (uint16_t*)dst, n);
+        break;
+    case DTYPE_INT32:
+        for (int64_t i = 0; i < n; i++) {
+            float x = src[i] == src[i] ? src[i] : 0.0f;
+            ((int32_t*)dst)[i] = x >= 2147483648.0f ? INT32_MAX : (x <= -2147483648.0f ? INT32_MIN : (int32_t)x);
+        }
+        break;
+    case DTYPE_INT8:
+        for (int64_t i = 0; i < n; i++) {
+            float x = src[i] == src[i] ? src[i] : 0.0f;
+            ((int8_t*)dst)[i] = (int8_t)(x >= 127.0f ? 127.0f : (x <= -128.0f ? -128.0f : x));
+        }
+        break;
+    }
+}
+
+typedef enum {
+    ELEMENTWISE_ADD,
+    ELEMENTWISE_SUB,
+    ELEMENTWISE_COPY,     // Reads only the first input
+    ELEMENTWISE_CONVERT,  // Copy between dtypes, reading only the first input
+} ElementwiseOp;
+
+#define ELEMENTWISE_BLOCK 256  // Elements other dtypes are widened to fp32 at a time
+
+// Copy n elements of size bytes from a stride (in elements) to contiguous storage, or back
+static void gather_elements(const char* src, int64_t stride, int64_t n, size_t size, char* dst) {
+    for (int64_t j = 0; j < n; j++) {
+        memcpy(dst + j * size, src + j * stride * size, size);
+    }
+}
+
+static void scatter_elements(const char* src, int64_t n, size_t size, char* dst, int64_t stride) {
+    for (int64_t j = 0; j < n; j++) {
+        memcpy(dst + j * stride * size, src + j * size, size);
+    }
+}
+
+// Run an op over a strided layout whose operands are (a, b, c) or, for copies, (a, c).
+// a and b hold in_dtype and c holds out_dtype, which differ only for conversions.
+// Fully contiguous ops are split into ranges of elements; otherwise the outer
+// dimensions are split across threads and the innermost one is a SIMD kernel
+// call when every operand is unit-stride along it. Types other than fp32 are
+// widened a block at a time, computed in fp32 and narrowed on the way out.
+static void elementwise_cpu(ElementwiseOp op, const StridedLayout* layout, DType in_dtype, DType out_dtype, const void* a,
+                            const void* b, void* c) {
+    const CpuKernels* kernels = get_cpu_kernels();
+    bool unary = op == ELEMENTWISE_COPY || op == ELEMENTWISE_CONVERT;
+    int out = layout->count - 1;
+    int nd = layout->ndim;
+    int64_t n = layout->shape[nd - 1];
+    size_t in_size = dtype_size(in_dtype);
+    size_t out_size = dtype_size(out_dtype);
+
+    int64_t sa = layout->strides[0][nd - 1];
+    int64_t sb = unary ? 1 : layout->strides[1][nd - 1];
+    int64_t sc = layout->strides[out][nd - 1];
+    bool unit = sa == 1 && sb == 1 && sc == 1;
+
+    // Element offsets of the first element of each operand in a run
+    auto run = [&](int64_t oa, int64_t ob, int64_t oc, int64_t count) {
+        if (in_dtype == DTYPE_FLOAT32 && out_dtype == DTYPE_FLOAT32) {
+            const float* pa = (const float*)a + oa;
+            const float* pb = unary ? NULL : (const float*)b + ob;
+            float* pc = (float*)c + oc;
+            if (unit) {
+                if (op == ELEMENTWISE_ADD) {
+                    kernels->add(pa, pb, pc, count);
+                } else if (op == ELEMENTWISE_SUB) {
+                    kernels->sub(pa, pb, pc, count);
+                } else if (pa != pc) {
+                    memmove(pc, pa, count * sizeof(float));
+                }
+                return;
+            }
+            for (int64_t j = 0; j < count; j++) {
+                float x = pa[j * sa];
+                if (op == ELEMENTWISE_ADD) {
+                    pc[j * sc] = x + pb[j * sb];
+                } else if (op == ELEMENTWISE_SUB) {
+                    pc[j * sc] = x - pb[j * sb];
+                } else {
+                    pc[j * sc] = x;
+                }
+            }
+            return;
+        }
+
+        const char* pa = (const char*)a + oa * in_size;
+        const char* pb = unary ? NULL : (const char*)b + ob * in_size;
+        char* pc = (char*)c + oc * out_size;
+        if (op == ELEMENTWISE_COPY) {
+            // Same dtype: move the bytes without widening
+            if (unit && pa != pc) {
+                memmove(pc, pa, count * in_size);
+            } else if (!unit) {
+                for (int64_t j = 0; j < count; j++) {
+                    memcpy(pc + j * sc * in_size, pa + j * sa * in_size, in_size);
+                }
+            }
+            return;
+        }
+
+        float xa[ELEMENTWISE_BLOCK];
+        float xb[ELEMENTWISE_BLOCK];
+        char raw[ELEMENTWISE_BLOCK * sizeof(float)];
+        for (int64_t j0 = 0; j0 < count; j0 += ELEMENTWISE_BLOCK) {
+            int64_t block = std::min<int64_t>(ELEMENTWISE_BLOCK, count - j0);
+            if (sa == 1) {
+                load_as_float(in_dtype, pa + j0 * in_size, xa, block);
+            } else {
+                gather_elements(pa + j0 * sa * in_size, sa, block, in_size, raw);
+                load_as_float(in_dtype, raw, xa, block);
+            }
+            if (!unary) {
+                if (sb == 1) {
+                    load_as_float(in_dtype, pb + j0 * in_size, xb, block);
+                } else {
+                    gather_elements(pb + j0 * sb * in_size, sb, block, in_size, raw);
+                    load_as_float(in_dtype, raw, xb, block);
+                }
+            }
+
+            if (op == ELEMENTWISE_ADD) {
+                kernels->add(xa, xb, xa, block);
+            } else if (op == ELEMENTWISE_SUB) {
+                kernels->sub(xa, xb, xa, block);
+            }
+
+            if (sc == 1) {
+                store_from_float(out_dtype, xa, pc + j0 * out_size, block);
+            } else {
+                store_from_float(out_dtype, xa, raw, block);
+                scatter_elements(raw, block, out_size, pc + j0 * sc * out_size, sc);
+            }
+        }
+    };
+
+    if (nd == 1) {
+        int64_t oa = layout->offsets[0];
+        int64_t ob = unary ? 0 : layout->offsets[1];
+        int64_t oc = layout->offsets[out];
+        parallel_for(n, CPU_PARALLEL_GRAIN, [&](int64_t begin, int64_t end) {
+            run(oa + begin * sa, ob + begin * sb, oc + begin * sc, end - begin);
+        });
+        return;
+    }
+
+    int64_t rows = n > 0 ? layout->size / n : 0;
+    parallel_for(rows, std::max<int64_t>(1, CPU_PARALLEL_GRAIN / std::max<int64_t>(n, 1)), [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; row++) {
+            int64_t oa = layout->offsets[0];
+            int64_t ob = unary ? 0 : layout->offsets[1];
+            int64_t oc = layout->offsets[out];
+            int64_t rem = row;
+            for (int d = nd - 2; d >= 0; d--) {
+                int64_t coord = rem % layout->shape[d];
+                rem /= layout->shape[d];
+                oa += coord * layout->strides[0][d];
+                if (!unary) {
+                    ob += coord * layout->strides[1][d];
+                }
+                oc += coord * layout->strides[out][d];
+            }
+            run(oa, ob, oc, n);
+        }
+    });
+}
+
+static void binary_cpu(ElementwiseOp op, Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor) {
+    Tensor* operands[3] = {tensor1, tensor2, result_tensor};
+    StridedLayout layout;
+    strided_layout(&layout, result_tensor->shape, result_tensor->ndim, operands, 3);
+    elementwise_cpu(op, &layout, result_tensor->dtype, result_tensor->dtype, tensor1->data, tensor2->data, result_tensor->data);
+}
+
+void add_tensor_cpu(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor) {
+    binary_cpu(ELEMENTWISE_ADD, tensor1, tensor2, result_tensor);
+}
+
+void sub_tensor_cpu(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor) {
+    binary_cpu(ELEMENTWISE_SUB, tensor1, tensor2, result_tensor);
+}
+
+void copy_tensor_cpu(Tensor* src, Tensor* dst) {
+    Tensor* operands[2] = {src, dst};
+    StridedLayout layout;
+    strided_layout(&layout, dst->shape, dst->ndim, operands, 2);
+    ElementwiseOp op = src->dtype == dst->dtype ? ELEMENTWISE_COPY : ELEMENTWISE_CONVERT;
+    elementwise_cpu(op, &layout, src->dtype, dst->dtype, src->data, NULL, dst->data);
+}
+
+// dst[o] = sum of src over the dimensions dst broadcasts along. Dimensions line
+// up from the right; each output element sums its own slice, so outputs are
+// independent and split across threads.
+void sum_to_cpu(Tensor* src, Tensor* dst) {
+    int nd = src->ndim;
+    int lead = nd - dst->ndim;
+    std::vector<int> out_shape(nd), reduce_shape(nd);
+    int64_t reduce_count = 1;
+    for (int d = 0; d < nd; d++) {
+        out_shape[d] = d < lead ? 1 : dst->shape[d - lead];
+        reduce_shape[d] = out_shape[d] == 1 ? src->shape[d] : 1;
+        reduce_count *= reduce_shape[d];
+    }
+
+    const float* data = (const float*)src->data + src->offset;
+    parallel_for(dst->size, std::max<int64_t>(1, CPU_PARALLEL_GRAIN / std::max<int64_t>(reduce_count, 1)), [&](int64_t begin, int64_t end) {
+        for (int64_t o = begin; o < end; o++) {
+            int64_t base = 0;
+            int64_t rem = o;
+            for (int d = nd - 1; d >= 0; d--) {
+                base += (rem % out_shape[d]) * src->strides[d];
+                rem /= out_shape[d];
+            }
+
+            float sum = 0.0f;
+            for (int64_t r = 0; r < reduce_count; r++) {
+                int64_t index = base;
+                int64_t rest = r;
+                for (int d = nd - 1; d >= 0; d--) {
+                    index += (rest % reduce_shape[d]) * src->strides[d];
+                    rest /= reduce_shape[d];
+                }
+                sum += data[index];
+            }
+
+            // dst is freshly allocated and contiguous
+            ((float*)dst->data)[o] = sum;
+        }
+    });
+}
+
+void scale_tensor_cpu(const float* src, float* dst, int64_t n, float factor) {
+    parallel_for(n, CPU_PARALLEL_GRAIN, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+            dst[i] = src[i] * factor;
+        }
+    });
+}
+
+#define REDUCE_BLOCK 256       // Elements a SIMD sum kernel adds before rows are split pairwise
+#define REDUCE_ROW_BLOCK 8     // Rows accumulated directly before column sums are split pairwise
+#define REDUCE_COLUMNS 1024    // Columns of an (outer, reduce, inner) block handled per work item
+
+// Pairwise summation: the rounding error grows with log(n) rather than n, and
+// each leaf is a vectorised block sum
+static float pairwise_sum(const CpuKernels* kernels, const float* a, int64_t n) {
+    if (n <= REDUCE_BLOCK) {
+        return kernels->sum(a, n);
+    }
+    int64_t half = (n / 2 + REDUCE_BLOCK - 1) / REDUCE_BLOCK * REDUCE_BLOCK;
+    return pairwise_sum(kernels, a, half) + pairwise_sum(kernels, a + half, n - half);
+}
+
+// out[j] = sum over rows r of a[r * stride + j], split pairwise over the rows
+static void pairwise_sum_rows(const CpuKernels* kernels, const float* a, int64_t rows, int64_t stride, int64_t cols,
+                              float* out) {
+    if (rows <= REDUCE_ROW_BLOCK) {
+        memcpy(out, a, cols * sizeof(float));
+        for (int64_t r = 1; r < rows; r++) {
+            kernels->add(out, a + r * stride, out, cols);
+        }
+        return;
+    }
+
+    int64_t half = rows / 2;
+    std::vector<float> rest(cols);
+    pairwise_sum_rows(kernels, a, half, stride, cols, out);
+    pairwise_sum_rows(kernels, a + half * stride, rows - half, stride, cols, rest.data());
+    kernels->add(out, rest.data(), out, cols);
+}
+
+// Index of the first largest of n elements a[i * stride]. NaN counts as larger
+// than everything, as in reduce.comp, so the first NaN wins.
+static int64_t argmax_row(const float* a, int64_t n, int64_t stride) {
+    int64_t best = 0;
+    for (int64_t i = 1; i < n && !isnan(a[best * stride]); i++) {
+        if (a[i * stride] > a[best * stride] || isnan(a[i * stride])) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Reduce src, read as a contiguous (outer, reduce, inner) array, over its middle
+// dimension into the contiguous (outer, inner) dst. Sums are multiplied by scale
+// and argmax writes the int32 index of the first largest element.
+void reduce_cpu(ReduceOp op, const float* src, void* result, int64_t outer, int64_t reduce, int64_t inner, float scale) {
+    const CpuKernels* kernels = get_cpu_kernels();
+    float* dst = (float*)result;
+    int32_t* dst_indices = (int32_t*)result;
+    bool sums = op == REDUCE_SUM || op == REDUCE_MEAN;
+
+    if (inner == 1) {
+        // Each output reduces one contiguous row. When there are fewer rows than
+        // threads, long rows are also split into chunks whose results are combined after.
+        int64_t chunk = outer < cpu_thread_count() && reduce > CPU_PARALLEL_GRAIN ? CPU_PARALLEL_GRAIN : std::max<int64_t>(reduce, 1);
+        int64_t chunks = (reduce + chunk - 1) / chunk;
+        std::vector<float> values(outer * chunks);
+        std::vector<int64_t> indices(outer * chunks);
+
+        parallel_for(outer * chunks, std::max<int64_t>(1, CPU_PARALLEL_GRAIN / chunk), [&](int64_t begin, int64_t end) {
+            for (int64_t item = begin; item < end; item++) {
+                int64_t start = (item % chunks) * chunk;
+                int64_t count = std::min(chunk, reduce - start);
+                const float* row = src + (item / chunks) * reduce + start;
+                if (sums) {
+                    values[item] = pairwise_sum(kernels, row, count);
+                } else {
+                    int64_t index = argmax_row(row, count, 1);
+                    values[item] = row[index];
+                    indices[item] = start + index;
+                }
+            }
+        });
+
+        for (int64_t o = 0; o < outer; o++) {
+            const float* partial = values.data() + o * chunks;
+            if (sums) {
+                dst[o] = (chunks > 0 ? pairwise_sum(kernels, partial, chunks) : 0.0f) * scale;
+                continue;
+            }
+            int64_t best = argmax_row(partial, chunks, 1);
+            if (op == REDUCE_ARGMAX) {
+                dst_indices[o] = (int32_t)indices[o * chunks + best];
+            } else {
+                dst[o] = partial[best];
+            }
+        }
+        return;
+    }
+
+    // Otherwise every output column of a block is reduced together, so the
+    // reads along each row stay contiguous and sums use the SIMD add kernel
+    int64_t blocks = (inner + REDUCE_COLUMNS - 1) / REDUCE_COLUMNS;
+    int64_t work = std::max<int64_t>(reduce * std::min<int64_t>(inner, REDUCE_COLUMNS), 1);
+    parallel_for(outer * blocks, std::max<int64_t>(1, CPU_PARALLEL_GRAIN / work), [&](int64_t begin, int64_t end) {
+        std::vector<int64_t> indices;
+        for (int64_t item = begin; item < end; item++) {
+            int64_t o = item / blocks;
+            int64_t j0 = (item % blocks) * REDUCE_COLUMNS;
+            int64_t cols = std::min<int64_t>(REDUCE_COLUMNS, inner - j0);
+            const float* block = src + o * reduce * inner + j0;
+            float* out = dst + o * inner + j0;
+            int32_t* out_indices = dst_indices + o * inner + j0;
+
+            if (reduce == 0) {
+                for (int64_t j = 0; j < cols; j++) {
+                    out[j] = 0.0f;
+                }
+            } else if (sums) {
+                pairwise_sum_rows(kernels, block, reduce, inner, cols, out);
+                for (int64_t j = 0; scale != 1.0f && j < cols; j++) {
+                    out[j] *= scale;
+                }
+            } else {
+                indices.assign(cols, 0);
+                memcpy(out, block, cols * sizeof(float));
+                for (int64_t r = 1; r < reduce; r++) {
+                    const float* row = block + r * inner;
+                    for (int64_t j = 0; j < cols; j++) {
+                        if (row[j] > out[j] || (isnan(row[j]) && !isnan(out[j]))) {
+                            out[j] = row[j];
+                            indices[j] = r;
+                        }
+                    }
+                }
+                for (int64_t j = 0; op == REDUCE_ARGMAX && j < cols; j++) {
+                    out_indices[j] = (int32_t)indices[j];
+                }
+            }
+        }
+    });
+}
+
+// reduce_cpu's max and argmax for int32, whose values above 2^24 fp32 cannot
+// hold exactly. Argmax writes the index of the first largest element.
+void reduce_cpu_int32(ReduceOp op, const int32_t* src, int32_t* dst, int64_t outer, int64_t reduce, int64_t inner) {
+    int64_t grain = std::max<int64_t>(1, CPU_PARALLEL_GRAIN / std::max<int64_t>(reduce, 1));
+    parallel_for(outer * inner, grain, [&](int64_t begin, int64_t end) {
+        for (int64_t item = begin; item < end; item++) {
+            const int32_t* column = src + (item / inner) * reduce * inner + item % inner;
+            int64_t best = 0;
+            for (int64_t r = 1; r < reduce; r++) {
+                if (column[r * inner] > column[best * inner]) {
+                    best = r;
+                }
+            }
+            dst[item] = op == REDUCE_ARGMAX ? (int32_t)best : column[best * inner];
+        }
+    });
+}
+
+// Matmul blocking:a KC x NC panel of B is packed contiguously and reused for
+// every MC-row block of A, and rows are processed MR at a time so each panel
+// row is loaded once per MR output rows.
+#define MATMUL_MC 64
+#define MATMUL_KC 128
+#define MATMUL_NC 512
+#define MATMUL_MR 4
+#define MATMUL_PARALLEL_THRESHOLD (1 << 18)  // Multiply-adds below which one thread is used
+
+typedef struct {
+    const float* a;
+    const float* b;
+    float* c;
+    int m;
+    int n;
+    int k;
+    bool trans_a;
+    bool trans_b;
+} MatmulArgs;
+
+// c[0..rows) += a[r][p] * panel[p] over p, for up to MATMUL_MR rows of C at once.
+// Full row groups go through the vectorised axpy4 kernel.
+static void matmul_micro(const MatmulArgs* args, int row, int rows, int p0, int kb, int j0, int nb,
+                         const float* __restrict__ panel) {
+    Axpy4Kernel axpy4 = get_cpu_kernels()->axpy4;
+    float* __restrict__ c[MATMUL_MR];
+    for (int r = 0; r < rows; r++) {
+        c[r] = args->c + (row + r) * args->n + j0;
+    }
+
+    for (int p = 0; p < kb; p++) {
+        const float* __restrict__ b = panel + p * nb;
+        float av[MATMUL_MR];
+        for (int r = 0; r < rows; r++) {
+            av[r] = args->trans_a ? args->a[(p0 + p) * args->m + row + r] : args->a[(row + r) * args->k + p0 + p];
+        }
+
+        if (rows == MATMUL_MR) {
+            axpy4(av, b, c[0], c[1], c[2], c[3], nb);
+        } else {
+            for (int r = 0; r < rows; r++) {
+                float* __restrict__ cr = c[r];
+                for (int j = 0; j < nb; j++) {
+                    cr[j] += av[r] * b[j];
+                }
+            }
+        }
+    }
+}
+
+// Compute rows [row_begin, row_end) of one matrix product
+static void matmul_rows(const MatmulArgs* args, int row_begin, int row_end, float* panel) {
+    for (int i = row_begin; i < row_end; i++) {
+        memset(args->c + i * args->n, 0, args->n * sizeof(float));
+    }
+
+    for (int j0 = 0; j0 < args->n; j0 += MATMUL_NC) {
+        int nb = std::min(MATMUL_NC, args->n - j0);
+        for (int p0 = 0; p0 < args->k; p0 += MATMUL_KC) {
+            int kb = std::min(MATMUL_KC, args->k - p0);
+
+            // Pack B[p0:p0+kb, j0:j0+nb] row-major, undoing any transpose
+            for (int p = 0; p < kb; p++) {
+                for (int j = 0; j < nb; j++) {
+                    panel[p * nb + j] = args->trans_b ? args->b[(j0 + j) * args->k + p0 + p] : args->b[(p0 + p) * args->n + j0 + j];
+                }
+            }
+
+            for (int i = row_begin; i < row_end; i += MATMUL_MR) {
+                matmul_micro(args, i, std::min(MATMUL_MR, row_end - i), p0, kb, j0, nb, panel);
+            }
+        }
+    }
+}
+
+// C = op(A) * op(B) for batch row-major matrices packed back to back, where A is
+// m x k (k x m if trans_a), B is k x n (n x k if trans_b) and C is m x n.
+// Work is split into MATMUL_MC-row blocks across the thread pool.
+void matmul_cpu(const float* a, const float* b, float* c, int batch, int m, int n, int k, bool trans_a, bool trans_b) {
+    int row_blocks = (m + MATMUL_MC - 1) / MATMUL_MC;
+    int items = batch * row_blocks;
+
+    // Small products run on the calling thread
+    int64_t grain = (long long)batch * m * n * k >= MATMUL_PARALLEL_THRESHOLD ? 1 : items;
+    parallel_for(items, grain, [&](int64_t begin, int64_t end) {
+        float* panel = (float*)malloc(MATMUL_KC * MATMUL_NC * sizeof(float));
+        if (panel == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+
+        for (int64_t item = begin; item < end; item++) {
+            int batch_index = (int)(item / row_blocks);
+            int row_begin = (int)(item % row_blocks) * MATMUL_MC;
+            MatmulArgs args = {a + (size_t)batch_index * m * k, b + (size_t)batch_index * k * n,
+                               c + (size_t)batch_index * m * n, m, n, k, trans_a, trans_b};
+            matmul_rows(&args, row_begin, std::min(row_begin + MATMUL_MC, m), panel);
+        }
+
+        free(panel);
+    });
+}
@@ -3,7 +3,22 @@
 
 #include "tensor.h"
 
-void add_tensor_cpu(Tensor* tensor1, Tensor* tensor2, float* result_data);
-void sub_tensor_cpu(Tensor* tensor1, Tensor* tensor2, float* result_data);
+// Elementwise ops read and write strided tensors, including views of the same storage
+void add_tensor_cpu(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor);
+void sub_tensor_cpu(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor);
+void copy_tensor_cpu(Tensor* src, Tensor* dst);  // Converts when the dtypes differ
+
+// Convert n contiguous elements between a storage dtype and fp32
+void load_as_float(DType dtype, const void* src, float* dst, int64_t n);
+void store_from_float(DType dtype, const float* src, void* dst, int64_t n);
+
+// The remaining kernels read and write fp32
+void sum_to_cpu(Tensor* src, Tensor* dst);
+void scale_tensor_cpu(const float* src, float* dst, int64_t n, float factor);
+void reduce_cpu(ReduceOp op, const float* src, void* dst, int64_t outer, int64_t reduce, int64_t inner, float scale);
+// Max and argmax of int32 without going through fp32
+void reduce_cpu_int32(ReduceOp op, const int32_t* src, int32_t* dst, int64_t outer, int64_t reduce, int64_t inner);
+const char* cpu_kernel_isa();  // Instruction set the CPU kernels were selected for
+void matmul_cpu(const float* a, const float* b, float* c, int batch, int m, int n, int k, bool trans_a, bool trans_b);
 
 #endif /* CPU_H */
\ No newline at end of file
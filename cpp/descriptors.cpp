@@ -0,0 +1,217 @@
+#include "descriptors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iterator>
+
+static VkDescriptorPool createPool(VkDevice device) {
+    VkDescriptorPoolSize poolSize{};
+    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSize.descriptorCount = DESCRIPTOR_POOL_MAX_SETS * DESCRIPTOR_POOL_BUFFERS_PER_SET;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    poolInfo.maxSets = DESCRIPTOR_POOL_MAX_SETS;
+
+    VkDescriptorPool pool;
+    if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create descriptor pool\n");
+        exit(1);
+    }
+    return pool;
+}
+
+// Reset a pool once none of its sets is cached and the work binding them has retired
+static bool resetIfRetired(DescriptorAllocator* allocator, VkDevice device, DescriptorPool& pool) {
+    if (pool.allocatedSets > 0 && pool.liveSets == 0 && pool.recording == 0 && pool.lastSerial <= allocator->completedSerial) {
+        vkResetDescriptorPool(device, pool.pool, 0);
+        pool.allocatedSets = 0;
+    }
+    return pool.allocatedSets == 0;
+}
+
+// Drop a cache entry and its place in the lists of its buffers
+static std::unordered_map<std::string, CachedDescriptorSet>::iterator evictEntry(
+    DescriptorAllocator* allocator, std::unordered_map<std::string, CachedDescriptorSet>::iterator it) {
+    for (VkBuffer buffer : it->second.buffers) {
+        auto byBuffer = allocator->keysByBuffer.find(buffer);
+        if (byBuffer == allocator->keysByBuffer.end()) {
+            continue;
+        }
+        std::vector<std::string>& list = byBuffer->second;
+        for (size_t i = 0; i < list.size();) {
+            if (list[i] == it->first) {
+                list[i] = list.back();
+                list.pop_back();
+            } else {
+                i++;
+            }
+        }
+        if (list.empty()) {
+            allocator->keysByBuffer.erase(byBuffer);
+        }
+    }
+    allocator->pools[it->second.pool].liveSets--;
+    return allocator->cache.erase(it);
+}
+
+// Allocate from the current pool, moving on to an empty pool or a new one when it is full
+static VkDescriptorSet allocateSet(DescriptorAllocator* allocator, VkDevice device, VkDescriptorSetLayout layout, uint32_t* poolIndex) {
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &layout;
+
+    VkDescriptorSet set;
+    if (!allocator->pools.empty()) {
+        allocInfo.descriptorPool = allocator->pools[allocator->current].pool;
+        if (vkAllocateDescriptorSets(device, &allocInfo, &set) == VK_SUCCESS) {
+            *poolIndex = allocator->current;
+            return set;
+        }
+    }
+
+    // Step 1: Switch to a pool that is empty or can be reset
+    uint32_t next = (uint32_t)allocator->pools.size();
+    for (uint32_t i = 0; i < allocator->pools.size(); i++) {
+        if (resetIfRetired(allocator, device, allocator->pools[i])) {
+            next = i;
+            break;
+        }
+    }
+
+    // Step 2: With the chain at its limit, evict the sets of the oldest pool,
+    // which is reused now if its work has retired and otherwise once it has
+    if (next == allocator->pools.size() && allocator->pools.size() >= DESCRIPTOR_CACHE_MAX_POOLS) {
+        uint32_t oldest = allocator->current == 0 ? 1 : 0;
+        for (uint32_t i = 0; i < allocator->pools.size(); i++) {
+            if (i != allocator->current && allocator->pools[i].age < allocator->pools[oldest].age) {
+                oldest = i;
+            }
+        }
+        for (auto it = allocator->cache.begin(); it != allocator->cache.end();) {
+            it = it->second.pool == oldest ? evictEntry(allocator, it) : std::next(it);
+        }
+        if (resetIfRetired(allocator, device, allocator->pools[oldest])) {
+            next = oldest;
+        }
+    }
+
+    // Step 3: Otherwise grow the chain by one
+    if (next == allocator->pools.size()) {
+        DescriptorPool pool{};
+        pool.pool = createPool(device);
+        allocator->pools.push_back(pool);
+    }
+    allocator->current = next;
+    allocator->pools[next].age = ++allocator->ages;
+
+    // Step 4: An empty pool only fails for a layout larger than the whole pool
+    allocInfo.descriptorPool = allocator->pools[next].pool;
+    if (vkAllocateDescriptorSets(device, &allocInfo, &set) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to allocate descriptor set\n");
+        exit(1);
+    }
+    *poolIndex = next;
+    return set;
+}
+
+// Return the set binding buffers to the layout's bindings in order, writing one
+// only the first time this layout sees these buffers. The set's pool is held
+// until finishDescriptorSet is given the serial of the work that binds it.
+VkDescriptorSet acquireDescriptorSet(DescriptorAllocator* allocator, VkDevice device, VkDescriptorSetLayout layout,
+                                     const VkBuffer* buffers, uint32_t bufferCount, uint32_t* pool) {
+    std::string key((const char*)&layout, sizeof(layout));
+    key.append((const char*)buffers, bufferCount * sizeof(VkBuffer));
+
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    auto it = allocator->cache.find(key);
+    if (it != allocator->cache.end()) {
+        *pool = it->second.pool;
+        allocator->pools[*pool].recording++;
+        return it->second.set;
+    }
+
+    CachedDescriptorSet cached{};
+    cached.set = allocateSet(allocator, device, layout, &cached.pool);
+    cached.layout = layout;
+    cached.buffers.assign(buffers, buffers + bufferCount);
+    allocator->pools[cached.pool].allocatedSets++;
+    allocator->pools[cached.pool].liveSets++;
+    allocator->pools[cached.pool].recording++;
+    *pool = cached.pool;
+
+    std::vector<VkDescriptorBufferInfo> bufferInfos(bufferCount);
+    std::vector<VkWriteDescriptorSet> descriptorWrites(bufferCount);
+    for (uint32_t i = 0; i < bufferCount; i++) {
+        bufferInfos[i].buffer = buffers[i];
+        bufferInfos[i].offset = 0;
+        bufferInfos[i].range = VK_WHOLE_SIZE;
+
+        descriptorWrites[i] = {};
+        descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[i].dstSet = cached.set;
+        descriptorWrites[i].dstBinding = i;
+        descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[i].descriptorCount = 1;
+        descriptorWrites[i].pBufferInfo = &bufferInfos[i];
+    }
+    vkUpdateDescriptorSets(device, bufferCount, descriptorWrites.data(), 0, nullptr);
+
+    for (uint32_t i = 0; i < bufferCount; i++) {
+        std::vector<std::string>& keys = allocator->keysByBuffer[buffers[i]];
+        if (std::find(keys.begin(), keys.end(), key) == keys.end()) {  // A buffer bound twice is listed once
+            keys.push_back(key);
+        }
+    }
+    allocator->cache.emplace(key, cached);
+    return cached.set;
+}
+
+// The work binding a set acquired from pool completes at serial. Until every
+// such serial has retired the pool is not reset, even if its sets are evicted.
+void finishDescriptorSet(DescriptorAllocator* allocator, uint32_t pool, uint64_t serial) {
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    DescriptorPool& entry = allocator->pools[pool];
+    entry.recording--;
+    entry.lastSerial = std::max(entry.lastSerial, serial);
+}
+
+// Evict every set that binds buffer, which is about to be destroyed, so none is
+// found again once its handle is reused
+void releaseDescriptorSets(DescriptorAllocator* allocator, VkBuffer buffer) {
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    auto byBuffer = allocator->keysByBuffer.find(buffer);
+    if (byBuffer == allocator->keysByBuffer.end()) {
+        return;
+    }
+
+    std::vector<std::string> keys;
+    keys.swap(byBuffer->second);
+    allocator->keysByBuffer.erase(byBuffer);
+    for (const std::string& key : keys) {
+        auto it = allocator->cache.find(key);
+        if (it != allocator->cache.end()) {
+            evictEntry(allocator, it);
+        }
+    }
+}
+
+// Evict every set of a layout that is about to be destroyed
+void releaseDescriptorSetLayout(DescriptorAllocator* allocator, VkDescriptorSetLayout layout) {
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    for (auto it = allocator->cache.begin(); it != allocator->cache.end();) {
+        it = it->second.layout == layout ? evictEntry(allocator, it) : std::next(it);
+    }
+}
+
+// Reset each pool left with no cached sets and no work in flight
+void recycleDescriptorPools(DescriptorAllocator* allocator, VkDevice device, uint64_t completedSerial) {
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    allocator->completedSerial = completedSerial;
+    for (DescriptorPool& pool : allocator->pools) {
+        resetIfRetired(allocator, device, pool);
+    }
+}
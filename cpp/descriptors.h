@@ -0,0 +1,58 @@
+#ifndef DESCRIPTORS_H
+#define DESCRIPTORS_H
+
+#include <vulkan/vulkan.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define DESCRIPTOR_POOL_MAX_SETS 256        // Sets per pool in the chain
+#define DESCRIPTOR_POOL_BUFFERS_PER_SET 4   // Storage buffers per set a pool is sized for, on average
+#define DESCRIPTOR_CACHE_MAX_POOLS 8        // Pools whose sets stay cached; older ones are evicted
+
+// One pool of the chain. Sets are never freed one at a time: once every set
+// allocated from a pool has been evicted and the work binding them has retired,
+// the whole pool is reset at once.
+typedef struct {
+    VkDescriptorPool pool;
+    uint32_t allocatedSets;  // Since the last reset
+    uint32_t liveSets;       // Allocated and still cached
+    uint32_t recording;      // Dispatches that acquired a set here and have no serial yet
+    uint64_t lastSerial;     // Latest work that binds a set from this pool
+    uint64_t age;            // When it last became the pool new sets come from
+} DescriptorPool;
+
+// A set written for one kernel layout and one list of buffers
+typedef struct {
+    VkDescriptorSet set;
+    uint32_t pool;  // Index into the chain
+    VkDescriptorSetLayout layout;
+    std::vector<VkBuffer> buffers;
+} CachedDescriptorSet;
+
+// Descriptor sets are cached by (layout, buffers), so repeating an op on the same
+// tensors binds the set written the first time without vkUpdateDescriptorSets.
+// Pools are chained, a new one being created when the others are full. Once
+// DESCRIPTOR_CACHE_MAX_POOLS are in use, filling one evicts the sets of the
+// oldest, which is reset when its work retires, so a long run keeps reusing the
+// same pools. Sets are also evicted when their buffer or layout is destroyed.
+typedef struct {
+    std::mutex mutex;
+    std::vector<DescriptorPool> pools;
+    uint32_t current;  // Pool new sets are allocated from
+    uint64_t ages;     // Times a pool has become current
+    uint64_t completedSerial;  // As of the last recycle
+    std::unordered_map<std::string, CachedDescriptorSet> cache;       // Keyed by the layout and buffer handles
+    std::unordered_map<VkBuffer, std::vector<std::string>> keysByBuffer;  // Cache entries naming each buffer
+} DescriptorAllocator;
+
+// Every acquired set must be finished with the serial of the work that binds it
+VkDescriptorSet acquireDescriptorSet(DescriptorAllocator* allocator, VkDevice device, VkDescriptorSetLayout layout,
+                                     const VkBuffer* buffers, uint32_t bufferCount, uint32_t* pool);
+void finishDescriptorSet(DescriptorAllocator* allocator, uint32_t pool, uint64_t serial);
+void releaseDescriptorSets(DescriptorAllocator* allocator, VkBuffer buffer);
+void releaseDescriptorSetLayout(DescriptorAllocator* allocator, VkDescriptorSetLayout layout);
+void recycleDescriptorPools(DescriptorAllocator* allocator, VkDevice device, uint64_t completedSerial);
+
+#endif /* DESCRIPTORS_H */
@@ -0,0 +1,398 @@
+#include "fusion.h"
+#include "vulkan.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// One step of a flattened expression. Registers 0..inputs-1 hold the inputs and
+// instruction i writes register inputs + i.
+typedef struct {
+    FusedOp op;
+    int lhs;
+    int rhs;
+} FusedInstr;
+
+typedef struct {
+    std::vector<Tensor*> inputs;
+    std::vector<FusedInstr> instrs;
+} FusedProgram;
+
+static FusedExpr* new_expr(FusedOp op, Tensor* tensor, FusedExpr* lhs, FusedExpr* rhs) {
+    FusedExpr* expr = (FusedExpr*)malloc(sizeof(FusedExpr));
+    if (expr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    expr->op = op;
+    expr->tensor = tensor;
+    expr->lhs = lhs;
+    expr->rhs = rhs;
+    expr->refcount = 1;
+
+    if (lhs != NULL) {
+        lhs->refcount++;
+    }
+    if (rhs != NULL) {
+        rhs->refcount++;
+    }
+    return expr;
+}
+
+static void count_inputs(FusedExpr* expr, std::unordered_set<Tensor*>& inputs) {
+    if (expr->op == FUSED_INPUT) {
+        inputs.insert(expr->tensor);
+    } else {
+        count_inputs(expr->lhs, inputs);
+        count_inputs(expr->rhs, inputs);
+    }
+}
+
+// Flatten the DAG in post-order. Shared nodes and repeated tensors are emitted once.
+static int flatten(FusedExpr* expr, FusedProgram& program, std::unordered_map<FusedExpr*, int>& registers,
+                   std::unordered_map<Tensor*, int>& inputs) {
+    auto it = registers.find(expr);
+    if (it != registers.end()) {
+        return it->second;
+    }
+
+    int reg;
+    if (expr->op == FUSED_INPUT) {
+        auto input = inputs.find(expr->tensor);
+        if (input == inputs.end()) {
+            reg = (int)program.inputs.size();
+            inputs[expr->tensor] = reg;
+            program.inputs.push_back(expr->tensor);
+        } else {
+            reg = input->second;
+        }
+    } else {
+        FusedInstr instr;
+        instr.op = expr->op;
+        instr.lhs = flatten(expr->lhs, program, registers, inputs);
+        instr.rhs = flatten(expr->rhs, program, registers, inputs);
+        program.instrs.push_back(instr);
+        reg = -(int)program.instrs.size();  // Instruction registers are renumbered below
+    }
+
+    registers[expr] = reg;
+    return reg;
+}
+
+static FusedProgram build_program(FusedExpr* expr) {
+    FusedProgram program;
+    std::unordered_map<FusedExpr*, int> registers;
+    std::unordered_map<Tensor*, int> inputs;
+    flatten(expr, program, registers, inputs);
+
+    // Instruction results were numbered -1, -2, ... while inputs were still being found
+    int inputCount = (int)program.inputs.size();
+    for (FusedInstr& instr : program.instrs) {
+        instr.lhs = instr.lhs < 0 ? inputCount - instr.lhs - 1 : instr.lhs;
+        instr.rhs = instr.rhs < 0 ? inputCount - instr.rhs - 1 : instr.rhs;
+    }
+    return program;
+}
+
+static int result_register(const FusedProgram& program) {
+    return (int)(program.inputs.size() + program.instrs.size()) - 1;
+}
+
+static std::string generate_glsl(const FusedProgram& program) {
+    // Specialized per KernelVariant like the built-in elementwise shaders
+    std::string glsl = "#version 450\n\nlayout (local_size_x = 256, local_size_x_id = 0) in;\n"
+                       "layout (constant_id = 1) const uint ITEMS_PER_THREAD = 1;\n\n";
+    char line[256];
+
+    for (size_t i = 0; i < program.inputs.size(); i++) {
+        snprintf(line, sizeof(line), "layout (binding = %zu) readonly buffer Input%zu {\n    float input%zu[];\n};\n\n", i, i, i);
+        glsl += line;
+    }
+    snprintf(line, sizeof(line), "layout (binding = %zu) writeonly buffer ResultBuffer {\n    float result_data[];\n};\n\n", program.inputs.size());
+    glsl += line;
+
+    glsl += "layout (push_constant) uniform PushConstants {\n    uint size;\n};\n\n";
+    glsl += "void main() {\n    uint first = gl_WorkGroupID.x * gl_WorkGroupSize.x * ITEMS_PER_THREAD + gl_LocalInvocationID.x;\n"
+            "    for (uint item = 0; item < ITEMS_PER_THREAD; item++) {\n        uint index = first + item * gl_WorkGroupSize.x;\n"
+            "        if (index >= size) {\n            return;\n        }\n\n";
+
+    for (size_t i = 0; i < program.inputs.size(); i++) {
+        snprintf(line, sizeof(line), "        float r%zu = input%zu[index];\n", i, i);
+        glsl += line;
+    }
+    for (size_t i = 0; i < program.instrs.size(); i++) {
+        const FusedInstr& instr = program.instrs[i];
+        const char* op = instr.op == FUSED_ADD ? "+" : "-";
+        snprintf(line, sizeof(line), "        float r%zu = r%d %s r%d;\n", program.inputs.size() + i, instr.lhs, op, instr.rhs);
+        glsl += line;
+    }
+
+    snprintf(line, sizeof(line), "\n        result_data[index] = r%d;\n    }\n}\n", result_register(program));
+    glsl += line;
+    return glsl;
+}
+
+// Directory holding generated shaders, overridable with VKGRAD_KERNEL_CACHE
+static const char* kernel_cache_dir() {
+    const char* dir = getenv("VKGRAD_KERNEL_CACHE");
+    return dir != NULL ? dir : "cpp/fused";
+}
+
+// Run glslangValidator on src without a shell, so the paths may hold any
+// character. Returns whether it exited successfully.
+static bool run_glslang(const std::string& src, const std::string& spv) {
+    const char* argv[] = {"glslangValidator", "-V", src.c_str(), "-o", spv.c_str(), NULL};
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        // Step 1: Silence its progress output, then replace the child with it
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+        execvp(argv[0], (char* const*)argv);
+        _exit(127);
+    }
+
+    // Step 2: Wait for the compiler to finish
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Compile the GLSL for a program once, keyed by a hash of its source. The SPIR-V
+// stays on disk so later processes skip glslangValidator entirely.
+static std::string compile_program(const std::string& glsl) {
+    // FNV-1a over the shader source
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : glsl) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "/fused_%016llx", (unsigned long long)hash);
+    std::string base = std::string(kernel_cache_dir()) + name;
+    std::string spv = base + ".spv";
+
+    // SPIR-V this process has already found or written, so warm calls neither
+    // take the compile lock nor touch the file system
+    static std::mutex compiledMutex;
+    static std::unordered_set<std::string> compiled;
+    {
+        std::lock_guard<std::mutex> lock(compiledMutex);
+        if (compiled.count(spv)) {
+            return spv;
+        }
+    }
+
+    // Threads fusing the same expression would otherwise write the same files
+    static std::mutex compileMutex;
+    std::lock_guard<std::mutex> lock(compileMutex);
+    if (access(spv.c_str(), R_OK) != 0) {
+        mkdir(kernel_cache_dir(), 0755);
+        std::string src = base + ".comp";
+        FILE* file = fopen(src.c_str(), "w");
+        if (!file) {
+            fprintf(stderr, "Failed to write fused shader: %s\n", src.c_str());
+            exit(1);
+        }
+        fputs(glsl.c_str(), file);
+        fclose(file);
+
+        if (!run_glslang(src, spv)) {
+            fprintf(stderr, "Fused shader compilation failed: %s\n", src.c_str());
+            exit(1);
+        }
+    }
+
+    std::lock_guard<std::mutex> compiledLock(compiledMutex);
+    compiled.insert(spv);
+    return spv;
+}
+
+static void run_program_vulkan(const FusedProgram& program, Tensor* result) {
+    VulkanContext* context = getVulkanContext();
+
+    std::string spv = compile_program(generate_glsl(program));
+    uint32_t bufferCount = (uint32_t)program.inputs.size() + 1;
+
+    std::vector<VkBuffer> buffers;
+    for (Tensor* input : program.inputs) {
+        buffers.push_back(input->buffer);
+    }
+    buffers.push_back(result->buffer);
+
+    uint32_t size = (uint32_t)result->size;
+    ComputeKernel* kernel = getTunedKernel(context, spv.c_str(), bufferCount, sizeof(uint32_t), buffers.data(), &size, size,
+                                           result->allocation.requested);
+    VkDeviceSize bytes = (VkDeviceSize)size * bufferCount * sizeof(float);
+    result->ready_serial = dispatchKernel(context, kernel, buffers.data(), bufferCount, &size, variantGroupCount(kernel, size), 1, 1, bytes);
+}
+
+// Interpret the program over blocks of FUSED_BLOCK elements so the temporaries
+// stay in cache and each input is read once.
+static void run_program_cpu(const FusedProgram& program, Tensor* result) {
+    size_t registerCount = program.inputs.size() + program.instrs.size();
+    std::vector<float> scratch(program.instrs.size() * FUSED_BLOCK);
+    std::vector<const float*> registers(registerCount);
+
+    for (int start = 0; start < result->size; start += FUSED_BLOCK) {
+        int count = result->size - start < FUSED_BLOCK ? result->size - start : FUSED_BLOCK;
+
+        for (size_t i = 0; i < program.inputs.size(); i++) {
+            registers[i] = (const float*)program.inputs[i]->data + program.inputs[i]->offset + start;
+        }
+
+        for (size_t i = 0; i < program.instrs.size(); i++) {
+            const FusedInstr& instr = program.instrs[i];
+            const float* lhs = registers[instr.lhs];
+            const float* rhs = registers[instr.rhs];
+            float* out = scratch.data() + i * FUSED_BLOCK;
+
+            if (instr.op == FUSED_ADD) {
+                for (int j = 0; j < count; j++) {
+                    out[j] = lhs[j] + rhs[j];
+                }
+            } else {
+                for (int j = 0; j < count; j++) {
+                    out[j] = lhs[j] - rhs[j];
+                }
+            }
+            registers[program.inputs.size() + i] = out;
+        }
+
+        memcpy((float*)result->data + start, registers[registerCount - 1], count * sizeof(float));
+    }
+}
+
+// Evaluate an expression, splitting it when it reads more tensors than one kernel can bind
+static Tensor* eval_expr(FusedExpr* expr) {
+    std::unordered_set<Tensor*> inputs;
+    count_inputs(expr, inputs);
+
+    if (inputs.size() > FUSED_MAX_INPUTS) {
+        Tensor* lhs = eval_expr(expr->lhs);
+        Tensor* rhs = eval_expr(expr->rhs);
+
+        FusedExpr* lhsInput = new_expr(FUSED_INPUT, lhs, NULL, NULL);
+        FusedExpr* rhsInput = new_expr(FUSED_INPUT, rhs, NULL, NULL);
+        FusedExpr* root = new_expr(expr->op, NULL, lhsInput, rhsInput);
+        fused_free(lhsInput);
+        fused_free(rhsInput);
+
+        Tensor* result = eval_expr(root);
+        fused_free(root);
+        destroy_tensor(lhs);
+        destroy_tensor(rhs);
+        return result;
+    }
+
+    FusedProgram program = build_program(expr);
+    Tensor* first = program.inputs[0];
+    Tensor* result = empty_tensor(first->shape, first->ndim, first->device, DTYPE_FLOAT32);
+    bool vulkan = strcmp(first->device, "vulkan") == 0;
+
+    // The result keeps the inputs' dtype when they all share one
+    DType dtype = first->dtype;
+    for (Tensor* input : program.inputs) {
+        if (input->dtype != dtype) {
+            dtype = DTYPE_FLOAT32;
+        }
+    }
+
+    // Generated kernels index fp32 inputs densely from the start of their buffer, so
+    // strided views and other dtypes are copied first. The CPU interpreter handles
+    // offsets itself.
+    std::vector<Tensor*> copies;
+    for (Tensor*& input : program.inputs) {
+        if (!is_contiguous(input) || (vulkan && input->offset != 0) || input->dtype != DTYPE_FLOAT32) {
+            input = convert_tensor(input, DTYPE_FLOAT32);
+            copies.push_back(input);
+        }
+    }
+
+    if (vulkan) {
+        run_program_vulkan(program, result);
+    } else {
+        run_program_cpu(program, result);
+    }
+
+    for (Tensor* copy : copies) {
+        destroy_tensor(copy);
+    }
+
+    if (dtype != DTYPE_FLOAT32) {
+        Tensor* narrowed = convert_tensor(result, dtype);
+        destroy_tensor(result);
+        result = narrowed;
+    }
+    return result;
+}
+
+extern "C" {
+    FusedExpr* fused_input(Tensor* tensor) {
+        return new_expr(FUSED_INPUT, tensor, NULL, NULL);
+    }
+
+    FusedExpr* fused_add(FusedExpr* lhs, FusedExpr* rhs) {
+        return new_expr(FUSED_ADD, NULL, lhs, rhs);
+    }
+
+    FusedExpr* fused_sub(FusedExpr* lhs, FusedExpr* rhs) {
+        return new_expr(FUSED_SUB, NULL, lhs, rhs);
+    }
+
+    Tensor* fused_eval(FusedExpr* expr) {
+        PROFILE_SCOPE("fused_eval");
+
+        // Every input must match the first in device and shape
+        std::unordered_set<Tensor*> inputs;
+        count_inputs(expr, inputs);
+        Tensor* first = *inputs.begin();
+        for (Tensor* input : inputs) {
+            if (strcmp(input->device, first->device) != 0) {
+                fprintf(stderr, "Tensors must be on the same device: %s and %s\n", first->device, input->device);
+                exit(1);
+            }
+            if (input->ndim != first->ndim) {
+                fprintf(stderr, "Tensors must have the same number of dimensions %d and %d for fusion\n", first->ndim, input->ndim);
+                exit(1);
+            }
+            for (int i = 0; i < first->ndim; i++) {
+                if (input->shape[i] != first->shape[i]) {
+                    fprintf(stderr, "Tensors must have the same shape %d and %d at index %d for fusion\n", first->shape[i], input->shape[i], i);
+                    exit(1);
+                }
+            }
+        }
+
+        return eval_expr(expr);
+    }
+
+    void fused_free(FusedExpr* expr) {
+        if (expr == NULL || --expr->refcount > 0) {
+            return;
+        }
+        fused_free(expr->lhs);
+        fused_free(expr->rhs);
+        free(expr);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include "tensor.h"
+
+#define FUSED_MAX_INPUTS 7  // Input buffers per fused kernel; one more binding holds the result
+#define FUSED_BLOCK 256     // Elements evaluated together on the CPU path
+
+typedef enum {
+    FUSED_INPUT,
+    FUSED_ADD,
+    FUSED_SUB,
+} FusedOp;
+
+// Node of an elementwise expression DAG. Every handle returned to the caller and
+// every parent node holds one reference; fused_free drops the caller's.
+typedef struct FusedExpr {
+    FusedOp op;
+    Tensor* tensor;  // FUSED_INPUT only
+    struct FusedExpr* lhs;
+    struct FusedExpr* rhs;
+    int refcount;
+} FusedExpr;
+
+extern "C" {
+    FusedExpr* fused_input(Tensor* tensor);
+    FusedExpr* fused_add(FusedExpr* lhs, FusedExpr* rhs);
+    FusedExpr* fused_sub(FusedExpr* lhs, FusedExpr* rhs);
+    Tensor* fused_eval(FusedExpr* expr);
+    void fused_free(FusedExpr* expr);
+}
+
+#endif /* FUSION_H */
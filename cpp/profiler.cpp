@@ -0,0 +1,336 @@
+#include "profiler.h"
+#include "vulkan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+typedef enum {
+    TRACK_HOST,
+    TRACK_GPU,
+} ProfileTrack;
+
+typedef struct {
+    const char* name;  // Interned, so events outlive the kernels they name
+    const char* category;
+    ProfileTrack track;
+    int64_t start;     // Nanoseconds since the profiler's epoch
+    int64_t duration;
+    uint64_t bytes;
+} ProfileEvent;
+
+// A GPU op whose timestamps have been written but not read back yet
+typedef struct {
+    uint32_t query;
+    const char* name;
+    const char* category;
+    uint64_t bytes;
+    uint64_t serial;
+    int64_t recorded;  // Host time the op was recorded, to place the GPU track
+} PendingGpuOp;
+
+typedef struct {
+    std::atomic<int> enabled;  // -1 until VKGRAD_PROFILE has been read
+    const char* tracePath;     // From VKGRAD_PROFILE; written at exit
+    std::mutex mutex;          // Guards the rest; events arrive from every thread
+    std::chrono::steady_clock::time_point epoch;
+    std::vector<ProfileEvent> events;
+    std::unordered_set<std::string> names;
+
+    // Timestamp queries, allocated in pairs
+    VkPhysicalDevice physicalDevice;
+    VkDevice device;
+    uint32_t queueFamilyIndex;
+    VkQueryPool queryPool;
+    double timestampPeriod;  // Nanoseconds per tick
+    uint64_t timestampMask;
+    std::vector<uint32_t> freeQueries;
+    std::vector<PendingGpuOp> pending;
+    bool haveGpuOffset;
+    int64_t gpuOffset;  // Added to GPU times to put them on the host clock
+    uint64_t untimedOps;
+} Profiler;
+
+static Profiler profiler = {-1};
+
+static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - profiler.epoch).count();
+}
+
+static const char* internName(const char* name) {
+    return profiler.names.insert(name).first->c_str();
+}
+
+static void writeSummary(FILE* file);
+
+static void exportAtExit() {
+    profiler_export_trace(profiler.tracePath);
+    writeSummary(stderr);
+}
+
+bool profilerEnabled() {
+    if (profiler.enabled < 0) {
+        std::lock_guard<std::mutex> lock(profiler.mutex);
+        if (profiler.enabled >= 0) {
+            return profiler.enabled > 0;
+        }
+        profiler.epoch = std::chrono::steady_clock::now();
+        const char* path = getenv("VKGRAD_PROFILE");
+        if (path != NULL && path[0] != '\0') {
+            profiler.tracePath = path;
+            atexit(exportAtExit);
+        }
+        profiler.enabled = profiler.tracePath != NULL;
+    }
+    return profiler.enabled > 0;
+}
+
+ProfileScope::ProfileScope(const char* name, const char* category, uint64_t bytes)
+    : name(name), category(category), bytes(bytes), start(profilerEnabled() ? nowNs() : -1) {}
+
+ProfileScope::~ProfileScope() {
+    if (start >= 0 && profilerEnabled()) {
+        std::lock_guard<std::mutex> lock(profiler.mutex);
+        profiler.events.push_back({name, category, TRACK_HOST, start, nowNs() - start, bytes});
+    }
+}
+
+// Create the timestamp query pool once both the device and profiling are on
+static void createQueryPool() {
+    if (!profilerEnabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(profiler.mutex);
+    if (profiler.device == VK_NULL_HANDLE || profiler.queryPool != VK_NULL_HANDLE) {
+        return;
+    }
+
+    uint32_t familyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(profiler.physicalDevice, &familyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> families(familyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(profiler.physicalDevice, &familyCount, families.data());
+    uint32_t validBits = profiler.queueFamilyIndex < familyCount ? families[profiler.queueFamilyIndex].timestampValidBits : 0;
+    if (validBits == 0) {
+        fprintf(stderr, "Queue has no timestamp support; profiling host events only\n");
+        return;
+    }
+
+    VkQueryPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = PROFILER_MAX_QUERIES;
+    if (vkCreateQueryPool(profiler.device, &poolInfo, nullptr, &profiler.queryPool) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create timestamp query pool; profiling host events only\n");
+        profiler.queryPool = VK_NULL_HANDLE;
+        return;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(profiler.physicalDevice, &properties);
+    profiler.timestampPeriod = properties.limits.timestampPeriod;
+    profiler.timestampMask = validBits >= 64 ? UINT64_MAX : (1ull << validBits) - 1;
+    for (uint32_t query = PROFILER_MAX_QUERIES; query >= 2; query -= 2) {
+        profiler.freeQueries.push_back(query - 2);
+    }
+}
+
+void profilerInitGpu(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamilyIndex) {
+    profiler.physicalDevice = physicalDevice;
+    profiler.device = device;
+    profiler.queueFamilyIndex = queueFamilyIndex;
+    createQueryPool();
+}
+
+uint32_t profilerBeginGpu(VkCommandBuffer commandBuffer) {
+    if (!profilerEnabled() || profiler.queryPool == VK_NULL_HANDLE) {
+        return PROFILER_NO_QUERY;
+    }
+    std::lock_guard<std::mutex> lock(profiler.mutex);
+    if (profiler.freeQueries.empty()) {
+        profiler.untimedOps++;
+        return PROFILER_NO_QUERY;
+    }
+
+    uint32_t query = profiler.freeQueries.back();
+    profiler.freeQueries.pop_back();
+
+    // Queries are reset in the same command buffer, ahead of the writes
+    vkCmdResetQueryPool(commandBuffer, profiler.queryPool, query, 2);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, profiler.queryPool, query);
+    return query;
+}
+
+void profilerEndGpu(VkCommandBuffer commandBuffer, uint32_t query) {
+    if (query != PROFILER_NO_QUERY) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, profiler.queryPool, query + 1);
+    }
+}
+
+void profilerRecordGpu(uint32_t query, const char* name, const char* category, uint64_t bytes, uint64_t serial) {
+    if (query != PROFILER_NO_QUERY) {
+        std::lock_guard<std::mutex> lock(profiler.mutex);
+        profiler.pending.push_back({query, internName(name), category, bytes, serial, nowNs()});
+    }
+}
+
+void profilerCollectGpu(uint64_t completedSerial) {
+    std::lock_guard<std::mutex> lock(profiler.mutex);
+    for (size_t i = 0; i < profiler.pending.size();) {
+        PendingGpuOp op = profiler.pending[i];
+        if (op.serial > completedSerial) {
+            i++;
+            continue;
+        }
+
+        uint64_t ticks[2];
+        if (vkGetQueryPoolResults(profiler.device, profiler.queryPool, op.query, 2, sizeof(ticks), ticks, sizeof(uint64_t),
+                                  VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+            int64_t start = (int64_t)((ticks[0] & profiler.timestampMask) * profiler.timestampPeriod);
+            int64_t duration = (int64_t)(((ticks[1] - ticks[0]) & profiler.timestampMask) * profiler.timestampPeriod);
+
+            // The GPU clock has its own epoch; line it up with the first op's recording
+            if (!profiler.haveGpuOffset) {
+                profiler.gpuOffset = op.recorded - start;
+                profiler.haveGpuOffset = true;
+            }
+            profiler.events.push_back({op.name, op.category, TRACK_GPU, start + profiler.gpuOffset, duration, op.bytes});
+        }
+
+        profiler.freeQueries.push_back(op.query);
+        profiler.pending[i] = profiler.pending.back();
+        profiler.pending.pop_back();
+    }
+}
+
+// Wait for recorded GPU work so every op has its timestamps
+static void drainGpu() {
+    if (profiler.queryPool != VK_NULL_HANDLE) {
+        waitForIdle(getVulkanContext());
+    }
+}
+
+static void writeJsonString(FILE* file, const char* text) {
+    fputc('"', file);
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+// Nearest-rank percentile of sorted durations
+static int64_t percentile(const std::vector<int64_t>& sorted, double p) {
+    size_t rank = (size_t)(p * sorted.size() + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void writeSummary(FILE* file) {
+    drainGpu();
+    std::lock_guard<std::mutex> lock(profiler.mutex);
+
+    // Group by track, category and name, keeping first-seen order for ties
+    std::unordered_map<std::string, size_t> index;
+    std::vector<const ProfileEvent*> keys;
+    std::vector<std::vector<int64_t>> durations;
+    std::vector<uint64_t> bytes;
+    for (const ProfileEvent& event : profiler.events) {
+        std::string key = std::to_string(event.track) + event.category + "/" + event.name;
+        auto it = index.find(key);
+        if (it == index.end()) {
+            it = index.emplace(key, keys.size()).first;
+            keys.push_back(&event);
+            durations.emplace_back();
+            bytes.push_back(0);
+        }
+        durations[it->second].push_back(event.duration);
+        bytes[it->second] += event.bytes;
+    }
+
+    std::vector<int64_t> totals(keys.size(), 0);
+    std::vector<size_t> order(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        for (int64_t duration : durations[i]) {
+            totals[i] += duration;
+        }
+        std::sort(durations[i].begin(), durations[i].end());
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return totals[a] > totals[b]; });
+
+    fprintf(file, "%-5s %-9s %-32s %8s %12s %10s %10s %14s %9s\n", "Track", "Category", "Name", "Count", "Total ms",
+            "p50 us", "p99 us", "Bytes", "GB/s");
+    for (size_t i : order) {
+        const ProfileEvent* key = keys[i];
+        const char* name = key->name;
+        size_t length = strlen(name);
+        double gbps = totals[i] > 0 ? (double)bytes[i] / (double)totals[i] : 0.0;  // Bytes per ns is GB/s
+        fprintf(file, "%-5s %-9s %-32s %8zu %12.3f %10.1f %10.1f %14llu %9.2f\n", key->track == TRACK_GPU ? "gpu" : "host",
+                key->category, length > 32 ? name + length - 32 : name, durations[i].size(), totals[i] / 1e6,
+                percentile(durations[i], 0.5) / 1e3, percentile(durations[i], 0.99) / 1e3, (unsigned long long)bytes[i], gbps);
+    }
+    if (profiler.untimedOps > 0) {
+        fprintf(file, "%llu GPU ops were not timed because every timestamp query was in use\n", (unsigned long long)profiler.untimedOps);
+    }
+}
+
+extern "C" {
+    void profiler_enable(int enabled) {
+        profilerEnabled();
+        profiler.enabled = enabled != 0;
+        createQueryPool();
+    }
+
+    void profiler_reset() {
+        drainGpu();
+        std::lock_guard<std::mutex> lock(profiler.mutex);
+        profiler.events.clear();
+        profiler.untimedOps = 0;
+    }
+
+    void profiler_export_trace(const char* path) {
+        drainGpu();
+        FILE* file = fopen(path, "w");
+        if (!file) {
+            fprintf(stderr, "Failed to write profile trace: %s\n", path);
+            return;
+        }
+
+        // Complete ("X") events on one thread per track, with times in microseconds
+        std::lock_guard<std::mutex> lock(profiler.mutex);
+        fprintf(file, "{\"traceEvents\": [\n");
+        fprintf(file, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"host\"}},\n", TRACK_HOST);
+        fprintf(file, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"gpu\"}}", TRACK_GPU);
+        for (const ProfileEvent& event : profiler.events) {
+            fprintf(file, ",\n  {\"name\": ");
+            writeJsonString(file, event.name);
+            fprintf(file, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"bytes\": %llu}}",
+                    event.category, event.track, event.start / 1000.0, event.duration / 1000.0, (unsigned long long)event.bytes);
+        }
+        fprintf(file, "\n], \"displayTimeUnit\": \"ns\"}\n");
+        fclose(file);
+    }
+
+    void profiler_print_summary(const char* path) {
+        FILE* file = path != NULL ? fopen(path, "w") : stdout;
+        if (!file) {
+            fprintf(stderr, "Failed to write profile summary: %s\n", path);
+            return;
+        }
+
+        writeSummary(file);
+        if (file != stdout) {
+            fclose(file);
+        } else {
+            fflush(file);
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+
+#define PROFILER_MAX_QUERIES 4096      // Timestamp queries, two per GPU op awaiting its results
+#define PROFILER_NO_QUERY UINT32_MAX   // Returned when an op is not timed on the GPU
+
+// Opt-in profiler. Host events time API calls and allocations with a wall clock;
+// GPU events time each dispatch, copy and fill with a pair of timestamp queries
+// written around it in the command buffer. Setting VKGRAD_PROFILE=<path> turns
+// it on at startup and writes a Chrome trace there at exit, plus a summary table
+// on stderr.
+bool profilerEnabled();
+
+// Host wall time of the enclosing scope, recorded as one event when profiling is on
+class ProfileScope {
+public:
+    ProfileScope(const char* name, const char* category = "api", uint64_t bytes = 0);
+    ~ProfileScope();
+
+private:
+    const char* name;
+    const char* category;
+    uint64_t bytes;
+    int64_t start;  // -1 when profiling was off on entry
+};
+
+#define PROFILE_SCOPE(name) ProfileScope profileScope(name)
+
+// Set up timestamp queries once the device exists. Queues without timestamp
+// support leave the profiler with host events only.
+void profilerInitGpu(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamilyIndex);
+
+// Around the commands of one GPU op: begin and end write its timestamps into the
+// command buffer, record names the op once the serial of its submission is known
+uint32_t profilerBeginGpu(VkCommandBuffer commandBuffer);
+void profilerEndGpu(VkCommandBuffer commandBuffer, uint32_t query);
+void profilerRecordGpu(uint32_t query, const char* name, const char* category, uint64_t bytes, uint64_t serial);
+
+// Read back the timestamps of ops whose submissions have retired
+void profilerCollectGpu(uint64_t completedSerial);
+
+extern "C" {
+    void profiler_enable(int enabled);
+    void profiler_reset();
+    void profiler_export_trace(const char* path);   // Chrome trace event JSON
+    void profiler_print_summary(const char* path);  // Per-op table; NULL prints to stdout
+}
+
+#endif /* PROFILER_H */
@@ -0,0 +1,76 @@
+// Storage types of the elementwise shaders. Every value is loaded into and
+// stored from a float, so 16-bit and 8-bit tensors only change the bytes
+// moved, not the arithmetic. A shader picks the source and result types with
+// SRC_DTYPE and DST_DTYPE, or both at once with DTYPE; they default to fp32.
+
+#define DTYPE_F32 0   // DType in tensor.h
+#define DTYPE_F16 1
+#define DTYPE_BF16 2
+#define DTYPE_I32 3
+#define DTYPE_I8 4
+
+#ifndef DTYPE
+#define DTYPE DTYPE_F32
+#endif
+#ifndef SRC_DTYPE
+#define SRC_DTYPE DTYPE
+#endif
+#ifndef DST_DTYPE
+#define DST_DTYPE DTYPE
+#endif
+
+#if SRC_DTYPE == DTYPE_F16 || SRC_DTYPE == DTYPE_BF16 || DST_DTYPE == DTYPE_F16 || DST_DTYPE == DTYPE_BF16
+#extension GL_EXT_shader_16bit_storage : require
+#endif
+#if SRC_DTYPE == DTYPE_I8 || DST_DTYPE == DTYPE_I8
+#extension GL_EXT_shader_8bit_storage : require
+#endif
+
+// Round to nearest even on the upper 16 bits of a float; NaNs stay quiet.
+// Matches float_to_bfloat16 in cpu.cpp.
+uint bfloat16Bits(float value) {
+    uint bits = floatBitsToUint(value);
+    if ((bits & 0x7FFFFFFFu) > 0x7F800000u) {
+        return (bits >> 16) | 0x40u;
+    }
+    return (bits + 0x7FFFu + ((bits >> 16) & 1u)) >> 16;
+}
+
+// Integer results truncate toward zero and saturate; NaN becomes 0, as in store_from_float
+int saturateInt(float value, float low, float high) {
+    return isnan(value) ? 0 : (value >= high ? int(high) : int(max(value, low)));
+}
+
+#if SRC_DTYPE == DTYPE_F16
+#define SRC_T float16_t
+#define LOAD_SRC(x) float(x)
+#elif SRC_DTYPE == DTYPE_BF16
+#define SRC_T uint16_t
+#define LOAD_SRC(x) uintBitsToFloat(uint(x) << 16)
+#elif SRC_DTYPE == DTYPE_I32
+#define SRC_T int
+#define LOAD_SRC(x) float(x)
+#elif SRC_DTYPE == DTYPE_I8
+#define SRC_T int8_t
+#define LOAD_SRC(x) float(int(x))
+#else
+#define SRC_T float
+#define LOAD_SRC(x) (x)
+#endif
+
+#if DST_DTYPE == DTYPE_F16
+#define DST_T float16_t
+#define STORE_DST(v) float16_t(v)
+#elif DST_DTYPE == DTYPE_BF16
+#define DST_T uint16_t
+#define STORE_DST(v) uint16_t(bfloat16Bits(v))
+#elif DST_DTYPE == DTYPE_I32
+#define DST_T int
+#define STORE_DST(v) (v >= 2147483648.0 ? 2147483647 : saturateInt(v, -2147483648.0, 2147483520.0))
+#elif DST_DTYPE == DTYPE_I8
+#define DST_T int8_t
+#define STORE_DST(v) int8_t(saturateInt(v, -128.0, 127.0))
+#else
+#define DST_T float
+#define STORE_DST(v) (v)
+#endif
@@ -5,19 +5,529 @@
 #include "tensor.h"
 #include "cpu.h"
 #include "vulkan.h"
+#include "autograd.h"
+#include "profiler.h"
+#include "tensor_file.h"
 
-extern "C"
+static void contiguous_strides(const int *shape, int ndim, int *strides)
 {
-    Tensor *create_tensor(float *data, int *shape, int ndim, char *device)
+    int stride = 1;
+    for (int i = ndim - 1; i >= 0; i--)
+    {
+        strides[i] = stride;
+        stride *= shape[i];
+    }
+}
+
+static int normalize_dim(int dim, int ndim)
+{
+    if (dim < 0)
+    {
+        dim += ndim;
+    }
+    if (dim < 0 || dim >= ndim)
+    {
+        fprintf(stderr, "Dimension %d out of range for a %d-D tensor\n", dim, ndim);
+        exit(1);
+    }
+    return dim;
+}
+
+// Copy src into dst, which has the same shape, on their device
+static void copy_into(Tensor *src, Tensor *dst)
+{
+    if (strcmp(src->device, "vulkan") == 0)
+    {
+        copy_tensor_vulkan(src, dst);
+    }
+    else
+    {
+        copy_tensor_cpu(src, dst);
+    }
+}
+
+// Copy a tensor into new contiguous storage of a possibly different shape with the same size
+static Tensor *copy_reshaped(Tensor *tensor, const int *shape, int ndim)
+{
+    Tensor *result_tensor = empty_tensor(shape, ndim, tensor->device, tensor->dtype);
+
+    // Write through a view of the result with the source's shape
+    int *strides = (int *)malloc(tensor->ndim * sizeof(int));
+    if (strides == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    contiguous_strides(tensor->shape, tensor->ndim, strides);
+    Tensor *window = make_view(result_tensor, tensor->shape, strides, tensor->ndim, 0);
+    copy_into(tensor, window);
+    result_tensor->ready_serial = window->ready_serial;
+
+    destroy_tensor(window);
+    free(strides);
+    return result_tensor;
+}
+
+static void check_dtype(int dtype)
+{
+    if (dtype < DTYPE_FLOAT32 || dtype > DTYPE_INT8)
+    {
+        fprintf(stderr, "Unknown dtype %d\n", dtype);
+        exit(1);
+    }
+}
+
+static Storage *new_storage(void *data, VkBuffer buffer, const DeviceAllocation &allocation)
+{
+    Storage *storage = new Storage();
+    storage->refcount = 1;
+    storage->data = data;
+    storage->buffer = buffer;
+    storage->allocation = allocation;
+    storage->file = NULL;
+    storage->version = 0;
+    return storage;
+}
+
+// Give a view its own contiguous storage on its current device
+static void detach_view(Tensor *tensor)
+{
+    Tensor *copy = copy_tensor(tensor);
+    copy->storage->version = tensor->storage->version.load();
+    release_storage(tensor->storage);
+    tensor->storage = copy->storage;
+    tensor->data = copy->data;
+    tensor->buffer = copy->buffer;
+    tensor->allocation = copy->allocation;
+    tensor->ready_serial = copy->ready_serial;
+    tensor->offset = 0;
+    contiguous_strides(tensor->shape, tensor->ndim, tensor->strides);
+
+    copy->storage = NULL;
+    destroy_tensor(copy);
+}
+
+// Create a view with the given shape whose strides and offset come from geometry,
+// called as geometry(input strides, input offset, view strides, &view offset).
+// Backward scatters the gradient through the same view of a contiguous tensor
+// shaped like the input, so geometry is applied to that layout too.
+template <typename Geometry>
+static Tensor *apply_view(Tensor *tensor, const int *shape, int ndim, Geometry geometry)
+{
+    int *strides = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+    int *input_strides = (int *)malloc((tensor->ndim > 0 ? tensor->ndim : 1) * sizeof(int));
+    if (strides == NULL || input_strides == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    int offset;
+    geometry(tensor->strides, tensor->offset, strides, &offset);
+    Tensor *view = make_view(tensor, shape, strides, ndim, offset);
+
+    contiguous_strides(tensor->shape, tensor->ndim, input_strides);
+    geometry(input_strides, 0, strides, &offset);
+    record_view_grad(view, tensor, strides, offset);
+
+    free(strides);
+    free(input_strides);
+    return view;
+}
+
+// fp32 version of a tensor for kernels that only read fp32: the tensor itself, or a
+// converted copy the caller destroys
+static Tensor *as_float32(Tensor *tensor)
+{
+    return tensor->dtype == DTYPE_FLOAT32 ? tensor : convert_tensor(tensor, DTYPE_FLOAT32);
+}
+
+// Convert an fp32 result computed through as_float32 back to the inputs' dtype
+static Tensor *narrow_result(Tensor *result_tensor, DType dtype)
+{
+    if (result_tensor->dtype == dtype)
+    {
+        return result_tensor;
+    }
+    Tensor *narrowed = convert_tensor(result_tensor, dtype);
+    destroy_tensor(result_tensor);
+    return narrowed;
+}
+
+static void require_floating(Tensor *tensor, const char *name)
+{
+    if (!is_floating(tensor->dtype))
+    {
+        fprintf(stderr, "%s expects floating point tensors\n", name);
+        exit(1);
+    }
+}
+
+// Stride of an operand along dimension d of an ndim-D iteration space. Operands
+// line up from the right and repeat (stride 0) along missing or size-1 dimensions.
+static int broadcast_stride(Tensor *operand, int d, int ndim)
+{
+    int dim = d - (ndim - operand->ndim);
+    if (dim < 0 || operand->shape[dim] == 1)
+    {
+        return 0;
+    }
+    return operand->strides[dim];
+}
+
+// Shared by add_tensor and sub_tensor. Shapes broadcast as in NumPy: they line up
+// from the right, and a missing or size-1 dimension repeats along the other operand.
+// Returns the broadcast shape, which the caller frees.
+static int *broadcast_shape(Tensor *tensor1, Tensor *tensor2, const char *name, int *ndim)
+{
+    if (strcmp(tensor1->device, tensor2->device) != 0)
+    {
+        fprintf(stderr, "Tensors must be on the same device: %s and %s\n", tensor1->device, tensor2->device);
+        exit(1);
+    }
+    require_floating(tensor1, name);
+    require_floating(tensor2, name);
+
+    *ndim = tensor1->ndim > tensor2->ndim ? tensor1->ndim : tensor2->ndim;
+    int *shape = (int *)malloc((*ndim > 0 ? *ndim : 1) * sizeof(int));
+    if (shape == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < *ndim; i++)
+    {
+        int dim1 = i - (*ndim - tensor1->ndim);
+        int dim2 = i - (*ndim - tensor2->ndim);
+        int size1 = dim1 >= 0 ? tensor1->shape[dim1] : 1;
+        int size2 = dim2 >= 0 ? tensor2->shape[dim2] : 1;
+        if (size1 != size2 && size1 != 1 && size2 != 1)
+        {
+            fprintf(stderr, "Tensors with sizes %d and %d at index %d cannot be broadcast for %s\n", size1, size2, i, name);
+            exit(1);
+        }
+        shape[i] = size1 == 1 ? size2 : size1;
+    }
+    return shape;
+}
+
+// Run an elementwise op into result_tensor, which has the broadcast shape. Both
+// backends read strided and broadcast inputs and write strided results directly;
+// inputs of another dtype than the result are converted first.
+static void binary_into(Tensor *tensor1, Tensor *tensor2, Tensor *result_tensor, GradOp op)
+{
+    DType dtype = result_tensor->dtype;
+    Tensor *operand1 = tensor1->dtype == dtype ? tensor1 : convert_tensor(tensor1, dtype);
+    Tensor *operand2 = tensor2->dtype == dtype ? tensor2 : convert_tensor(tensor2, dtype);
+    if (strcmp(tensor1->device, "vulkan") == 0)
+    {
+        if (op == GRAD_ADD)
+        {
+            add_tensor_vulkan(operand1, operand2, result_tensor);
+        }
+        else
+        {
+            sub_tensor_vulkan(operand1, operand2, result_tensor);
+        }
+    }
+    else
+    {
+        if (op == GRAD_ADD)
+        {
+            add_tensor_cpu(operand1, operand2, result_tensor);
+        }
+        else
+        {
+            sub_tensor_cpu(operand1, operand2, result_tensor);
+        }
+    }
+    if (operand1 != tensor1)
     {
+        destroy_tensor(operand1);
+    }
+    if (operand2 != tensor2)
+    {
+        destroy_tensor(operand2);
+    }
+}
+
+// Operands of different dtypes are both computed and stored as fp32
+static Tensor *binary_tensor(Tensor *tensor1, Tensor *tensor2, GradOp op)
+{
+    int ndim;
+    int *shape = broadcast_shape(tensor1, tensor2, op == GRAD_ADD ? "addition" : "subtraction", &ndim);
+
+    // Step 1: Allocate a contiguous result of the broadcast shape on the inputs' device
+    DType dtype = tensor1->dtype == tensor2->dtype ? tensor1->dtype : DTYPE_FLOAT32;
+    Tensor *result_tensor = empty_tensor(shape, ndim, tensor1->device, dtype);
+    free(shape);
+
+    // Step 2: Run the op
+    binary_into(tensor1, tensor2, result_tensor, op);
+
+    // Step 3: Record the op for backward
+    record_grad(result_tensor, op, tensor1, tensor2);
+
+    return result_tensor;
+}
+
+static bool same_memory(Tensor *tensor1, Tensor *tensor2)
+{
+    return (tensor1->buffer != VK_NULL_HANDLE && tensor1->buffer == tensor2->buffer) ||
+           (tensor1->data != NULL && tensor1->data == tensor2->data);
+}
+
+// add_tensor and sub_tensor writing into out, which must already have the broadcast
+// shape and is written in its own dtype. Every element is read before it is
+// written, so an input may be out itself, but not any other view of its memory.
+static void binary_out(Tensor *tensor1, Tensor *tensor2, Tensor *out, GradOp op)
+{
+    const char *name = op == GRAD_ADD ? "addition" : "subtraction";
+    int ndim;
+    int *shape = broadcast_shape(tensor1, tensor2, name, &ndim);
+
+    // Step 1: Check out against the broadcast shape and device
+    bool matches = out->ndim == ndim && strcmp(out->device, tensor1->device) == 0;
+    for (int i = 0; matches && i < ndim; i++)
+    {
+        matches = out->shape[i] == shape[i];
+    }
+    free(shape);
+    if (!matches)
+    {
+        fprintf(stderr, "The output of %s must be on the inputs' device with their broadcast shape\n", name);
+        exit(1);
+    }
+    require_floating(out, name);
+
+    // Step 2: Writes must not race with each other or with reads of other elements
+    for (int d = 0; d < ndim; d++)
+    {
+        if (out->shape[d] > 1 && out->strides[d] == 0)
+        {
+            fprintf(stderr, "The output of %s has elements that share memory\n", name);
+            exit(1);
+        }
+    }
+    Tensor *inputs[2] = {tensor1, tensor2};
+    for (int i = 0; i < 2; i++)
+    {
+        if (!same_memory(inputs[i], out))
+        {
+            continue;
+        }
+        bool aliased = inputs[i]->offset == out->offset && inputs[i]->dtype == out->dtype;
+        for (int d = 0; aliased && d < ndim; d++)
+        {
+            aliased = out->shape[d] == 1 || broadcast_stride(inputs[i], d, ndim) == out->strides[d];
+        }
+        if (!aliased)
+        {
+            fprintf(stderr, "An input of %s shares memory with its output without being the same elements\n", name);
+            exit(1);
+        }
+    }
+
+    // Step 3: Writing over a tensor would lose values backward needs
+    if (records_grad(tensor1, tensor2) || records_grad(out, NULL))
+    {
+        fprintf(stderr, "In-place %s is not differentiable; call it with grad disabled or on tensors without requires_grad\n", name);
+        exit(1);
+    }
+
+    // Step 4: Backward of ops that saved out's memory must see it was overwritten
+    binary_into(tensor1, tensor2, out, op);
+    out->storage->version++;
+}
+
+// Shared by the reductions. Kernels read the input as a contiguous (outer, reduce,
+// inner) array, which a contiguous tensor already is when the reduced dimensions
+// are adjacent; anything else is copied once with the reduced dimensions moved
+// last. The Vulkan kernel reduces rows, so it always needs inner == 1. Kernels
+// read fp32, so other dtypes are converted first and the result converted back,
+// except that int32, which fp32 rounds above 2^24, is reduced as int32.
+static Tensor *reduce_tensor(Tensor *tensor, const int *dims, int ndims, int keepdim, ReduceOp op)
+{
+    if (op == REDUCE_SUM || op == REDUCE_MEAN)
+    {
+        require_floating(tensor, op == REDUCE_SUM ? "sum" : "mean");
+    }
+
+    int ndim = tensor->ndim;
+    char *reduced = (char *)calloc(ndim > 0 ? ndim : 1, 1);
+    int *shape = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+    int *strides = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+    if (reduced == NULL || shape == NULL || strides == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < ndims; i++)
+    {
+        int dim = normalize_dim(dims[i], ndim);
+        if (reduced[dim])
+        {
+            fprintf(stderr, "Reduction dimension %d repeated\n", dim);
+            exit(1);
+        }
+        reduced[dim] = 1;
+    }
+    for (int i = 0; ndims == 0 && i < ndim; i++)
+    {
+        reduced[i] = 1;
+    }
+
+    // Step 1: Work out the result shape and the (outer, reduce, inner) split
+    int out_ndim = 0;
+    int first = -1;
+    int last = -1;
+    long long kept_count = 1;
+    long long reduce_count = 1;
+    for (int i = 0; i < ndim; i++)
+    {
+        if (reduced[i])
+        {
+            reduce_count *= tensor->shape[i];
+            if (tensor->shape[i] != 1)
+            {
+                first = first < 0 ? i : first;
+                last = i;
+            }
+            if (keepdim)
+            {
+                shape[out_ndim++] = 1;
+            }
+        }
+        else
+        {
+            kept_count *= tensor->shape[i];
+            shape[out_ndim++] = tensor->shape[i];
+        }
+    }
+    if ((op == REDUCE_MAX || op == REDUCE_ARGMAX) && reduce_count == 0)
+    {
+        fprintf(stderr, "Cannot take the max over an empty dimension\n");
+        exit(1);
+    }
+
+    long long outer = 1;
+    long long inner = 1;
+    bool adjacent = true;
+    for (int i = 0; i < ndim; i++)
+    {
+        if (first < 0 || i < first)
+        {
+            outer *= tensor->shape[i];
+        }
+        else if (i > last)
+        {
+            inner *= tensor->shape[i];
+        }
+        else if (!reduced[i] && tensor->shape[i] != 1)
+        {
+            adjacent = false;
+        }
+    }
 
-        Tensor *tensor = (Tensor *)malloc(sizeof(Tensor));
-        if (tensor == NULL)
+    bool vulkan = strcmp(tensor->device, "vulkan") == 0;
+    DType compute = tensor->dtype == DTYPE_INT32 ? DTYPE_INT32 : DTYPE_FLOAT32;
+    Tensor *source = tensor;
+    if (tensor->dtype != compute && is_contiguous(tensor) && adjacent && !(vulkan && inner != 1))
+    {
+        source = as_float32(tensor);
+    }
+    else if (!is_contiguous(tensor) || !adjacent || (vulkan && inner != 1) || tensor->dtype != compute)
+    {
+        // Step 2: Copy through a permuted view with the kept dimensions first
+        int *permuted = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+        if (permuted == NULL)
         {
             fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
+        int next = 0;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int i = 0; i < ndim; i++)
+            {
+                if (reduced[i] == pass)
+                {
+                    permuted[next] = tensor->shape[i];
+                    strides[next++] = tensor->strides[i];
+                }
+            }
+        }
+        Tensor *view = make_view(tensor, permuted, strides, ndim, tensor->offset);
+        source = convert_tensor(view, compute);
+        destroy_tensor(view);
+        free(permuted);
+
+        outer = kept_count;
+        inner = 1;
+    }
+
+    // Step 3: Reduce on the input's device; only the result is written back
+    Tensor *result_tensor = empty_tensor(shape, out_ndim, tensor->device, op == REDUCE_ARGMAX ? DTYPE_INT32 : compute);
+    float scale = op == REDUCE_MEAN ? 1.0f / (float)reduce_count : 1.0f;
+    if (result_tensor->size > 0 && vulkan)
+    {
+        reduce_vulkan(op, source, result_tensor, (int)outer, (int)reduce_count, scale);
+    }
+    else if (result_tensor->size > 0 && compute == DTYPE_INT32)
+    {
+        reduce_cpu_int32(op, (const int32_t *)source->data + source->offset, (int32_t *)result_tensor->data, outer, reduce_count, inner);
+    }
+    else if (result_tensor->size > 0)
+    {
+        reduce_cpu(op, (const float *)source->data + source->offset, result_tensor->data, outer, reduce_count, inner, scale);
+    }
+    if (source != tensor)
+    {
+        destroy_tensor(source);
+    }
+    if (op != REDUCE_ARGMAX)
+    {
+        result_tensor = narrow_result(result_tensor, tensor->dtype);
+    }
+
+    // Step 4: Record sums for backward, which reads the result's gradient at
+    // every input element (stride 0 along the reduced dimensions). The max is
+    // not differentiated.
+    if (op == REDUCE_SUM || op == REDUCE_MEAN)
+    {
+        int out_dim = 0;
+        for (int i = 0; i < ndim; i++)
+        {
+            strides[i] = reduced[i] ? 0 : result_tensor->strides[out_dim];
+            out_dim += !reduced[i] || keepdim;
+        }
+        record_reduce_grad(result_tensor, tensor, strides, scale);
+    }
+
+    free(strides);
+    free(shape);
+    free(reduced);
+    return result_tensor;
+}
+
+extern "C"
+{
+    Tensor *create_tensor(float *data, int *shape, int ndim, char *device)
+    {
+
+        Tensor *tensor = new Tensor();
+        tensor->refcount = 1;
         tensor->data = data;
+        tensor->dtype = DTYPE_FLOAT32;
+        tensor->buffer = VK_NULL_HANDLE;
+        memset(&tensor->allocation, 0, sizeof(DeviceAllocation));
+        tensor->ready_serial = 0;
+        tensor->offset = 0;
+        DeviceAllocation none = {};
+        tensor->storage = new_storage(NULL, VK_NULL_HANDLE, none);
+        tensor->requires_grad = 0;
+        tensor->grad = NULL;
+        tensor->grad_fn = NULL;
         tensor->shape = shape;
         tensor->ndim = ndim;
 
@@ -38,212 +548,934 @@ extern "C"
             tensor->size *= shape[i];
         }
 
-        tensor->strides = (int *)malloc(ndim * sizeof(int));
-        if (tensor->strides == NULL)
+        tensor->strides = (int *)malloc(ndim * sizeof(int));
+        if (tensor->strides == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        int stride = 1;
+        for (int i = ndim - 1; i >= 0; i--)
+        {
+            tensor->strides[i] = stride;
+            stride *= shape[i];
+        }
+
+        return tensor;
+    }
+
+    Tensor *wrap_tensor(void *data, int *shape, int *strides, int ndim, int dtype)
+    {
+        check_dtype(dtype);
+        int *shape_copy = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+        if (shape_copy == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        memcpy(shape_copy, shape, ndim * sizeof(int));
+
+        Tensor *tensor = create_tensor((float *)data, shape_copy, ndim, (char *)"cpu");
+        tensor->dtype = (DType)dtype;
+        memcpy(tensor->strides, strides, ndim * sizeof(int));
+        return tensor;
+    }
+
+    void free_tensor(Tensor *tensor)
+    {
+        destroy_tensor(tensor);
+    }
+
+    void retain_tensor(Tensor *tensor)
+    {
+        tensor->refcount++;
+    }
+
+    Tensor *share_storage(Tensor *tensor)
+    {
+        return make_view(tensor, tensor->shape, tensor->strides, tensor->ndim, tensor->offset);
+    }
+
+    float get_item(Tensor *tensor, int *indices)
+    {
+        PROFILE_SCOPE("get_item");
+        int index = tensor->offset;
+        for (int i = 0; i < tensor->ndim; i++)
+        {
+            index += indices[i] * tensor->strides[i];
+        }
+
+        // Room for one element of any dtype
+        size_t element = dtype_size(tensor->dtype);
+        float value[1];
+        if (strcmp(tensor->device, "vulkan") == 0)
+        {
+            // Waits for the op producing the tensor, then reads back one element,
+            // straight from the buffer on unified memory
+            readTensorBuffer(getVulkanContext(), tensor->buffer, tensor->allocation, index * element, value, element);
+        }
+        else
+        {
+            memcpy(value, (char *)tensor->data + index * element, element);
+        }
+
+        float result;
+        load_as_float(tensor->dtype, value, &result, 1);
+        return result;
+    }
+
+    void to_device(Tensor *tensor, char *target_device)
+    {
+        ProfileScope scope("to_device", "api", tensor->size * dtype_size(tensor->dtype));
+        // printf("Transferring tensor from %s to %s\n", tensor->device, target_device);
+        if ((tensor->offset != 0 || !is_contiguous(tensor)) && strcmp(target_device, tensor->device) != 0)
+        {
+            // Transfers copy a dense block of elements from the start of the storage.
+            // Other tensors sharing the storage keep the old copy either way.
+            detach_view(tensor);
+        }
+
+        if ((strcmp(target_device, "vulkan") == 0) && (strcmp(tensor->device, "cpu") == 0))
+        {
+            cpu_to_vulkan(tensor);
+        }
+        else if ((strcmp(target_device, "cpu") == 0) && (strcmp(tensor->device, "vulkan") == 0))
+        {
+            vulkan_to_cpu(tensor);
+        }
+    }
+
+    Tensor *to_dtype(Tensor *tensor, int dtype)
+    {
+        PROFILE_SCOPE("to_dtype");
+        check_dtype(dtype);
+
+        // Casts between floating types are differentiable; the gradient is cast back
+        Tensor *result_tensor = convert_tensor(tensor, (DType)dtype);
+        if (is_floating(tensor->dtype) && is_floating((DType)dtype))
+        {
+            record_grad(result_tensor, GRAD_CAST, tensor, NULL);
+        }
+        return result_tensor;
+    }
+
+    Tensor *add_tensor(Tensor *tensor1, Tensor *tensor2)
+    {
+        PROFILE_SCOPE("add_tensor");
+        return binary_tensor(tensor1, tensor2, GRAD_ADD);
+    }
+
+    Tensor *sub_tensor(Tensor *tensor1, Tensor *tensor2)
+    {
+        PROFILE_SCOPE("sub_tensor");
+        return binary_tensor(tensor1, tensor2, GRAD_SUB);
+    }
+
+    void add_(Tensor *tensor, Tensor *other)
+    {
+        PROFILE_SCOPE("add_");
+        binary_out(tensor, other, tensor, GRAD_ADD);
+    }
+
+    void sub_(Tensor *tensor, Tensor *other)
+    {
+        PROFILE_SCOPE("sub_");
+        binary_out(tensor, other, tensor, GRAD_SUB);
+    }
+
+    void add_out(Tensor *tensor1, Tensor *tensor2, Tensor *out)
+    {
+        PROFILE_SCOPE("add_out");
+        binary_out(tensor1, tensor2, out, GRAD_ADD);
+    }
+
+    void sub_out(Tensor *tensor1, Tensor *tensor2, Tensor *out)
+    {
+        PROFILE_SCOPE("sub_out");
+        binary_out(tensor1, tensor2, out, GRAD_SUB);
+    }
+
+    Tensor *matmul(Tensor *tensor1, Tensor *tensor2)
+    {
+        PROFILE_SCOPE("matmul");
+        if (tensor1->ndim != 2 || tensor2->ndim != 2)
+        {
+            fprintf(stderr, "matmul expects 2-D tensors, got %d and %d dimensions\n", tensor1->ndim, tensor2->ndim);
+            exit(1);
+        }
+
+        Tensor *result_tensor = gemm_tensor(tensor1, tensor2, false, false);
+        record_grad(result_tensor, GRAD_MATMUL, tensor1, tensor2);
+        return result_tensor;
+    }
+
+    Tensor *bmm(Tensor *tensor1, Tensor *tensor2)
+    {
+        PROFILE_SCOPE("bmm");
+        if (tensor1->ndim != 3 || tensor2->ndim != 3)
+        {
+            fprintf(stderr, "bmm expects 3-D tensors, got %d and %d dimensions\n", tensor1->ndim, tensor2->ndim);
+            exit(1);
+        }
+
+        Tensor *result_tensor = gemm_tensor(tensor1, tensor2, false, false);
+        record_grad(result_tensor, GRAD_MATMUL, tensor1, tensor2);
+        return result_tensor;
+    }
+
+    Tensor *sum_tensor(Tensor *tensor, int *dims, int ndims, int keepdim)
+    {
+        PROFILE_SCOPE("sum_tensor");
+        return reduce_tensor(tensor, dims, ndims, keepdim, REDUCE_SUM);
+    }
+
+    Tensor *mean_tensor(Tensor *tensor, int *dims, int ndims, int keepdim)
+    {
+        PROFILE_SCOPE("mean_tensor");
+        return reduce_tensor(tensor, dims, ndims, keepdim, REDUCE_MEAN);
+    }
+
+    Tensor *max_tensor(Tensor *tensor, int *dims, int ndims, int keepdim)
+    {
+        PROFILE_SCOPE("max_tensor");
+        return reduce_tensor(tensor, dims, ndims, keepdim, REDUCE_MAX);
+    }
+
+    Tensor *argmax_tensor(Tensor *tensor, int dim, int keepdim)
+    {
+        PROFILE_SCOPE("argmax_tensor");
+        return reduce_tensor(tensor, &dim, 1, keepdim, REDUCE_ARGMAX);
+    }
+
+    Tensor *slice(Tensor *tensor, int dim, int start, int end, int step)
+    {
+        dim = normalize_dim(dim, tensor->ndim);
+        if (step <= 0)
+        {
+            fprintf(stderr, "Slice step must be positive, got %d\n", step);
+            exit(1);
+        }
+
+        // Python semantics: negative bounds count from the end and are clamped
+        int size = tensor->shape[dim];
+        start = start < 0 ? start + size : start;
+        end = end < 0 ? end + size : end;
+        start = start < 0 ? 0 : (start > size ? size : start);
+        end = end < start ? start : (end > size ? size : end);
+
+        int *shape = (int *)malloc(tensor->ndim * sizeof(int));
+        if (shape == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        memcpy(shape, tensor->shape, tensor->ndim * sizeof(int));
+        shape[dim] = (end - start + step - 1) / step;
+
+        int ndim = tensor->ndim;
+        Tensor *view = apply_view(tensor, shape, ndim, [&](const int *strides, int offset, int *view_strides, int *view_offset)
+        {
+            memcpy(view_strides, strides, ndim * sizeof(int));
+            view_strides[dim] = strides[dim] * step;
+            *view_offset = offset + start * strides[dim];
+        });
+
+        free(shape);
+        return view;
+    }
+
+    Tensor *transpose(Tensor *tensor, int dim0, int dim1)
+    {
+        int *dims = (int *)malloc((tensor->ndim > 0 ? tensor->ndim : 1) * sizeof(int));
+        if (dims == NULL)
         {
             fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
-        int stride = 1;
-        for (int i = ndim - 1; i >= 0; i--)
+        for (int i = 0; i < tensor->ndim; i++)
         {
-            tensor->strides[i] = stride;
-            stride *= shape[i];
+            dims[i] = i;
         }
+        dim0 = normalize_dim(dim0, tensor->ndim);
+        dim1 = normalize_dim(dim1, tensor->ndim);
+        dims[dim0] = dim1;
+        dims[dim1] = dim0;
 
-        return tensor;
+        Tensor *view = permute(tensor, dims);
+        free(dims);
+        return view;
     }
 
-    float get_item(Tensor *tensor, int *indices)
+    Tensor *permute(Tensor *tensor, int *dims)
     {
-        int index = 0;
-        for (int i = 0; i < tensor->ndim; i++)
+        int ndim = tensor->ndim;
+        int *shape = (int *)calloc(ndim > 0 ? ndim : 1, sizeof(int));
+        char *seen = (char *)calloc(ndim > 0 ? ndim : 1, 1);
+        if (shape == NULL || seen == NULL)
         {
-            index += indices[i] * tensor->strides[i];
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
         }
 
-        float result;
-        result = tensor->data[index];
+        for (int i = 0; i < ndim; i++)
+        {
+            int dim = normalize_dim(dims[i], ndim);
+            if (seen[dim])
+            {
+                fprintf(stderr, "permute: dimension %d repeated\n", dim);
+                exit(1);
+            }
+            seen[dim] = 1;
+            shape[i] = tensor->shape[dim];
+        }
 
-        return result;
+        Tensor *view = apply_view(tensor, shape, ndim, [&](const int *strides, int offset, int *view_strides, int *view_offset)
+        {
+            for (int i = 0; i < ndim; i++)
+            {
+                view_strides[i] = strides[normalize_dim(dims[i], ndim)];
+            }
+            *view_offset = offset;
+        });
+
+        free(seen);
+        free(shape);
+        return view;
     }
 
-    void to_device(Tensor *tensor, char *target_device)
+    Tensor *reshape(Tensor *tensor, int *shape, int ndim)
     {
-        // printf("Transferring tensor from %s to %s\n", tensor->device, target_device);
-        if ((strcmp(target_device, "vulkan") == 0) && (strcmp(tensor->device, "cpu") == 0))
+        // Resolve a single -1 from the remaining size
+        int *resolved = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+        if (resolved == NULL)
         {
-            cpu_to_vulkan(tensor);
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
         }
-        else if ((strcmp(target_device, "cpu") == 0) && (strcmp(tensor->device, "vulkan") == 0))
+        int known = 1;
+        int inferred = -1;
+        for (int i = 0; i < ndim; i++)
         {
-            vulkan_to_cpu(tensor);
+            resolved[i] = shape[i];
+            if (shape[i] == -1 && inferred < 0)
+            {
+                inferred = i;
+            }
+            else
+            {
+                known *= shape[i];
+            }
         }
-    }
-
-    Tensor *add_tensor(Tensor *tensor1, Tensor *tensor2)
-    {
-        if (tensor1->ndim != tensor2->ndim)
+        if (inferred >= 0 && known > 0)
+        {
+            resolved[inferred] = tensor->size / known;
+            known *= resolved[inferred];
+        }
+        if (known != tensor->size)
         {
-            fprintf(stderr, "Tensors must have the same number of dimensions %d and %d for addition\n", tensor1->ndim, tensor2->ndim);
+            fprintf(stderr, "Cannot reshape a tensor of %d elements to the requested shape\n", tensor->size);
             exit(1);
         }
 
-        if (strcmp(tensor1->device, tensor2->device) != 0)
+        // Contiguous tensors are reinterpreted in place; anything else is copied once
+        Tensor *result_tensor;
+        int *strides = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+        if (strides == NULL)
         {
-            fprintf(stderr, "Tensors must be on the same device: %s and %s\n", tensor1->device, tensor2->device);
+            fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
+        contiguous_strides(resolved, ndim, strides);
 
-        char *device = (char *)malloc(strlen(tensor1->device) + 1);
-        if (device != NULL)
+        if (is_contiguous(tensor))
         {
-            strcpy(device, tensor1->device);
+            result_tensor = apply_view(tensor, resolved, ndim, [&](const int *, int offset, int *view_strides, int *view_offset)
+            {
+                memcpy(view_strides, strides, ndim * sizeof(int));
+                *view_offset = offset;
+            });
         }
         else
         {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(-1);
+            result_tensor = copy_reshaped(tensor, resolved, ndim);
+            record_view_grad(result_tensor, tensor, strides, 0);
         }
 
-        int ndim = tensor1->ndim;
-        int *shape = (int *)malloc(ndim * sizeof(int));
-        if (shape == NULL)
+        free(strides);
+        free(resolved);
+        return result_tensor;
+    }
+
+    Tensor *expand(Tensor *tensor, int *shape, int ndim)
+    {
+        if (ndim < tensor->ndim)
         {
-            fprintf(stderr, "Memory allocation failed\n");
+            fprintf(stderr, "expand: cannot expand a %d-D tensor to %d dimensions\n", tensor->ndim, ndim);
             exit(1);
         }
 
+        // Dimensions line up from the right; new and size-1 dimensions repeat with stride 0
+        int lead = ndim - tensor->ndim;
+        int *resolved = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+        int *strides = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+        if (resolved == NULL || strides == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
         for (int i = 0; i < ndim; i++)
         {
-            if (tensor1->shape[i] != tensor2->shape[i])
+            int size = i < lead ? 1 : tensor->shape[i - lead];
+            int stride = i < lead ? 0 : tensor->strides[i - lead];
+            resolved[i] = shape[i] == -1 && i >= lead ? size : shape[i];
+            if (resolved[i] == size)
+            {
+                strides[i] = size == 1 ? 0 : stride;
+            }
+            else if (size == 1 && resolved[i] >= 0)
+            {
+                strides[i] = 0;
+            }
+            else
             {
-                fprintf(stderr, "Tensors must have the same shape %d and %d at index %d for addition\n", tensor1->shape[i], tensor2->shape[i], i);
+                fprintf(stderr, "expand: size %d at index %d cannot become %d\n", size, i, shape[i]);
                 exit(1);
             }
-            shape[i] = tensor1->shape[i];
         }
 
-        if (strcmp(tensor1->device, "vulkan") == 0)
-        {
-            // Step 1: Retrieve the Vulkan context
-            VulkanContext *context = getVulkanContext();
-
-            // Step 2: Create a result buffer for Vulkan
-            VkBuffer resultBuffer;
-            VkDeviceMemory resultMemory;
-            createBuffer(context->device, context->physicalDevice, tensor1->size * sizeof(float),
-                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, resultBuffer, resultMemory);
+        Tensor *view = make_view(tensor, resolved, strides, ndim, tensor->offset);
+        record_grad(view, GRAD_EXPAND, tensor, NULL);
 
-            // Step 3: Create a result tensor and associate it with the result buffer
-            Tensor *result_tensor = (Tensor *)malloc(sizeof(Tensor));
-            result_tensor->buffer = resultBuffer;
-            result_tensor->memory = resultMemory;
-            result_tensor->size = tensor1->size;
-            result_tensor->ndim = ndim;
-            result_tensor->shape = shape;
-            result_tensor->device = device;
+        free(strides);
+        free(resolved);
+        return view;
+    }
 
-            // Step 4: Call the Vulkan tensor addition function
-            add_tensor_vulkan(tensor1, tensor2, result_tensor);
+    Tensor *contiguous(Tensor *tensor)
+    {
+        PROFILE_SCOPE("contiguous");
+        int *strides = (int *)malloc((tensor->ndim > 0 ? tensor->ndim : 1) * sizeof(int));
+        if (strides == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        contiguous_strides(tensor->shape, tensor->ndim, strides);
 
-            return result_tensor;
+        // Already contiguous: a view sharing the storage
+        Tensor *result_tensor;
+        if (is_contiguous(tensor))
+        {
+            result_tensor = apply_view(tensor, tensor->shape, tensor->ndim, [&](const int *input_strides, int offset, int *view_strides, int *view_offset)
+            {
+                memcpy(view_strides, input_strides, tensor->ndim * sizeof(int));
+                *view_offset = offset;
+            });
         }
         else
         {
-            // CPU-based tensor addition
-            float *result_data = (float *)malloc(tensor1->size * sizeof(float));
-            if (result_data == NULL)
+            result_tensor = copy_tensor(tensor);
+            record_view_grad(result_tensor, tensor, strides, 0);
+        }
+
+        free(strides);
+        return result_tensor;
+    }
+
+    int is_contiguous(Tensor *tensor)
+    {
+        int expected = 1;
+        for (int i = tensor->ndim - 1; i >= 0; i--)
+        {
+            if (tensor->shape[i] != 1 && tensor->strides[i] != expected)
             {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
+                return 0;
             }
-            add_tensor_cpu(tensor1, tensor2, result_data);
-            return create_tensor(result_data, shape, ndim, device);
+            expected *= tensor->shape[i];
         }
+        return 1;
     }
 
-    Tensor *sub_tensor(Tensor *tensor1, Tensor *tensor2)
+    void get_vulkan_memory_stats(DeviceAllocatorStats *stats)
+    {
+        VulkanContext *context = getVulkanContext();
+        *stats = getDeviceAllocatorStats(&context->allocator);
+        std::lock_guard<std::mutex> lock(context->bufferCache.mutex);
+        stats->cachedBytes = context->bufferCache.cachedBytes;
+    }
+
+    void empty_cache()
+    {
+        emptyBufferCache(getVulkanContext());
+    }
+
+    void set_async(int enabled)
     {
-        if (tensor1->ndim != tensor2->ndim)
+        VulkanContext *context = getVulkanContext();
+        if (!enabled)
         {
-            fprintf(stderr, "Tensors must have the same number of dimensions %d and %d for subtraction\n", tensor1->ndim, tensor2->ndim);
-            exit(1);
+            waitForIdle(context);
         }
+        context->asyncMode = enabled != 0;
+    }
 
-        if (strcmp(tensor1->device, tensor2->device) != 0)
+    void set_lazy(int enabled)
+    {
+        VulkanContext *context = getVulkanContext();
+        if (!enabled)
         {
-            fprintf(stderr, "Tensors must be on the same device: %s and %s\n", tensor1->device, tensor2->device);
-            exit(1);
+            flushPendingCommands(context);
         }
+        context->lazyMode = enabled != 0;
+    }
 
-        char *device = (char *)malloc(strlen(tensor1->device) + 1);
-        if (device != NULL)
+    void synchronize()
+    {
+        PROFILE_SCOPE("synchronize");
+        waitForIdle(getVulkanContext());
+    }
+
+    int tensor_ready(Tensor *tensor)
+    {
+        if (strcmp(tensor->device, "vulkan") != 0)
         {
-            strcpy(device, tensor1->device);
+            return 1;
         }
-        else
+        VulkanContext *context = getVulkanContext();
+        retireSubmissions(context);
+        return tensor->ready_serial <= context->completedSerial;
+    }
+
+    void wait_tensor(Tensor *tensor)
+    {
+        PROFILE_SCOPE("wait_tensor");
+        if (strcmp(tensor->device, "vulkan") == 0)
         {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(-1);
+            waitForSerial(getVulkanContext(), tensor->ready_serial);
         }
+    }
+}
 
-        int ndim = tensor1->ndim;
-        int *shape = (int *)malloc(ndim * sizeof(int));
-        if (shape == NULL)
+// Allocate an uninitialised tensor with its own copy of the shape, on the CPU or in a Vulkan buffer
+Tensor *empty_tensor(const int *shape, int ndim, const char *device, DType dtype)
+{
+    int *shape_copy = (int *)malloc(ndim * sizeof(int));
+    if (shape_copy == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(shape_copy, shape, ndim * sizeof(int));
+
+    Tensor *tensor = create_tensor(NULL, shape_copy, ndim, (char *)device);
+    tensor->dtype = dtype;
+
+    if (strcmp(device, "vulkan") == 0)
+    {
+        VkBuffer buffer;
+        DeviceAllocation allocation;
+        if (createTensorBuffer(getVulkanContext(), tensorBufferSize(tensor), buffer, allocation) != VK_SUCCESS)
+        {
+            fprintf(stderr, "Failed to allocate Vulkan result buffer\n");
+            exit(1);
+        }
+        replace_storage(tensor, NULL, buffer, allocation);
+    }
+    else
+    {
+        ProfileScope scope("malloc", "alloc", tensor->size * dtype_size(dtype));
+        void *data = host_alloc(tensor->size * dtype_size(dtype));
+        if (data == NULL)
         {
             fprintf(stderr, "Memory allocation failed\n");
             exit(1);
         }
+        DeviceAllocation none = {};
+        replace_storage(tensor, data, VK_NULL_HANDLE, none);
+    }
 
-        for (int i = 0; i < ndim; i++)
+    return tensor;
+}
+
+// Host memory for tensor data, released with free(). Large blocks are
+// page-aligned and padded to whole pages, so a device with host memory import
+// can use them without a staging copy.
+void *host_alloc(size_t bytes)
+{
+    if (bytes < HOST_ALIGNED_MIN_BYTES)
+    {
+        return malloc(bytes);
+    }
+
+    void *data = NULL;
+    size_t padded = (bytes + HOST_ALIGNMENT - 1) / HOST_ALIGNMENT * HOST_ALIGNMENT;
+    if (posix_memalign(&data, HOST_ALIGNMENT, padded) != 0)
+    {
+        return NULL;
+    }
+    return data;
+}
+
+// The matmul kernels read each matrix of a batch row-major or transposed, with
+// the matrices packed back to back. Returns the tensor itself if it is laid out
+// that way, with stored_transposed set for the transposed case, or a contiguous copy.
+static Tensor *matrix_operand(Tensor *tensor, bool *stored_transposed)
+{
+    int ndim = tensor->ndim;
+    int rows = tensor->shape[ndim - 2];
+    int cols = tensor->shape[ndim - 1];
+    int row_stride = tensor->strides[ndim - 2];
+    int col_stride = tensor->strides[ndim - 1];
+    bool packed = ndim == 2 || tensor->shape[0] == 1 || tensor->strides[0] == rows * cols;
+
+    if (packed && (cols == 1 || col_stride == 1) && (rows == 1 || row_stride == cols))
+    {
+        *stored_transposed = false;
+        return tensor;
+    }
+    if (packed && (rows == 1 || row_stride == 1) && (cols == 1 || col_stride == rows))
+    {
+        *stored_transposed = true;
+        return tensor;
+    }
+
+    *stored_transposed = false;
+    return copy_tensor(tensor);
+}
+
+// op(tensor1) @ op(tensor2) for 2-D matrices or 3-D batches of them, where op
+// swaps the last two dimensions when the matching trans flag is set
+Tensor *gemm_tensor(Tensor *tensor1, Tensor *tensor2, bool trans_a, bool trans_b)
+{
+    if (tensor1->ndim != tensor2->ndim || tensor1->ndim < 2 || tensor1->ndim > 3)
+    {
+        fprintf(stderr, "Matrix multiplication expects two 2-D or two 3-D tensors, got %d and %d dimensions\n", tensor1->ndim, tensor2->ndim);
+        exit(1);
+    }
+
+    if (strcmp(tensor1->device, tensor2->device) != 0)
+    {
+        fprintf(stderr, "Tensors must be on the same device: %s and %s\n", tensor1->device, tensor2->device);
+        exit(1);
+    }
+    require_floating(tensor1, "Matrix multiplication");
+    require_floating(tensor2, "Matrix multiplication");
+
+    int ndim = tensor1->ndim;
+    int batch = ndim == 3 ? tensor1->shape[0] : 1;
+    if (ndim == 3 && tensor2->shape[0] != batch)
+    {
+        fprintf(stderr, "Tensors must have the same batch size %d and %d for matrix multiplication\n", batch, tensor2->shape[0]);
+        exit(1);
+    }
+
+    int m = tensor1->shape[ndim - (trans_a ? 1 : 2)];
+    int k = tensor1->shape[ndim - (trans_a ? 2 : 1)];
+    int k2 = tensor2->shape[ndim - (trans_b ? 1 : 2)];
+    int n = tensor2->shape[ndim - (trans_b ? 2 : 1)];
+    if (k != k2)
+    {
+        fprintf(stderr, "Inner dimensions must match %d and %d for matrix multiplication\n", k, k2);
+        exit(1);
+    }
+
+    // Transposed views are read as transposed operands; other layouts are copied.
+    // The kernels read fp32, so narrower inputs are widened first.
+    Tensor *input1 = as_float32(tensor1);
+    Tensor *input2 = as_float32(tensor2);
+    bool stored_transposed;
+    Tensor *operand1 = matrix_operand(input1, &stored_transposed);
+    trans_a = trans_a != stored_transposed;
+    Tensor *operand2 = matrix_operand(input2, &stored_transposed);
+    trans_b = trans_b != stored_transposed;
+
+    int shape[3] = {batch, m, n};
+    Tensor *result_tensor = empty_tensor(shape + (3 - ndim), ndim, tensor1->device, DTYPE_FLOAT32);
+
+    if (strcmp(tensor1->device, "vulkan") == 0)
+    {
+        matmul_tensor_vulkan(operand1, operand2, result_tensor, batch, m, n, k, trans_a, trans_b);
+    }
+    else
+    {
+        matmul_cpu((const float *)operand1->data + operand1->offset, (const float *)operand2->data + operand2->offset,
+                   (float *)result_tensor->data, batch, m, n, k, trans_a, trans_b);
+    }
+
+    Tensor *temporaries[4] = {operand1, operand2, input1, input2};
+    for (int i = 0; i < 4; i++)
+    {
+        bool repeated = temporaries[i] == tensor1 || temporaries[i] == tensor2;
+        for (int j = 0; j < i; j++)
         {
-            if (tensor1->shape[i] != tensor2->shape[i])
-            {
-                fprintf(stderr, "Tensors must have the same shape %d and %d at index %d for addition\n", tensor1->shape[i], tensor2->shape[i], i);
-                exit(1);
-            }
-            shape[i] = tensor1->shape[i];
+            repeated = repeated || temporaries[j] == temporaries[i];
         }
-
-        if (strcmp(tensor1->device, "vulkan") == 0)
+        if (!repeated)
         {
-            // Step 1: Retrieve the Vulkan context
-            VulkanContext *context = getVulkanContext();
+            destroy_tensor(temporaries[i]);
+        }
+    }
+
+    // Mixed dtypes keep the fp32 result
+    return narrow_result(result_tensor, tensor1->dtype == tensor2->dtype ? tensor1->dtype : DTYPE_FLOAT32);
+}
+
+// Drop a reference to a tensor, freeing it once none are left. Its storage is
+// freed with the last tensor or view using it.
+void destroy_tensor(Tensor *tensor)
+{
+    if (--tensor->refcount > 0)
+    {
+        return;
+    }
+
+    release_storage(tensor->storage);
+    if (tensor->grad != NULL)
+    {
+        destroy_tensor(tensor->grad);
+    }
+    free_grad_node(tensor->grad_fn);
+    free(tensor->shape);
+    free(tensor->strides);
+    free(tensor->device);
+    delete tensor;
+}
+
+// Point a tensor at new storage owning data or buffer, releasing what it used before
+void replace_storage(Tensor *tensor, void *data, VkBuffer buffer, const DeviceAllocation &allocation)
+{
+    // The values are the same wherever they live, so the version carries over
+    Storage *storage = new_storage(data, buffer, allocation);
+    if (tensor->storage != NULL)
+    {
+        storage->version = tensor->storage->version.load();
+    }
+    release_storage(tensor->storage);
+
+    tensor->storage = storage;
+    tensor->data = data;
+    tensor->buffer = buffer;
+    tensor->allocation = allocation;
+    tensor->offset = 0;
+}
 
-            // Step 2: Create a result buffer for Vulkan
-            VkBuffer resultBuffer;
-            VkDeviceMemory resultMemory;
-            createBuffer(context->device, context->physicalDevice, tensor1->size * sizeof(float),
-                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, resultBuffer, resultMemory);
+void release_storage(Storage *storage)
+{
+    if (storage == NULL || --storage->refcount > 0)
+    {
+        return;
+    }
 
-            // Step 3: Create a result tensor and associate it with the result buffer
-            Tensor *result_tensor = (Tensor *)malloc(sizeof(Tensor));
-            result_tensor->buffer = resultBuffer;
-            result_tensor->memory = resultMemory;
-            result_tensor->size = tensor1->size;
-            result_tensor->ndim = ndim;
-            result_tensor->shape = shape;
-            result_tensor->device = device;
+    // The buffer goes back to the cache once work still using it retires. Host
+    // memory imported as the buffer must outlive the import, so it goes with it.
+    if (storage->allocation.imported)
+    {
+        destroyBuffer(getVulkanContext(), storage->buffer, storage->allocation, storage->data);
+        storage->data = NULL;
+    }
+    else if (storage->buffer != VK_NULL_HANDLE)
+    {
+        destroyTensorBuffer(getVulkanContext(), storage->buffer, storage->allocation);
+    }
+    if (storage->file != NULL)
+    {
+        releaseTensorFile(storage->file);
+    }
+    free(storage->data);
+    delete storage;
+}
 
-            // Step 4: Call the Vulkan tensor addition function
-            sub_tensor_vulkan(tensor1, tensor2, result_tensor);
+void strided_layout(StridedLayout *layout, const int *shape, int ndim, Tensor *const *operands, int count)
+{
+    layout->count = count;
+    layout->size = 1;
+    for (int i = 0; i < ndim; i++)
+    {
+        layout->size *= shape[i];
+    }
+    for (int i = 0; i < count; i++)
+    {
+        layout->offsets[i] = operands[i]->offset;
+    }
 
-            return result_tensor;
+    // Walk from the innermost dimension outwards, growing the current merged
+    // dimension while every operand steps through the next one contiguously
+    int merged = 0;
+    for (int d = ndim - 1; d >= 0; d--)
+    {
+        if (shape[d] == 1)
+        {
+            continue;
         }
-        else
+
+        if (merged > 0)
         {
-            // CPU-based tensor addition
-            float *result_data = (float *)malloc(tensor1->size * sizeof(float));
-            if (result_data == NULL)
+            int last = merged - 1;
+            bool mergeable = true;
+            for (int i = 0; i < count; i++)
             {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
+                if (broadcast_stride(operands[i], d, ndim) != layout->strides[i][last] * layout->shape[last])
+                {
+                    mergeable = false;
+                }
+            }
+            if (mergeable)
+            {
+                layout->shape[last] *= shape[d];
+                continue;
             }
-            sub_tensor_cpu(tensor1, tensor2, result_data);
-            return create_tensor(result_data, shape, ndim, device);
         }
+
+        if (merged == STRIDED_MAX_DIMS)
+        {
+            fprintf(stderr, "Elementwise ops support up to %d non-contiguous dimensions\n", STRIDED_MAX_DIMS);
+            exit(1);
+        }
+        layout->shape[merged] = shape[d];
+        for (int i = 0; i < count; i++)
+        {
+            layout->strides[i][merged] = broadcast_stride(operands[i], d, ndim);
+        }
+        merged++;
+    }
+
+    if (merged == 0)
+    {
+        layout->shape[0] = 1;
+        for (int i = 0; i < count; i++)
+        {
+            layout->strides[i][0] = 0;
+        }
+        merged = 1;
+    }
+
+    // Dimensions were collected innermost first
+    for (int lo = 0, hi = merged - 1; lo < hi; lo++, hi--)
+    {
+        int size = layout->shape[lo];
+        layout->shape[lo] = layout->shape[hi];
+        layout->shape[hi] = size;
+        for (int i = 0; i < count; i++)
+        {
+            int stride = layout->strides[i][lo];
+            layout->strides[i][lo] = layout->strides[i][hi];
+            layout->strides[i][hi] = stride;
+        }
+    }
+    layout->ndim = merged;
+}
+
+// A tensor sharing the storage of another with its own shape, strides and offset
+Tensor *make_view(Tensor *tensor, const int *shape, const int *strides, int ndim, int offset)
+{
+    int *shape_copy = (int *)malloc((ndim > 0 ? ndim : 1) * sizeof(int));
+    if (shape_copy == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(shape_copy, shape, ndim * sizeof(int));
+
+    Tensor *view = create_tensor((float *)tensor->data, shape_copy, ndim, tensor->device);
+    view->dtype = tensor->dtype;
+    memcpy(view->strides, strides, ndim * sizeof(int));
+    view->offset = offset;
+    release_storage(view->storage);
+    view->storage = tensor->storage;
+    if (view->storage != NULL)
+    {
+        view->storage->refcount++;
+    }
+    view->buffer = tensor->buffer;
+    view->allocation = tensor->allocation;
+    view->ready_serial = tensor->ready_serial;
+
+    return view;
+}
+
+// Contiguous copy of a tensor on the same device, outside the autograd tape
+Tensor *copy_tensor(Tensor *tensor)
+{
+    return convert_tensor(tensor, tensor->dtype);
+}
+
+// Contiguous copy of a tensor converted to another dtype, outside the autograd tape
+Tensor *convert_tensor(Tensor *tensor, DType dtype)
+{
+    Tensor *result_tensor = empty_tensor(tensor->shape, tensor->ndim, tensor->device, dtype);
+    copy_into(tensor, result_tensor);
+    return result_tensor;
+}
+
+// Sum a tensor down to a shape it broadcasts from, outside the autograd tape
+Tensor *sum_to_shape(Tensor *tensor, const int *shape, int ndim)
+{
+    int lead = tensor->ndim - ndim;
+    bool compatible = lead >= 0;
+    for (int i = 0; compatible && i < ndim; i++)
+    {
+        compatible = shape[i] == tensor->shape[lead + i] || shape[i] == 1;
+    }
+    if (!compatible)
+    {
+        fprintf(stderr, "Cannot sum a %d-D tensor to the requested %d-D shape\n", tensor->ndim, ndim);
+        exit(1);
+    }
+
+    Tensor *source = as_float32(tensor);
+    Tensor *result_tensor = empty_tensor(shape, ndim, tensor->device, DTYPE_FLOAT32);
+    if (strcmp(tensor->device, "vulkan") == 0)
+    {
+        sum_to_vulkan(source, result_tensor);
+    }
+    else
+    {
+        sum_to_cpu(source, result_tensor);
+    }
+
+    if (source != tensor)
+    {
+        destroy_tensor(source);
+    }
+    return narrow_result(result_tensor, tensor->dtype);
+}
+
+// factor * tensor as a new contiguous tensor, outside the autograd tape
+Tensor *scale_tensor(Tensor *tensor, float factor)
+{
+    Tensor *source = is_contiguous(tensor) && tensor->dtype == DTYPE_FLOAT32 ? tensor : convert_tensor(tensor, DTYPE_FLOAT32);
+    Tensor *result_tensor = empty_tensor(tensor->shape, tensor->ndim, tensor->device, DTYPE_FLOAT32);
+    if (strcmp(tensor->device, "vulkan") == 0)
+    {
+        scale_tensor_vulkan(source, result_tensor, factor);
+    }
+    else
+    {
+        scale_tensor_cpu((const float *)source->data + source->offset, (float *)result_tensor->data, result_tensor->size, factor);
+    }
+
+    if (source != tensor)
+    {
+        destroy_tensor(source);
+    }
+    return narrow_result(result_tensor, tensor->dtype);
+}
+
+size_t dtype_size(DType dtype)
+{
+    switch (dtype)
+    {
+    case DTYPE_FLOAT16:
+    case DTYPE_BFLOAT16:
+        return 2;
+    case DTYPE_INT8:
+        return 1;
+    default:
+        return 4;
     }
-}
\ No newline at end of file
+}
+
+bool is_floating(DType dtype)
+{
+    return dtype == DTYPE_FLOAT32 || dtype == DTYPE_FLOAT16 || dtype == DTYPE_BFLOAT16;
+}
@@ -2,26 +2,150 @@
 #define TENSOR_H
 
 #include <vulkan/vulkan.h>
+#include <atomic>
+#include "allocator.h"
 
-typedef struct {
-    float* data;
+struct GradNode;
+struct TensorFile;
+
+// Storage types. Arithmetic always runs in fp32; 16-bit types only change how
+// elements are stored, which halves the bytes moved by bandwidth-bound ops.
+typedef enum {
+    DTYPE_FLOAT32,
+    DTYPE_FLOAT16,
+    DTYPE_BFLOAT16,
+    DTYPE_INT32,
+    DTYPE_INT8,
+} DType;
+
+// Memory owned by a tensor and shared with its views. It is freed when the last
+// of them is destroyed, whichever that is.
+typedef struct Storage {
+    std::atomic<int> refcount;
+    void* data;  // Host memory, NULL on the device
+    VkBuffer buffer;
+    DeviceAllocation allocation;
+    struct TensorFile* file;  // Mapped file the tensors read in place, instead of data
+    std::atomic<unsigned> version;  // Bumped by every in-place write
+} Storage;
+
+typedef struct Tensor {
+    void* data;          // size elements of dtype
     int* strides;
     int* shape;
     int ndim;
     int size;
+    int offset;          // Elements from the start of the storage to the first element
+    DType dtype;
+    Storage* storage;    // Owns no memory when the data is borrowed from the caller
     char* device;
+    std::atomic<int> refcount;  // Held by the caller and by autograd nodes reading the tensor
 
     // vulkan
     VkBuffer buffer;
-    VkDeviceMemory memory;
+    DeviceAllocation allocation;
+    uint64_t ready_serial;  // Submission that produces the buffer contents, 0 if none
+
+    // autograd
+    int requires_grad;
+    struct Tensor* grad;       // Accumulated by backward on leaf tensors
+    struct GradNode* grad_fn;  // Op that produced the tensor, NULL for leaves
 } Tensor;
 
 extern "C" {
+    // Tensor over data the caller keeps alive, taking ownership of shape
     Tensor* create_tensor(float* data, int* shape, int ndim, char* device);
+    // CPU tensor over memory the caller keeps alive, with strides in elements.
+    // Unlike create_tensor, shape and strides are copied.
+    Tensor* wrap_tensor(void* data, int* shape, int* strides, int ndim, int dtype);
+    // Every tensor returned by the API holds one reference, dropped by free_tensor.
+    // The tensor lives on while autograd nodes still read it.
+    void free_tensor(Tensor* tensor);
+    void retain_tensor(Tensor* tensor);
+    // New tensor over the same memory with its own reference to the storage. Memory
+    // handed out through it stays valid after the original moves to another device.
+    Tensor* share_storage(Tensor* tensor);
     float get_item(Tensor* tensor, int* indices);
     void to_device(Tensor* tensor, char* target_device);
+    Tensor* to_dtype(Tensor* tensor, int dtype);  // Converted copy; floats round to nearest even
     Tensor* add_tensor(Tensor* tensor1, Tensor* tensor2);
     Tensor* sub_tensor(Tensor* tensor1, Tensor* tensor2);
+    // In-place and out= forms, which allocate nothing when the dtypes match. out must have the broadcast
+    // shape already and may be an input, but no other view of an input's memory.
+    // They are not recorded for backward.
+    void add_(Tensor* tensor, Tensor* other);
+    void sub_(Tensor* tensor, Tensor* other);
+    void add_out(Tensor* tensor1, Tensor* tensor2, Tensor* out);
+    void sub_out(Tensor* tensor1, Tensor* tensor2, Tensor* out);
+    Tensor* matmul(Tensor* tensor1, Tensor* tensor2);
+    Tensor* bmm(Tensor* tensor1, Tensor* tensor2);
+
+    // Reductions over dims[0..ndims), or over every dimension when ndims is 0.
+    // Reduced dimensions are dropped unless keepdim is set.
+    Tensor* sum_tensor(Tensor* tensor, int* dims, int ndims, int keepdim);
+    Tensor* mean_tensor(Tensor* tensor, int* dims, int ndims, int keepdim);
+    Tensor* max_tensor(Tensor* tensor, int* dims, int ndims, int keepdim);
+    Tensor* argmax_tensor(Tensor* tensor, int dim, int keepdim);  // int32 indices
+
+    // Views share the storage of their input, which stays alive as long as they do
+    Tensor* slice(Tensor* tensor, int dim, int start, int end, int step);
+    Tensor* transpose(Tensor* tensor, int dim0, int dim1);
+    Tensor* permute(Tensor* tensor, int* dims);
+    Tensor* reshape(Tensor* tensor, int* shape, int ndim);
+    Tensor* expand(Tensor* tensor, int* shape, int ndim);
+    Tensor* contiguous(Tensor* tensor);
+    int is_contiguous(Tensor* tensor);
+
+    void get_vulkan_memory_stats(DeviceAllocatorStats* stats);
+    void empty_cache();  // Free the device buffers kept for reuse
+    void set_async(int enabled);
+    void set_lazy(int enabled);
+    void synchronize();
+    int tensor_ready(Tensor* tensor);
+    void wait_tensor(Tensor* tensor);
 }
 
+#define HOST_ALIGNMENT 4096                // Alignment of large host tensors: a page, as host memory imports need
+#define HOST_ALIGNED_MIN_BYTES (1u << 20)  // Host tensors below this are plain malloc blocks
+
+#define STRIDED_MAX_DIMS 6      // Dimensions an elementwise kernel indexes after merging
+#define STRIDED_MAX_OPERANDS 3  // Inputs plus output of an elementwise kernel
+
+// Iteration space of an elementwise op with the strides of each operand in it.
+// Operands may have fewer dimensions or size-1 dimensions, which broadcast with
+// stride 0. Dimensions of size 1 are dropped and neighbouring dimensions are merged where
+// every operand is laid out contiguously across them, so an op over contiguous
+// tensors becomes a single dimension.
+typedef struct {
+    int size;
+    int ndim;
+    int shape[STRIDED_MAX_DIMS];
+    int count;
+    int offsets[STRIDED_MAX_OPERANDS];
+    int strides[STRIDED_MAX_OPERANDS][STRIDED_MAX_DIMS];
+} StridedLayout;
+
+typedef enum {
+    REDUCE_SUM,
+    REDUCE_MEAN,
+    REDUCE_MAX,
+    REDUCE_ARGMAX,
+} ReduceOp;
+
+// Internal helpers shared by the op implementations
+void strided_layout(StridedLayout* layout, const int* shape, int ndim, Tensor* const* operands, int count);
+Tensor* make_view(Tensor* tensor, const int* shape, const int* strides, int ndim, int offset);
+Tensor* copy_tensor(Tensor* tensor);
+Tensor* convert_tensor(Tensor* tensor, DType dtype);
+Tensor* sum_to_shape(Tensor* tensor, const int* shape, int ndim);
+Tensor* empty_tensor(const int* shape, int ndim, const char* device, DType dtype);
+void* host_alloc(size_t bytes);
+size_t dtype_size(DType dtype);
+bool is_floating(DType dtype);
+void destroy_tensor(Tensor* tensor);
+void replace_storage(Tensor* tensor, void* data, VkBuffer buffer, const DeviceAllocation& allocation);
+void release_storage(Storage* storage);
+Tensor* gemm_tensor(Tensor* tensor1, Tensor* tensor2, bool trans_a, bool trans_b);
+Tensor* scale_tensor(Tensor* tensor, float factor);
+
 #endif /* TENSOR_H */
\ No newline at end of file
@@ -0,0 +1,300 @@
+#include "tensor_file.h"
+#include "vulkan.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + TENSOR_FILE_ALIGNMENT - 1) / TENSOR_FILE_ALIGNMENT * TENSOR_FILE_ALIGNMENT;
+}
+
+// Ask the kernel to start reading [offset, offset + length) of the file, rounded
+// out to whole pages. It returns at once; the pages arrive in the background.
+static void prefetchRange(TensorFile* file, uint64_t offset, uint64_t length) {
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t end = offset + length < file->size ? offset + length : file->size;
+    uint64_t start = offset / page * page;
+    if (start < end) {
+        madvise(file->mapping + start, end - start, MADV_WILLNEED);
+    }
+}
+
+// Let the kernel reclaim the pages wholly inside [offset, offset + length). They
+// are read back from the file if touched again.
+static void dropRange(TensorFile* file, uint64_t offset, uint64_t length) {
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = (offset + page - 1) / page * page;
+    uint64_t end = (offset + length) / page * page;
+    if (start < end) {
+        madvise(file->mapping + start, end - start, MADV_DONTNEED);
+    }
+}
+
+// Why an entry cannot be loaded from a file of the given size, or NULL if it can
+static const char* checkEntry(const TensorFileEntry* entry, uint64_t payloadStart, uint64_t size) {
+    if (memchr(entry->name, '\0', TENSOR_FILE_NAME_SIZE) == NULL) {
+        return "name is not terminated";
+    }
+    if (entry->dtype > DTYPE_INT8) {
+        return "unknown dtype";
+    }
+    if (entry->ndim > TENSOR_FILE_MAX_DIMS) {
+        return "too many dimensions";
+    }
+
+    uint64_t elements = 1;
+    for (uint32_t i = 0; i < entry->ndim; i++) {
+        if (entry->shape[i] < 0 || entry->shape[i] > INT_MAX) {
+            return "bad shape";
+        }
+        elements *= (uint64_t)entry->shape[i];
+        if (elements > INT_MAX) {
+            return "too many elements";
+        }
+    }
+
+    if (entry->bytes != elements * dtype_size((DType)entry->dtype)) {
+        return "payload size does not match the shape";
+    }
+    if (entry->offset % TENSOR_FILE_ALIGNMENT != 0 || entry->offset < payloadStart || entry->offset > size ||
+        entry->bytes > size - entry->offset) {
+        return "payload lies outside the file";
+    }
+    return NULL;
+}
+
+void releaseTensorFile(TensorFile* file) {
+    if (--file->refcount > 0) {
+        return;
+    }
+    munmap(file->mapping, file->size);
+    delete file;
+}
+
+// Stream a payload into a new Vulkan tensor a window at a time. While one window
+// is copied the kernel reads the next from disk, and pages already copied are
+// dropped, so a file larger than RAM loads without ever being resident whole.
+static Tensor* streamTensor(TensorFile* file, const TensorFileEntry* entry, const int* shape) {
+    VulkanContext* context = getVulkanContext();
+    Tensor* tensor = empty_tensor(shape, entry->ndim, "vulkan", (DType)entry->dtype);
+    const char* src = file->mapping + entry->offset;
+
+    // CPU tensors write the mapping copy-on-write. Dropping a page they wrote
+    // would undo the write, so pages are kept while any of them is alive.
+    bool dropPages = file->refcount == 1;
+
+    for (uint64_t done = 0; done < entry->bytes; done += TENSOR_FILE_STREAM_WINDOW) {
+        uint64_t chunk = entry->bytes - done < TENSOR_FILE_STREAM_WINDOW ? entry->bytes - done : TENSOR_FILE_STREAM_WINDOW;
+
+        // Step 1: Have this window and the next read in, so the disk stays busy while this one is copied
+        prefetchRange(file, entry->offset + done, 2 * TENSOR_FILE_STREAM_WINDOW);
+
+        // Step 2: Copy the window into the buffer, through the staging ring unless it is mapped
+        if (tensor->allocation.mapped != NULL) {
+            memcpy((char*)tensor->allocation.mapped + done, src + done, chunk);
+        } else {
+            uploadToBuffer(context, tensor->buffer, done, src + done, chunk);
+            tensor->ready_serial = context->nextSerial - 1;
+        }
+
+        // Step 3: The window has been copied out of the mapping
+        if (dropPages) {
+            dropRange(file, entry->offset + done, chunk);
+        }
+    }
+    return tensor;
+}
+
+extern "C" {
+    int save_tensors(const char* path, Tensor** tensors, const char** names, int count) {
+        PROFILE_SCOPE("save_tensors");
+
+        // Step 1: Lay out the entries, each payload starting on an aligned offset
+        TensorFileHeader header{};
+        header.magic = TENSOR_FILE_MAGIC;
+        header.version = TENSOR_FILE_VERSION;
+        header.count = (uint32_t)count;
+
+        std::vector<TensorFileEntry> entries(count);
+        uint64_t offset = alignOffset(sizeof(TensorFileHeader) + count * sizeof(TensorFileEntry));
+        for (int i = 0; i < count; i++) {
+            Tensor* tensor = tensors[i];
+            if (strlen(names[i]) >= TENSOR_FILE_NAME_SIZE) {
+                fprintf(stderr, "Tensor name is longer than %d characters: %s\n", TENSOR_FILE_NAME_SIZE - 1, names[i]);
+                return -1;
+            }
+            if (tensor->ndim > TENSOR_FILE_MAX_DIMS) {
+                fprintf(stderr, "Tensor files hold up to %d dimensions\n", TENSOR_FILE_MAX_DIMS);
+                return -1;
+            }
+
+            TensorFileEntry& entry = entries[i];
+            strcpy(entry.name, names[i]);
+            entry.dtype = tensor->dtype;
+            entry.ndim = (uint32_t)tensor->ndim;
+            for (int d = 0; d < tensor->ndim; d++) {
+                entry.shape[d] = tensor->shape[d];
+            }
+            entry.offset = offset;
+            entry.bytes = (uint64_t)tensor->size * dtype_size(tensor->dtype);
+            offset = alignOffset(offset + entry.bytes);
+        }
+
+        // The file is written beside path and renamed over it once complete. CPU
+        // tensors loaded from path map the old file, which must not be truncated
+        // under them, and a failed save leaves the old file as it was.
+        std::string temporary = std::string(path) + ".tmp";
+        FILE* out = fopen(temporary.c_str(), "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Failed to open %s for writing\n", temporary.c_str());
+            return -1;
+        }
+
+        // Step 2: Write the header and entries, then every payload contiguously in
+        // host memory, copying tensors that are not already laid out that way
+        static const char padding[TENSOR_FILE_ALIGNMENT] = {0};
+        bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                       (count == 0 || fwrite(entries.data(), sizeof(TensorFileEntry), count, out) == (size_t)count);
+        uint64_t position = sizeof(TensorFileHeader) + count * sizeof(TensorFileEntry);
+        for (int i = 0; i < count && written; i++) {
+            written = fwrite(padding, 1, entries[i].offset - position, out) == entries[i].offset - position;
+
+            Tensor* tensor = tensors[i];
+            Tensor* host = tensor;
+            if (strcmp(tensor->device, "cpu") != 0 || !is_contiguous(tensor)) {
+                char cpu[] = "cpu";
+                host = copy_tensor(tensor);
+                to_device(host, cpu);
+            }
+            const char* data = (const char*)host->data + (size_t)host->offset * dtype_size(host->dtype);
+            written = written && fwrite(data, 1, entries[i].bytes, out) == entries[i].bytes;
+            if (host != tensor) {
+                destroy_tensor(host);
+            }
+            position = entries[i].offset + entries[i].bytes;
+        }
+
+        // Step 3: Make the contents durable before they replace the old file
+        written = written && fflush(out) == 0 && fsync(fileno(out)) == 0;
+        written = fclose(out) == 0 && written;
+        if (!written || rename(temporary.c_str(), path) != 0) {
+            fprintf(stderr, "Failed to write %s\n", path);
+            remove(temporary.c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+    TensorFile* open_tensor_file(const char* path) {
+        PROFILE_SCOPE("open_tensor_file");
+
+        // Step 1: Map the whole file. The mapping outlives the descriptor.
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open tensor file %s\n", path);
+            return NULL;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(TensorFileHeader)) {
+            fprintf(stderr, "Not a tensor file: %s\n", path);
+            close(fd);
+            return NULL;
+        }
+        size_t size = (size_t)st.st_size;
+        void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            fprintf(stderr, "Failed to map tensor file %s\n", path);
+            return NULL;
+        }
+
+        // Step 2: Check the header and every entry before handing any out
+        const TensorFileHeader* header = (const TensorFileHeader*)mapping;
+        uint64_t payloadStart = sizeof(TensorFileHeader) + (uint64_t)header->count * sizeof(TensorFileEntry);
+        const char* problem = NULL;
+        if (header->magic != TENSOR_FILE_MAGIC || header->version != TENSOR_FILE_VERSION) {
+            problem = "bad magic or version";
+        } else if (payloadStart > size) {
+            problem = "entries lie outside the file";
+        }
+        const TensorFileEntry* entries = (const TensorFileEntry*)(header + 1);
+        for (uint32_t i = 0; problem == NULL && i < header->count; i++) {
+            problem = checkEntry(&entries[i], payloadStart, size);
+        }
+        if (problem != NULL) {
+            fprintf(stderr, "Invalid tensor file %s: %s\n", path, problem);
+            munmap(mapping, size);
+            return NULL;
+        }
+
+        TensorFile* file = new TensorFile();
+        file->refcount = 1;
+        file->mapping = (char*)mapping;
+        file->size = size;
+        file->entries = entries;
+        file->count = header->count;
+        return file;
+    }
+
+    int tensor_file_count(TensorFile* file) {
+        return (int)file->count;
+    }
+
+    const char* tensor_file_name(TensorFile* file, int index) {
+        if (index < 0 || (uint32_t)index >= file->count) {
+            fprintf(stderr, "Tensor file index %d out of range\n", index);
+            exit(1);
+        }
+        return file->entries[index].name;
+    }
+
+    Tensor* load_tensor(TensorFile* file, int index, const char* device) {
+        if (index < 0 || (uint32_t)index >= file->count) {
+            fprintf(stderr, "Tensor file index %d out of range\n", index);
+            exit(1);
+        }
+        const TensorFileEntry* entry = &file->entries[index];
+        ProfileScope scope("load_tensor", "api", entry->bytes);
+
+        int* shape = (int*)malloc((entry->ndim > 0 ? entry->ndim : 1) * sizeof(int));
+        if (shape == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < entry->ndim; i++) {
+            shape[i] = (int)entry->shape[i];
+        }
+
+        if (strcmp(device, "vulkan") == 0) {
+            Tensor* tensor = streamTensor(file, entry, shape);
+            free(shape);
+            return tensor;
+        }
+        if (strcmp(device, "cpu") != 0) {
+            fprintf(stderr, "Unknown device: %s\n", device);
+            exit(1);
+        }
+
+        // The tensor reads the mapping in place, and keeps it mapped
+        Tensor* tensor = create_tensor(NULL, shape, entry->ndim, (char*)"cpu");
+        tensor->dtype = (DType)entry->dtype;
+        DeviceAllocation none{};
+        replace_storage(tensor, NULL, VK_NULL_HANDLE, none);
+        file->refcount++;
+        tensor->storage->file = file;
+        tensor->data = file->mapping + entry->offset;
+        return tensor;
+    }
+
+    void close_tensor_file(TensorFile* file) {
+        releaseTensorFile(file);
+    }
+}
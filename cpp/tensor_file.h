@@ -0,0 +1,65 @@
+#ifndef TENSOR_FILE_H
+#define TENSOR_FILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "tensor.h"
+
+#define TENSOR_FILE_MAGIC 0x54474b56u  // "VKGT" read as a little-endian word
+#define TENSOR_FILE_VERSION 1
+#define TENSOR_FILE_ALIGNMENT 64       // Payload offsets are multiples of this
+#define TENSOR_FILE_MAX_DIMS 8
+#define TENSOR_FILE_NAME_SIZE 64       // Including the terminating NUL
+
+// Layout of a tensor file, all little-endian: a TensorFileHeader, count
+// TensorFileEntry records, then the payloads. Each payload is the tensor's
+// elements, contiguous and row-major, at its entry's offset.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+} TensorFileHeader;
+
+typedef struct {
+    char name[TENSOR_FILE_NAME_SIZE];
+    uint32_t dtype;  // DType
+    uint32_t ndim;
+    int64_t shape[TENSOR_FILE_MAX_DIMS];
+    uint64_t offset;  // From the start of the file
+    uint64_t bytes;
+} TensorFileEntry;
+
+// A tensor file mapped into memory. CPU tensors loaded from it point into the
+// mapping and hold a reference, so it is unmapped once the caller has closed
+// it and the last of them is gone.
+typedef struct TensorFile {
+    std::atomic<int> refcount;
+    char* mapping;
+    size_t size;
+    const TensorFileEntry* entries;
+    uint32_t count;
+} TensorFile;
+
+// Bytes streamed per step of a Vulkan load: as much as the staging ring holds
+#define TENSOR_FILE_STREAM_WINDOW (STAGING_CHUNK_SIZE * STAGING_CHUNK_COUNT)
+
+void releaseTensorFile(TensorFile* file);
+
+extern "C" {
+    // Write tensors, on any device and in any layout, under the given names.
+    // Returns 0, or -1 after printing why the file could not be written.
+    int save_tensors(const char* path, Tensor** tensors, const char** names, int count);
+    // Map a tensor file, or print why not and return NULL
+    TensorFile* open_tensor_file(const char* path);
+    int tensor_file_count(TensorFile* file);
+    const char* tensor_file_name(TensorFile* file, int index);
+    // On the CPU the tensor's data points into the mapping, copy-on-write. On
+    // Vulkan the payload is streamed through staging memory into a new buffer
+    // while the pages after it are read ahead.
+    Tensor* load_tensor(TensorFile* file, int index, const char* device);
+    void close_tensor_file(TensorFile* file);
+}
+
+#endif /* TENSOR_FILE_H */
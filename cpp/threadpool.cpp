@@ -0,0 +1,117 @@
+#include "threadpool.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Workers sleep on wake until the generation changes, then pull chunks from
+// next until the range is exhausted
+typedef struct {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::mutex submit;  // Serialises callers so one range runs at a time
+
+    const std::function<void(int64_t, int64_t)>* fn;
+    int64_t count;
+    int64_t chunk;
+    std::atomic<int64_t> next;
+    int active;  // Workers still on the current range
+    uint64_t generation;
+} ThreadPool;
+
+static thread_local bool in_parallel_region = false;
+
+static void run_chunks(ThreadPool* pool) {
+    int64_t begin;
+    while ((begin = pool->next.fetch_add(pool->chunk)) < pool->count) {
+        (*pool->fn)(begin, std::min(begin + pool->chunk, pool->count));
+    }
+}
+
+static void worker_loop(ThreadPool* pool) {
+    in_parallel_region = true;
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->wake.wait(lock, [&] { return pool->generation != seen; });
+            seen = pool->generation;
+        }
+
+        run_chunks(pool);
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->active == 0) {
+            pool->done.notify_one();
+        }
+    }
+}
+
+int cpu_thread_count() {
+    static int threads = [] {
+        const char* env = getenv("VKGRAD_CPU_THREADS");
+        int count = env != NULL ? atoi(env) : (int)std::thread::hardware_concurrency();
+        return std::max(count, 1);
+    }();
+    return threads;
+}
+
+// The pool lives for the whole process; its workers are never joined and are
+// torn down with it
+static ThreadPool* get_thread_pool() {
+    static ThreadPool* pool = [] {
+        ThreadPool* created = new ThreadPool();
+        created->fn = NULL;
+        created->count = 0;
+        created->chunk = 1;
+        created->next = 0;
+        created->active = 0;
+        created->generation = 0;
+        for (int i = 1; i < cpu_thread_count(); i++) {
+            created->workers.emplace_back(worker_loop, created);
+        }
+        return created;
+    }();
+    return pool;
+}
+
+void parallel_for(int64_t count, int64_t grain, const std::function<void(int64_t, int64_t)>& fn) {
+    if (count <= 0) {
+        return;
+    }
+    grain = std::max<int64_t>(grain, 1);
+    if (count <= grain || cpu_thread_count() == 1 || in_parallel_region) {
+        fn(0, count);
+        return;
+    }
+
+    ThreadPool* pool = get_thread_pool();
+    std::lock_guard<std::mutex> submit(pool->submit);
+
+    // A few chunks per thread balances uneven progress without much contention
+    int threads = cpu_thread_count();
+    int64_t chunk = std::max(grain, (count + threads * 4 - 1) / (threads * 4));
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->fn = &fn;
+        pool->count = count;
+        pool->chunk = chunk;
+        pool->next = 0;
+        pool->active = (int)pool->workers.size();
+        pool->generation++;
+    }
+    pool->wake.notify_all();
+
+    in_parallel_region = true;
+    run_chunks(pool);
+    in_parallel_region = false;
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->done.wait(lock, [&] { return pool->active == 0; });
+}
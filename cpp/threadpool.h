@@ -0,0 +1,19 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdint.h>
+#include <functional>
+
+// Elements per task for elementwise CPU ops. Smaller ops run inline on the
+// calling thread, since waking the pool costs more than the work itself.
+#define CPU_PARALLEL_GRAIN (1 << 15)
+
+// Run fn(begin, end) over [0, count) on the persistent thread pool, in chunks of
+// at least grain items. The caller works too and returns once every chunk is done.
+// Calls made from inside a task run serially on that thread.
+void parallel_for(int64_t count, int64_t grain, const std::function<void(int64_t, int64_t)>& fn);
+
+// Threads used by parallel_for, including the caller (VKGRAD_CPU_THREADS overrides)
+int cpu_thread_count();
+
+#endif /* THREADPOOL_H */
@@ -1,266 +1,782 @@
 #include "vulkan.h"
+#include "profiler.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <chrono>
 #include <iostream>
 
-// Singleton function to initialize and return the Vulkan context
+static VulkanContext* createVulkanContext() {
+    VulkanContext* context = new VulkanContext();
+    context->instance = createInstance();
+    context->physicalDevice = pickPhysicalDevice(context->instance);
+    queryStorageSupport(context);
+    queryUnifiedMemory(context);
+    queryHostImport(context);
+    selectQueueFamilies(context);
+    context->device = createLogicalDevice(context);
+    context->batchResources.commandPool = createCommandPool(context->device, context->queueFamilyIndex);
+    context->transferPool = createCommandPool(context->device, context->transferFamilyIndex);
+    context->transferSignal = VK_NULL_HANDLE;
+    context->computeSignal = VK_NULL_HANDLE;
+    context->fenceWaiters = 0;
+    context->pipelineCache = createPipelineCache(context->device, getPipelineCachePath());
+    querySubgroupSupport(context);
+    context->nextSerial = 1;
+    context->completedSerial = 0;
+    const char* async = getenv("VKGRAD_ASYNC");
+    context->asyncMode = async != NULL && strcmp(async, "0") != 0;
+    const char* lazy = getenv("VKGRAD_LAZY");
+    context->lazyMode = lazy != NULL && strcmp(lazy, "0") != 0;
+    const char* batchSize = getenv("VKGRAD_LAZY_BATCH");
+    context->lazyBatchSize = batchSize != NULL && atoi(batchSize) > 0 ? atoi(batchSize) : LAZY_BATCH_SIZE;
+    const char* bufferCache = getenv("VKGRAD_BUFFER_CACHE");
+    context->bufferCache.enabled = bufferCache == NULL || strcmp(bufferCache, "0") != 0;
+    context->pending.commandBuffer = VK_NULL_HANDLE;
+    createStagingRing(context);
+    profilerInitGpu(context->physicalDevice, context->device, context->queueFamilyIndex);
+    atexit([]() { savePipelineCache(getVulkanContext()); });
+    return context;
+}
+
+// Singleton function to initialize and return the Vulkan context. The first
+// call creates it exactly once even when several threads make it together.
+// The context is never destroyed, so exit handlers can still use it.
 VulkanContext* getVulkanContext() {
-    static VulkanContext context;
-    static int initialized = 0;
+    static VulkanContext* context = createVulkanContext();
+    return context;
+}
+
+void cpu_to_vulkan(Tensor* tensor) {
+    VulkanContext* context = getVulkanContext();
+    VkDeviceSize bytes = (VkDeviceSize)tensor->size * dtype_size(tensor->dtype);
+    bool large = bytes >= HOST_ALIGNED_MIN_BYTES;
+
+    VkBuffer buffer;
+    DeviceAllocation allocation;
+    Storage* storage = tensor->storage;
+    bool owned = storage != NULL && storage->refcount == 1 && storage->data == tensor->data;
+    if (context->unifiedMemory && large && owned &&
+        importHostBuffer(context, tensor->data, tensorBufferSize(tensor), buffer, allocation) == VK_SUCCESS) {
+        // Host memory nothing else reads becomes the buffer itself, with no copy
+        // at all. The new storage frees it once the import is gone.
+        void* data = tensor->data;
+        storage->data = NULL;
+        replace_storage(tensor, data, buffer, allocation);
+        tensor->ready_serial = 0;
+    } else {
+        // Step 1: Create the Vulkan buffer for the tensor data, sub-allocated from device memory
+        if (createTensorBuffer(context, tensorBufferSize(tensor), buffer, allocation) != VK_SUCCESS) {
+            fprintf(stderr, "Failed to create Vulkan buffer\n");
+            exit(1);
+        }
 
-    if (!initialized) {
-        context.instance = createInstance();
-        context.physicalDevice = pickPhysicalDevice(context.instance);
-        context.device = createLogicalDevice(context.physicalDevice, &context.queue);
-        context.commandPool = createCommandPool(context.device, 0);  // Assuming queueFamilyIndex is 0
-        context.descriptorPool = createDescriptorPool(context.device);  // Create descriptor pool
-        initialized = 1;
+        // Step 2: Copy the CPU data in. Aligned host memory is imported so the GPU
+        // copies straight out of it; the import must be gone before the memory can
+        // be freed, so that copy is waited for. Otherwise the host copy is finished
+        // on return, only a GPU copy from the staging ring may still be pending.
+        VkBuffer hostBuffer;
+        DeviceAllocation hostAllocation;
+        if (!context->unifiedMemory && large &&
+            importHostBuffer(context, tensor->data, bytes, hostBuffer, hostAllocation) == VK_SUCCESS) {
+            waitForSerial(context, copyBuffer(context, hostBuffer, buffer, bytes));
+            vkDestroyBuffer(context->device, hostBuffer, nullptr);
+            freeDeviceMemory(&context->allocator, context->device, &hostAllocation);
+            tensor->ready_serial = 0;
+        } else {
+            tensor->ready_serial = writeTensorBuffer(context, buffer, allocation, tensor->data, bytes);
+        }
+
+        // Step 3: The tensor now owns the buffer; host memory it owned is freed unless a view still reads it
+        replace_storage(tensor, NULL, buffer, allocation);
     }
+    free(tensor->device);
+    tensor->device = (char*)malloc(strlen("vulkan") + 1);
+    strcpy(tensor->device, "vulkan");
+}
 
-    return &context;
+void vulkan_to_cpu(Tensor* tensor) {
+    VulkanContext* context = getVulkanContext();
+
+    // Step 1: Allocate memory for CPU to hold the tensor data
+    size_t bytes = tensor->size * dtype_size(tensor->dtype);
+    void* data_tmp = host_alloc(bytes);
+    if (data_tmp == NULL) {
+        fprintf(stderr, "Failed to allocate memory on CPU\n");
+        return;
+    }
+
+    // Step 2: Copy the Vulkan buffer out
+    readTensorBuffer(context, tensor->buffer, tensor->allocation, 0, data_tmp, bytes);
+
+    // Step 3: Point the tensor at the CPU memory, releasing the Vulkan buffer
+    DeviceAllocation none{};
+    replace_storage(tensor, data_tmp, VK_NULL_HANDLE, none);
+
+    // Step 4: Update the device information
+    const char* device_str = "cpu";
+    free(tensor->device);
+    tensor->device = (char*)malloc(strlen(device_str) + 1);
+    strcpy(tensor->device, device_str);
 }
 
 
-// Transfer tensor data from CPU to Vulkan
-void cpu_to_vulkan(Tensor* tensor) {
-    VulkanContext* context = getVulkanContext();
+// Storage bytes of a tensor's buffer. Buffers hold whole 32-bit words so that
+// fills and shaders never touch a partial word past the end.
+VkDeviceSize tensorBufferSize(const Tensor* tensor) {
+    VkDeviceSize bytes = (VkDeviceSize)tensor->size * dtype_size(tensor->dtype);
+    return (bytes + 3) & ~(VkDeviceSize)3;
+}
 
-    // Step 1: Create the Vulkan buffer for the tensor data
-    VkBufferCreateInfo bufferInfo{};
-    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferInfo.size = tensor->size * sizeof(float);  // Total size in bytes
-    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+// Suffix of the shader variants built for each dtype (see setup.py)
+static const char* dtypeSuffix(DType dtype) {
+    static const char* suffixes[] = {"f32", "f16", "bf16", "i32", "i8"};
+    return suffixes[dtype];
+}
 
-    if (vkCreateBuffer(context->device, &bufferInfo, nullptr, &tensor->buffer) != VK_SUCCESS) {
-        fprintf(stderr, "Failed to create Vulkan buffer\n");
+// 16-bit and 8-bit tensors need the matching storage feature on the device
+static void requireStorage(VulkanContext* context, DType dtype) {
+    size_t bytes = dtype_size(dtype);
+    if ((bytes == 2 && !context->storage16Bit) || (bytes == 1 && !context->storage8Bit)) {
+        fprintf(stderr, "The Vulkan device does not support %zu-bit storage buffers\n", bytes * 8);
         exit(1);
     }
+}
 
-    // Step 2: Allocate memory for the Vulkan buffer
-    VkMemoryRequirements memRequirements;
-    vkGetBufferMemoryRequirements(context->device, tensor->buffer, &memRequirements);
+// Elementwise shaders are built once per floating point dtype; all operands
+// share the result's dtype
+static void elementwiseVulkan(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor, const char* name) {
+    char path[64];
+    if (result_tensor->dtype == DTYPE_FLOAT32) {
+        snprintf(path, sizeof(path), "cpp/%s.spv", name);
+    } else {
+        requireStorage(getVulkanContext(), result_tensor->dtype);
+        snprintf(path, sizeof(path), "cpp/%s_%s.spv", name, dtypeSuffix(result_tensor->dtype));
+    }
+    compute_shader(tensor1, tensor2, result_tensor, path);
+}
 
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(context->physicalDevice, memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+void add_tensor_vulkan(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor) {
+    elementwiseVulkan(tensor1, tensor2, result_tensor, "add_tensor");
+}
 
-    if (vkAllocateMemory(context->device, &allocInfo, nullptr, &tensor->memory) != VK_SUCCESS) {
-        fprintf(stderr, "Failed to allocate Vulkan memory\n");
-        exit(1);
+void sub_tensor_vulkan(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor) {
+    elementwiseVulkan(tensor1, tensor2, result_tensor, "sub_tensor");
+}
+
+// Push constants of the strided elementwise shaders, filled from a StridedLayout
+typedef struct {
+    uint32_t size;
+    uint32_t ndim;
+    uint32_t offsets[STRIDED_MAX_OPERANDS];
+    uint32_t shape[STRIDED_MAX_DIMS];
+    uint32_t strides[STRIDED_MAX_OPERANDS][STRIDED_MAX_DIMS];
+} StridedParams;
+
+// Bind the operands and dispatch one invocation per element of the layout
+static void dispatchStrided(Tensor* const* operands, int count, const char* shader_path) {
+    VulkanContext* context = getVulkanContext();
+    Tensor* result_tensor = operands[count - 1];
+
+    // Step 1: Describe the iteration space and each operand's strides in it
+    StridedLayout layout;
+    strided_layout(&layout, result_tensor->shape, result_tensor->ndim, operands, count);
+
+    StridedParams params{};
+    params.size = (uint32_t)layout.size;
+    params.ndim = (uint32_t)layout.ndim;
+    for (int i = 0; i < count; i++) {
+        params.offsets[i] = (uint32_t)layout.offsets[i];
+        for (int d = 0; d < layout.ndim; d++) {
+            params.strides[i][d] = (uint32_t)layout.strides[i][d];
+        }
+    }
+    for (int d = 0; d < layout.ndim; d++) {
+        params.shape[d] = (uint32_t)layout.shape[d];
     }
 
-    // Step 3: Bind the buffer to the allocated memory
-    vkBindBufferMemory(context->device, tensor->buffer, tensor->memory, 0);
+    VkBuffer buffers[STRIDED_MAX_OPERANDS];
+    VkDeviceSize bytes = 0;
+    for (int i = 0; i < count; i++) {
+        buffers[i] = operands[i]->buffer;
+        bytes += layout.size * dtype_size(operands[i]->dtype);
+    }
 
-    // Step 4: Create a staging buffer for data transfer (host-visible memory)
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(context->device, context->physicalDevice, tensor->size * sizeof(float),
-                 VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
-                 stagingBuffer, stagingBufferMemory);
+    // Step 2: Look up the pipeline variant for this size, tuning it on first use
+    ComputeKernel* kernel = getTunedKernel(context, shader_path, count, sizeof(StridedParams), buffers, &params, params.size,
+                                           result_tensor->allocation.requested);
 
-    // Step 5: Copy the CPU data to the staging buffer
-    void* data;
-    vkMapMemory(context->device, stagingBufferMemory, 0, tensor->size * sizeof(float), 0, &data);
-    memcpy(data, tensor->data, tensor->size * sizeof(float));  // Copy CPU data to staging buffer
-    vkUnmapMemory(context->device, stagingBufferMemory);
+    // Step 3: Dispatch enough workgroups to cover all elements
+    result_tensor->ready_serial = dispatchKernel(context, kernel, buffers, count, &params, variantGroupCount(kernel, params.size), 1, 1, bytes);
+}
 
-    // Step 6: Copy the data from the staging buffer to the Vulkan buffer (GPU memory)
-    copyBuffer(context->device, context->commandPool, context->queue, stagingBuffer, tensor->buffer, tensor->size * sizeof(float));
+void compute_shader(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor, const char* shader_path) {
+    // Step 1: Ensure tensors are on Vulkan
+    if (strcmp(tensor1->device, "vulkan") != 0 || strcmp(tensor2->device, "vulkan") != 0) {
+        fprintf(stderr, "Tensors must be on Vulkan\n");
+        return;
+    }
 
-    // Step 7: Clean up the staging buffer
-    vkDestroyBuffer(context->device, stagingBuffer, nullptr);
-    vkFreeMemory(context->device, stagingBufferMemory, nullptr);
+    // Step 2: Dispatch over the result's shape; inputs and result may be strided views
+    Tensor* operands[3] = {tensor1, tensor2, result_tensor};
+    dispatchStrided(operands, 3, shader_path);
+}
 
-    // Step 8: Update the tensor metadata
-    tensor->data = nullptr;  // Data is now on the GPU
-    tensor->device = (char*)malloc(strlen("vulkan") + 1);
-    strcpy(tensor->device, "vulkan");
+// Copies between equal dtypes move raw elements of the same width; other pairs
+// go through a conversion shader built for that pair
+void copy_tensor_vulkan(Tensor* src, Tensor* dst) {
+    VulkanContext* context = getVulkanContext();
+    requireStorage(context, src->dtype);
+    requireStorage(context, dst->dtype);
+
+    char path[64];
+    if (src->dtype != dst->dtype) {
+        snprintf(path, sizeof(path), "cpp/convert_%s_%s.spv", dtypeSuffix(src->dtype), dtypeSuffix(dst->dtype));
+    } else if (dtype_size(src->dtype) == 4) {
+        snprintf(path, sizeof(path), "cpp/copy_tensor.spv");
+    } else {
+        snprintf(path, sizeof(path), "cpp/copy_tensor_%zu.spv", dtype_size(src->dtype) * 8);
+    }
 
-    printf("Tensor successfully transferred to Vulkan GPU.\n");
+    Tensor* operands[2] = {src, dst};
+    dispatchStrided(operands, 2, path);
 }
 
-void vulkan_to_cpu(Tensor* tensor) {
+// Push constants of sum_to.comp
+typedef struct {
+    uint32_t outSize;
+    uint32_t reduceCount;
+    uint32_t ndim;
+    uint32_t srcOffset;
+    uint32_t outShape[STRIDED_MAX_DIMS];
+    uint32_t reduceShape[STRIDED_MAX_DIMS];
+    uint32_t srcStrides[STRIDED_MAX_DIMS];
+} SumToParams;
+
+void sum_to_vulkan(Tensor* src, Tensor* dst) {
     VulkanContext* context = getVulkanContext();
+    if (src->ndim > STRIDED_MAX_DIMS) {
+        fprintf(stderr, "sum_to supports up to %d dimensions on Vulkan, got %d\n", STRIDED_MAX_DIMS, src->ndim);
+        exit(1);
+    }
 
-    // Step 1: Allocate memory for CPU to hold the tensor data
-    float* data_tmp = (float*)malloc(tensor->size * sizeof(float));
-    if (data_tmp == NULL) {
-        fprintf(stderr, "Failed to allocate memory on CPU\n");
-        return;
+    // Dimensions line up from the right; dst has size 1 wherever it is summed over
+    SumToParams params{};
+    int lead = src->ndim - dst->ndim;
+    params.outSize = (uint32_t)dst->size;
+    params.reduceCount = 1;
+    params.ndim = (uint32_t)src->ndim;
+    params.srcOffset = (uint32_t)src->offset;
+    for (int d = 0; d < src->ndim; d++) {
+        params.outShape[d] = d < lead ? 1 : (uint32_t)dst->shape[d - lead];
+        params.reduceShape[d] = params.outShape[d] == 1 ? (uint32_t)src->shape[d] : 1;
+        params.srcStrides[d] = (uint32_t)src->strides[d];
+        params.reduceCount *= params.reduceShape[d];
     }
 
-    // Step 2: Create a staging buffer (host-visible) to copy data from the Vulkan buffer
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(context->device, context->physicalDevice, tensor->size * sizeof(float),
-                 VK_BUFFER_USAGE_TRANSFER_DST_BIT, 
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 stagingBuffer, stagingBufferMemory);
+    VkBuffer buffers[2] = {src->buffer, dst->buffer};
+    ComputeKernel* kernel = getTunedKernel(context, "cpp/sum_to.spv", 2, sizeof(SumToParams), buffers, &params, params.outSize,
+                                           dst->allocation.requested);
+    VkDeviceSize bytes = (VkDeviceSize)(src->size + dst->size) * sizeof(float);
+    dst->ready_serial = dispatchKernel(context, kernel, buffers, 2, &params, variantGroupCount(kernel, params.outSize), 1, 1, bytes);
+}
 
-    // Step 3: Copy data from the Vulkan buffer to the staging buffer
-    copyBuffer(context->device, context->commandPool, context->queue, tensor->buffer, stagingBuffer, tensor->size * sizeof(float));
+// Push constants of scale_tensor.comp
+typedef struct {
+    uint32_t size;
+    uint32_t srcOffset;
+    float factor;
+} ScaleParams;
 
-    // Step 4: Map the staging buffer memory to a pointer so we can access it on the CPU
-    void* mappedData;
-    vkMapMemory(context->device, stagingBufferMemory, 0, tensor->size * sizeof(float), 0, &mappedData);
+// dst = src * factor, where src is contiguous from its offset
+void scale_tensor_vulkan(Tensor* src, Tensor* dst, float factor) {
+    VulkanContext* context = getVulkanContext();
+    ScaleParams params = {(uint32_t)dst->size, (uint32_t)src->offset, factor};
+    VkBuffer buffers[2] = {src->buffer, dst->buffer};
+    ComputeKernel* kernel = getTunedKernel(context, "cpp/scale_tensor.spv", 2, sizeof(ScaleParams), buffers, &params, params.size,
+                                           dst->allocation.requested);
+    dst->ready_serial = dispatchKernel(context, kernel, buffers, 2, &params, variantGroupCount(kernel, params.size), 1, 1,
+                                       (VkDeviceSize)dst->size * 2 * sizeof(float));
+}
 
-    // Step 5: Copy data from the mapped staging buffer to the CPU memory
-    memcpy(data_tmp, mappedData, tensor->size * sizeof(float));
+// Push constants of reduce.comp
+typedef struct {
+    uint32_t rows;
+    uint32_t length;
+    uint32_t groups;
+    uint32_t op;
+    uint32_t srcOffset;
+    uint32_t hasIndices;
+    uint32_t finalPass;
+    float scale;
+} ReduceParams;
+
+// Reduce each of rows contiguous rows of length elements of src, starting at its
+// offset, into one element of dst. Every pass has one workgroup per chunk of a row
+// write a partial to a temporary buffer; the next pass reduces those partials
+// until a single pass covers each row and writes dst. Nothing leaves the device.
+void reduce_vulkan(ReduceOp op, Tensor* src, Tensor* dst, int rows, int length, float scale) {
+    VulkanContext* context = getVulkanContext();
+    const char* shader = context->subgroupArithmetic ? "cpp/reduce_subgroup.spv" : "cpp/reduce.spv";
+    if (src->dtype == DTYPE_INT32) {
+        shader = context->subgroupArithmetic ? "cpp/reduce_subgroup_i32.spv" : "cpp/reduce_i32.spv";
+    }
+    ComputeKernel* kernel = getComputeKernel(context, shader, 4, sizeof(ReduceParams));
+    uint32_t chunk = REDUCE_GROUP_SIZE * REDUCE_ITEMS_PER_THREAD;
+    bool indexed = op == REDUCE_MAX || op == REDUCE_ARGMAX;
+
+    // Rows map to workgroups along y, spilling into z past the 65535 limit
+    uint32_t groupsY = rows < 65535 ? (uint32_t)rows : 65535;
+    uint32_t groupsZ = ((uint32_t)rows + groupsY - 1) / groupsY;
+
+    ReduceParams params{};
+    params.rows = (uint32_t)rows;
+    params.length = (uint32_t)length;
+    params.op = (uint32_t)op;
+    params.srcOffset = (uint32_t)src->offset;
+    params.scale = scale;
+
+    VkBuffer values = src->buffer;
+    VkBuffer indices = src->buffer;  // Bound but unread until partials carry indices
+    DeviceAllocation valuesAllocation{};
+    DeviceAllocation indicesAllocation{};
+    while (true) {
+        // Step 1: Size this pass and allocate its partials unless it is the last
+        params.groups = params.length > chunk ? (params.length + chunk - 1) / chunk : 1;
+        params.finalPass = params.groups == 1;
+
+        VkBuffer outValues = dst->buffer;
+        VkBuffer outIndices = dst->buffer;  // Holds argmax's int32 result in the final pass
+        DeviceAllocation outValuesAllocation{};
+        DeviceAllocation outIndicesAllocation{};
+        if (!params.finalPass) {
+            VkDeviceSize partials = (VkDeviceSize)rows * params.groups * sizeof(float);
+            if (createBuffer(context, partials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                             outValues, outValuesAllocation) != VK_SUCCESS ||
+                (indexed && createBuffer(context, partials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                         outIndices, outIndicesAllocation) != VK_SUCCESS)) {
+                fprintf(stderr, "Failed to allocate Vulkan reduction buffer\n");
+                exit(1);
+            }
+            if (!indexed) {
+                outIndices = outValues;
+            }
+        }
 
-    // Unmap the staging buffer memory
-    vkUnmapMemory(context->device, stagingBufferMemory);
+        // Step 2: Dispatch one workgroup per chunk of every row
+        VkBuffer buffers[4] = {values, indices, outIndices, outValues};
+        VkDeviceSize bytes = (VkDeviceSize)rows * (params.length + params.groups) * sizeof(float) * (indexed ? 2 : 1);
+        uint64_t serial = dispatchKernel(context, kernel, buffers, 4, &params, params.groups, groupsY, groupsZ, bytes);
+
+        // Step 3: The previous partials are released once this pass has read them
+        if (values != src->buffer) {
+            destroyBuffer(context, values, valuesAllocation);
+            if (indexed) {
+                destroyBuffer(context, indices, indicesAllocation);
+            }
+        }
 
-    // Step 6: Free the Vulkan buffer (GPU memory)
-    vkDestroyBuffer(context->device, tensor->buffer, nullptr);
-    vkFreeMemory(context->device, tensor->memory, nullptr);
+        if (params.finalPass) {
+            dst->ready_serial = serial;
+            return;
+        }
+        values = outValues;
+        indices = outIndices;
+        valuesAllocation = outValuesAllocation;
+        indicesAllocation = outIndicesAllocation;
+        params.length = params.groups;
+        params.srcOffset = 0;
+        params.hasIndices = indexed;
+    }
+}
 
-    // Step 7: Free the staging buffer
-    vkDestroyBuffer(context->device, stagingBuffer, nullptr);
-    vkFreeMemory(context->device, stagingBufferMemory, nullptr);
+// Push constants of matmul.comp
+typedef struct {
+    uint32_t m;
+    uint32_t n;
+    uint32_t k;
+    uint32_t transA;
+    uint32_t transB;
+    uint32_t offsetA;
+    uint32_t offsetB;
+} MatmulParams;
+
+void matmul_tensor_vulkan(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor, int batch, int m, int n, int k,
+                          bool trans_a, bool trans_b) {
+    VulkanContext* context = getVulkanContext();
+    ComputeKernel* kernel = getComputeKernel(context, "cpp/matmul.spv", 3, sizeof(MatmulParams));
 
-    // Step 8: Update the Tensor structure to point to the CPU memory
-    tensor->data = data_tmp;  // Now the data is on the CPU
+    MatmulParams params = {(uint32_t)m, (uint32_t)n, (uint32_t)k, trans_a ? 1u : 0u, trans_b ? 1u : 0u,
+                           (uint32_t)tensor1->offset, (uint32_t)tensor2->offset};
+    VkBuffer buffers[3] = {tensor1->buffer, tensor2->buffer, result_tensor->buffer};
 
-    // Step 9: Update the device information
-    const char* device_str = "cpu";
-    tensor->device = (char*)malloc(strlen(device_str) + 1);
-    strcpy(tensor->device, device_str);
-
-    printf("Successfully transferred tensor to: %s\n", tensor->device);
+    // One workgroup per 64x64 tile of each output matrix
+    VkDeviceSize bytes = (VkDeviceSize)batch * ((VkDeviceSize)m * k + (VkDeviceSize)k * n + (VkDeviceSize)m * n) * sizeof(float);
+    result_tensor->ready_serial = dispatchKernel(context, kernel, buffers, 3, &params, (uint32_t)((n + 63) / 64),
+                                                 (uint32_t)((m + 63) / 64), (uint32_t)batch, bytes);
 }
 
+// Record a dispatch of a cached kernel. buffers[i] is bound to binding i and the
+// last buffer is the one the kernel writes. bytes is the traffic the profiler
+// reports for it. Returns the serial that marks completion.
+uint64_t dispatchKernel(VulkanContext* context, ComputeKernel* kernel, const VkBuffer* buffers, uint32_t bufferCount,
+                        const void* pushConstants, uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ,
+                        VkDeviceSize bytes) {
+    // Step 1: Find the descriptor set for the buffers, written the first time
+    // this kernel binds them
+    uint32_t descriptorPool;
+    VkDescriptorSet descriptorSet = acquireDescriptorSet(&context->descriptors, context->device, kernel->descriptorSetLayout,
+                                                         buffers, bufferCount, &descriptorPool);
+
+    // Step 2: Record commands to dispatch the compute shader
+    VkCommandBuffer commandBuffer = beginBatchedCommands(context, buffers, bufferCount - 1, buffers[bufferCount - 1]);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, kernel->pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, kernel->pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+    if (kernel->pushConstantSize > 0) {
+        vkCmdPushConstants(commandBuffer, kernel->pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, kernel->pushConstantSize, pushConstants);
+    }
 
-void add_tensor_vulkan(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor) {
-    compute_shader(tensor1, tensor2, result_tensor, "cpp/add_tensor.spv");
-}
+    uint32_t query = profilerBeginGpu(commandBuffer);
+    vkCmdDispatch(commandBuffer, groupCountX, groupCountY, groupCountZ);
+    profilerEndGpu(commandBuffer, query);
 
-void sub_tensor_vulkan(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor) {
-    compute_shader(tensor1, tensor2, result_tensor, "cpp/sub_tensor.spv");
+    // Step 3: Submit (or queue in the lazy batch)
+    uint64_t serial = endBatchedCommands(context, commandBuffer);
+    finishDescriptorSet(&context->descriptors, descriptorPool, serial);
+    profilerRecordGpu(query, kernel->name, "dispatch", bytes, serial);
+    return serial;
 }
 
-void compute_shader(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor, const char* shader_path) {
-   VulkanContext* context = getVulkanContext();
-    // Step 1: Ensure tensors are on Vulkan
-    if (strcmp(tensor1->device, "vulkan") != 0 || strcmp(tensor2->device, "vulkan") != 0) {
-        fprintf(stderr, "Tensors must be on Vulkan\n");
-        return;
+// Return the pipeline for a shader, compiling it the first time it is requested.
+// Every binding is a storage buffer visible to the compute stage, followed by an
+// optional block of push constants. Specialized variants are cached apart from
+// each other, keyed by path and variant.
+ComputeKernel* getComputeKernel(VulkanContext* context, const char* shader_path, uint32_t bindingCount, uint32_t pushConstantSize,
+                                const KernelVariant* variant) {
+    std::string key = shader_path;
+    if (variant != NULL) {
+        key += "@" + std::to_string(variant->workgroupSize) + "x" + std::to_string(variant->itemsPerThread);
+    }
+
+    // Held through creation so two threads never build the same pipeline;
+    // entries are never erased while in use, so the pointer stays valid
+    std::lock_guard<std::mutex> lock(context->kernelMutex);
+    auto it = context->kernels.find(key);
+    if (it != context->kernels.end()) {
+        return &it->second;
+    }
+
+    ComputeKernel kernel{};
+    kernel.bindingCount = bindingCount;
+    kernel.pushConstantSize = pushConstantSize;
+    if (variant != NULL) {
+        kernel.variant = *variant;
+    }
+
+    // Step 1: Load the compute shader
+    kernel.shaderModule = loadShaderModule(context->device, shader_path);
+    if (kernel.shaderModule == VK_NULL_HANDLE) {
+        exit(1);
     }
 
-    // Step 2: Load the compute shader
-    VkShaderModule shaderModule = loadShaderModule(context->device, shader_path);
-
-    // Step 3: Create descriptor sets for the buffers
-    VkDescriptorSetLayoutBinding bindings[3] = {};
-    
-    // Binding 0: tensor1
-    bindings[0].binding = 0;
-    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    bindings[0].descriptorCount = 1;
-    bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-    bindings[0].pImmutableSamplers = nullptr;
-
-    // Binding 1: tensor2
-    bindings[1].binding = 1;
-    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    bindings[1].descriptorCount = 1;
-    bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-    bindings[1].pImmutableSamplers = nullptr;
-
-    // Binding 2: result_tensor
-    bindings[2].binding = 2;
-    bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    bindings[2].descriptorCount = 1;
-    bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-    bindings[2].pImmutableSamplers = nullptr;
-
-    // Step 4: Create the descriptor set layout
+    // Step 2: Describe the buffer bindings
+    VkDescriptorSetLayoutBinding* bindings = (VkDescriptorSetLayoutBinding*)calloc(bindingCount, sizeof(VkDescriptorSetLayoutBinding));
+    for (uint32_t i = 0; i < bindingCount; i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        bindings[i].pImmutableSamplers = nullptr;
+    }
+
+    // Step 3: Create the descriptor set layout
     VkDescriptorSetLayoutCreateInfo layoutInfo{};
     layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layoutInfo.bindingCount = 3;
+    layoutInfo.bindingCount = bindingCount;
     layoutInfo.pBindings = bindings;
 
-    VkDescriptorSetLayout descriptorSetLayout;
-    vkCreateDescriptorSetLayout(context->device, &layoutInfo, nullptr, &descriptorSetLayout);
+    if (vkCreateDescriptorSetLayout(context->device, &layoutInfo, nullptr, &kernel.descriptorSetLayout) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create descriptor set layout for %s\n", shader_path);
+        exit(1);
+    }
+    free(bindings);
 
-    // Step 5: Create the pipeline layout
+    // Step 4: Create the pipeline layout
     VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+    pipelineLayoutInfo.pSetLayouts = &kernel.descriptorSetLayout;
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = pushConstantSize;
+    if (pushConstantSize > 0) {
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    }
 
-    VkPipelineLayout pipelineLayout;
-    vkCreatePipelineLayout(context->device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
+    if (vkCreatePipelineLayout(context->device, &pipelineLayoutInfo, nullptr, &kernel.pipelineLayout) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create pipeline layout for %s\n", shader_path);
+        exit(1);
+    }
 
-    // Step 6: Create the compute pipeline
+    // Step 5: Create the compute pipeline through the pipeline cache
     VkComputePipelineCreateInfo pipelineInfo{};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    pipelineInfo.stage.module = shaderModule;
+    pipelineInfo.stage.module = kernel.shaderModule;
     pipelineInfo.stage.pName = "main";  // Entry point in shader
-    pipelineInfo.layout = pipelineLayout;
+    pipelineInfo.layout = kernel.pipelineLayout;
+
+    VkSpecializationMapEntry specEntries[2] = {
+        {0, offsetof(KernelVariant, workgroupSize), sizeof(uint32_t)},
+        {1, offsetof(KernelVariant, itemsPerThread), sizeof(uint32_t)},
+    };
+    VkSpecializationInfo specInfo{};
+    specInfo.mapEntryCount = 2;
+    specInfo.pMapEntries = specEntries;
+    specInfo.dataSize = sizeof(KernelVariant);
+    specInfo.pData = &kernel.variant;
+    if (variant != NULL) {
+        pipelineInfo.stage.pSpecializationInfo = &specInfo;
+    }
 
-    VkPipeline computePipeline;
-    vkCreateComputePipelines(context->device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &computePipeline);
+    if (vkCreateComputePipelines(context->device, context->pipelineCache, 1, &pipelineInfo, nullptr, &kernel.pipeline) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create compute pipeline for %s\n", shader_path);
+        exit(1);
+    }
 
-    // Step 7: Create descriptor sets and allocate memory for them
-    VkDescriptorSet descriptorSet;
-    VkDescriptorSetAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    allocInfo.descriptorPool = context->descriptorPool;
-    allocInfo.descriptorSetCount = 1;
-    allocInfo.pSetLayouts = &descriptorSetLayout;
+    auto inserted = context->kernels.emplace(key, kernel).first;
+    inserted->second.name = inserted->first.c_str();
+    return &inserted->second;
+}
+
+// Destroy every cached pipeline; they are rebuilt on next use
+void destroyComputeKernels(VulkanContext* context) {
+    std::lock_guard<std::mutex> lock(context->kernelMutex);
+    for (auto& entry : context->kernels) {
+        ComputeKernel& kernel = entry.second;
+        vkDestroyPipeline(context->device, kernel.pipeline, nullptr);
+        vkDestroyPipelineLayout(context->device, kernel.pipelineLayout, nullptr);
+        releaseDescriptorSetLayout(&context->descriptors, kernel.descriptorSetLayout);
+        vkDestroyDescriptorSetLayout(context->device, kernel.descriptorSetLayout, nullptr);
+        vkDestroyShaderModule(context->device, kernel.shaderModule, nullptr);
+    }
+    context->kernels.clear();
+}
 
-    vkAllocateDescriptorSets(context->device, &allocInfo, &descriptorSet);
+// Location of the on-disk pipeline cache, overridable with VKGRAD_PIPELINE_CACHE
+const char* getPipelineCachePath() {
+    const char* path = getenv("VKGRAD_PIPELINE_CACHE");
+    return path != NULL ? path : "cpp/pipeline_cache.bin";
+}
 
-    // Step 8: Update descriptor sets with the buffers (tensor1, tensor2, result)
-    VkDescriptorBufferInfo bufferInfos[3] = {};
-    bufferInfos[0].buffer = tensor1->buffer;
-    bufferInfos[0].offset = 0;
-    bufferInfos[0].range = VK_WHOLE_SIZE;
+// Create the pipeline cache, seeding it from a previous run if the file exists.
+// The driver validates the header and ignores data written by another device.
+VkPipelineCache createPipelineCache(VkDevice device, const char* cachePath) {
+    void* initialData = NULL;
+    size_t initialSize = 0;
+
+    FILE* file = fopen(cachePath, "rb");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        initialSize = ftell(file);
+        rewind(file);
+
+        initialData = malloc(initialSize);
+        if (fread(initialData, 1, initialSize, file) != initialSize) {
+            free(initialData);
+            initialData = NULL;
+            initialSize = 0;
+        }
+        fclose(file);
+    }
 
-    bufferInfos[1].buffer = tensor2->buffer;
-    bufferInfos[1].offset = 0;
-    bufferInfos[1].range = VK_WHOLE_SIZE;
+    VkPipelineCacheCreateInfo cacheInfo{};
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.initialDataSize = initialSize;
+    cacheInfo.pInitialData = initialData;
+
+    VkPipelineCache pipelineCache;
+    if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+        // Stale or corrupt data: start from an empty cache instead
+        cacheInfo.initialDataSize = 0;
+        cacheInfo.pInitialData = NULL;
+        if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+            fprintf(stderr, "Failed to create pipeline cache\n");
+            exit(1);
+        }
+    }
 
-    bufferInfos[2].buffer = result_tensor->buffer;
-    bufferInfos[2].offset = 0;
-    bufferInfos[2].range = VK_WHOLE_SIZE;
+    free(initialData);
+    return pipelineCache;
+}
 
-    VkWriteDescriptorSet descriptorWrites[3] = {};
-    for (int i = 0; i < 3; i++) {
-        descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptorWrites[i].dstSet = descriptorSet;
-        descriptorWrites[i].dstBinding = i;
-        descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        descriptorWrites[i].descriptorCount = 1;
-        descriptorWrites[i].pBufferInfo = &bufferInfos[i];
+// Write the pipeline cache to disk so the next process starts warm
+void savePipelineCache(VulkanContext* context) {
+    if (context->pipelineCache == VK_NULL_HANDLE) {
+        return;
     }
 
-    vkUpdateDescriptorSets(context->device, 3, descriptorWrites, 0, nullptr);
+    size_t dataSize = 0;
+    if (vkGetPipelineCacheData(context->device, context->pipelineCache, &dataSize, NULL) != VK_SUCCESS || dataSize == 0) {
+        return;
+    }
 
-    // Step 9: Record commands to dispatch the compute shader
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands(context);
+    void* data = malloc(dataSize);
+    if (vkGetPipelineCacheData(context->device, context->pipelineCache, &dataSize, data) == VK_SUCCESS) {
+        FILE* file = fopen(getPipelineCachePath(), "wb");
+        if (file) {
+            fwrite(data, 1, dataSize, file);
+            fclose(file);
+        } else {
+            fprintf(stderr, "Failed to write pipeline cache: %s\n", getPipelineCachePath());
+        }
+    }
+    free(data);
+}
 
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+const char* getTuningCachePath() {
+    const char* path = getenv("VKGRAD_TUNING_CACHE");
+    return path != NULL ? path : "cpp/tuning_cache.txt";
+}
 
-    // Dispatch the compute shader with enough workgroups to cover all elements
-    vkCmdDispatch(commandBuffer, (uint32_t)ceil(tensor1->size / 256.0), 1, 1);
+// Tuning results are only valid for the device and driver that produced them
+static std::string tuningDeviceKey(VulkanContext* context) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+    char key[64];
+    snprintf(key, sizeof(key), "%x:%x:%x", properties.vendorID, properties.deviceID, properties.driverVersion);
+    return key;
+}
 
-    endSingleTimeCommands(context, commandBuffer);
+// Read this device's lines of the tuning cache, one
+// "<device> <size class> <workgroup size> <items per thread> <shader>" per winner
+static void loadTuningCache(VulkanContext* context) {
+    context->tuningLoaded = true;
+    FILE* file = fopen(getTuningCachePath(), "r");
+    if (!file) {
+        return;
+    }
 
-    // Step 10: Cleanup (pipeline, layout, etc.)
-    vkDestroyPipeline(context->device, computePipeline, nullptr);
-    vkDestroyPipelineLayout(context->device, pipelineLayout, nullptr);
-    vkDestroyDescriptorSetLayout(context->device, descriptorSetLayout, nullptr);
-    vkDestroyShaderModule(context->device, shaderModule, nullptr);
+    std::string device = tuningDeviceKey(context);
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        char lineDevice[64];
+        char shader[768];
+        unsigned sizeClass;
+        KernelVariant variant;
+        if (sscanf(line, "%63s %u %u %u %767[^\n]", lineDevice, &sizeClass, &variant.workgroupSize, &variant.itemsPerThread, shader) == 5 &&
+            device == lineDevice && variant.workgroupSize > 0 && variant.itemsPerThread > 0) {
+            context->tuning[std::string(shader) + " " + std::to_string(sizeClass)] = variant;
+        }
+    }
+    fclose(file);
+}
+
+static void appendTuningCache(VulkanContext* context, const char* shader_path, uint32_t sizeClass, KernelVariant variant) {
+    FILE* file = fopen(getTuningCachePath(), "a");
+    if (!file) {
+        fprintf(stderr, "Failed to write tuning cache: %s\n", getTuningCachePath());
+        return;
+    }
+    fprintf(file, "%s %u %u %u %s\n", tuningDeviceKey(context).c_str(), sizeClass, variant.workgroupSize, variant.itemsPerThread, shader_path);
+    fclose(file);
+}
+
+uint32_t variantGroupCount(const ComputeKernel* kernel, uint32_t count) {
+    uint64_t perGroup = (uint64_t)kernel->variant.workgroupSize * kernel->variant.itemsPerThread;
+    return (uint32_t)((count + perGroup - 1) / perGroup);
+}
+
+// Time every variant the device allows on the op's own inputs, writing to a
+// scratch buffer in place of the output, which may alias an input
+static KernelVariant tuneKernel(VulkanContext* context, const char* shader_path, uint32_t bindingCount, uint32_t pushConstantSize,
+                                const VkBuffer* buffers, const void* pushConstants, uint32_t count, VkDeviceSize outputBytes) {
+    static const uint32_t workgroupSizes[] = {64, 128, 256, 512, 1024};
+    static const uint32_t itemCounts[] = {1, 2, 4};
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+
+    // Step 1: Substitute the scratch output
+    std::vector<VkBuffer> tuneBuffers(buffers, buffers + bindingCount);
+    DeviceAllocation allocation;
+    if (createBuffer(context, outputBytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     tuneBuffers[bindingCount - 1], allocation) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create tuning buffer\n");
+        exit(1);
+    }
+
+    // Step 2: Keep the variant with the fastest of a few synchronous runs each
+    KernelVariant best = {DEFAULT_WORKGROUP_SIZE, 1};
+    double bestTime = INFINITY;
+    for (uint32_t workgroupSize : workgroupSizes) {
+        if (workgroupSize > properties.limits.maxComputeWorkGroupSize[0] || workgroupSize > properties.limits.maxComputeWorkGroupInvocations) {
+            continue;
+        }
+        for (uint32_t items : itemCounts) {
+            KernelVariant candidate = {workgroupSize, items};
+            ComputeKernel* kernel = getComputeKernel(context, shader_path, bindingCount, pushConstantSize, &candidate);
+            uint32_t groups = variantGroupCount(kernel, count);
+            if (groups > properties.limits.maxComputeWorkGroupCount[0]) {
+                continue;
+            }
+
+            waitForSerial(context, dispatchKernel(context, kernel, tuneBuffers.data(), bindingCount, pushConstants, groups));
+            for (int repeat = 0; repeat < TUNE_REPEATS; repeat++) {
+                auto start = std::chrono::steady_clock::now();
+                waitForSerial(context, dispatchKernel(context, kernel, tuneBuffers.data(), bindingCount, pushConstants, groups));
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (elapsed < bestTime) {
+                    bestTime = elapsed;
+                    best = candidate;
+                }
+            }
+        }
+    }
+
+    destroyBuffer(context, tuneBuffers[bindingCount - 1], allocation);
+    return best;
+}
+
+// The variant of a 1-D kernel for count elements. The first op of each
+// power-of-two size class on a device is tuned, unless the tuning cache already
+// has a winner; VKGRAD_AUTOTUNE=0 keeps the default variant.
+ComputeKernel* getTunedKernel(VulkanContext* context, const char* shader_path, uint32_t bindingCount, uint32_t pushConstantSize,
+                              const VkBuffer* buffers, const void* pushConstants, uint32_t count, VkDeviceSize outputBytes) {
+    KernelVariant variant = {DEFAULT_WORKGROUP_SIZE, 1};
+    const char* autotune = getenv("VKGRAD_AUTOTUNE");
+    if (count < TUNE_MIN_ELEMENTS || (autotune != NULL && strcmp(autotune, "0") == 0)) {
+        return getComputeKernel(context, shader_path, bindingCount, pushConstantSize, &variant);
+    }
+
+    uint32_t sizeClass = 0;
+    while ((count >> (sizeClass + 1)) != 0) {
+        sizeClass++;
+    }
+    std::string key = std::string(shader_path) + " " + std::to_string(sizeClass);
+
+    // Tuning runs one op at a time, so threads hitting the same kernel wait for its result
+    std::lock_guard<std::mutex> lock(context->tuneMutex);
+    if (!context->tuningLoaded) {
+        loadTuningCache(context);
+    }
+    auto it = context->tuning.find(key);
+    if (it != context->tuning.end()) {
+        variant = it->second;
+    } else {
+        variant = tuneKernel(context, shader_path, bindingCount, pushConstantSize, buffers, pushConstants, count, outputBytes);
+        context->tuning[key] = variant;
+        appendTuningCache(context, shader_path, sizeClass, variant);
+    }
+    return getComputeKernel(context, shader_path, bindingCount, pushConstantSize, &variant);
 }
 
 VkShaderModule loadShaderModule(VkDevice device, const char* filePath) {
@@ -294,137 +810,818 @@ VkShaderModule loadShaderModule(VkDevice device, const char* filePath) {
     return shaderModule;
 }
 
-VkDescriptorPool createDescriptorPool(VkDevice device) {
-    VkDescriptorPoolSize poolSize{};
-    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    poolSize.descriptorCount = 3;  // Number of buffers in use
-
-    VkDescriptorPoolCreateInfo poolInfo{};
-    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    poolInfo.poolSizeCount = 1;
-    poolInfo.pPoolSizes = &poolSize;
-    poolInfo.maxSets = 1;  // Only one descriptor set needed
-
-    VkDescriptorPool descriptorPool;
-    if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS) {
-        fprintf(stderr, "Failed to create descriptor pool\n");
-        exit(1);
+// Pools of the calling thread, created on its first op. They are never
+// destroyed: a thread's submissions may still be in flight after it exits.
+ThreadResources* getThreadResources(VulkanContext* context) {
+    static thread_local ThreadResources* resources = NULL;
+    if (resources == NULL) {
+        resources = new ThreadResources();
+        resources->commandPool = createCommandPool(context->device, context->queueFamilyIndex);
     }
-
-    return descriptorPool;
+    return resources;
 }
 
-VkCommandBuffer beginSingleTimeCommands(VulkanContext* context) {
+static VkCommandBuffer beginCommands(VulkanContext* context, ThreadResources* resources) {
     VkCommandBufferAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = context->commandPool;
+    allocInfo.commandPool = resources->commandPool;
     allocInfo.commandBufferCount = 1;
 
     VkCommandBuffer commandBuffer;
-    vkAllocateCommandBuffers(context->device, &allocInfo, &commandBuffer);
+    {
+        std::lock_guard<std::mutex> lock(resources->mutex);
+        vkAllocateCommandBuffers(context->device, &allocInfo, &commandBuffer);
+    }
 
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
     vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    recordGlobalBarrier(commandBuffer);
 
     return commandBuffer;
 }
 
-void endSingleTimeCommands(VulkanContext* context, VkCommandBuffer commandBuffer) {
+// On unified memory the host reads tensor buffers through their mapping, which
+// only sees kernel and copy writes made available to the host stage
+static void recordHostReadBarrier(VulkanContext* context, VkCommandBuffer commandBuffer) {
+    if (!context->unifiedMemory) {
+        return;
+    }
+
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+// Start a command buffer from the calling thread's pool
+VkCommandBuffer beginSingleTimeCommands(VulkanContext* context) {
+    return beginCommands(context, getThreadResources(context));
+}
+
+// Submit the commands; in synchronous mode also wait for them to finish.
+// Returns the serial that marks their completion.
+uint64_t endSingleTimeCommands(VulkanContext* context, VkCommandBuffer commandBuffer) {
+    recordHostReadBarrier(context, commandBuffer);
     vkEndCommandBuffer(commandBuffer);
 
+    uint64_t serial = submitCommandBuffer(context, commandBuffer, getThreadResources(context));
+    if (!context->asyncMode) {
+        waitForSerial(context, serial);
+    }
+
+    return serial;
+}
+
+static bool containsBuffer(const std::vector<VkBuffer>& buffers, VkBuffer buffer) {
+    for (VkBuffer candidate : buffers) {
+        if (candidate == buffer) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Start recording an op that reads some buffers and writes one. In lazy mode the
+// op is appended to the pending batch, with a barrier only if it touches a buffer
+// an earlier op in the batch writes (or writes one an earlier op reads). The
+// batch is shared by all threads, so it stays locked until endBatchedCommands.
+VkCommandBuffer beginBatchedCommands(VulkanContext* context, const VkBuffer* reads, int readCount, VkBuffer write) {
+    if (!context->lazyMode) {
+        return beginSingleTimeCommands(context);
+    }
+
+    context->mutex.lock();
+    PendingBatch* pending = &context->pending;
+    if (pending->commandBuffer == VK_NULL_HANDLE) {
+        // A new batch starts with a barrier against earlier submissions
+        pending->commandBuffer = beginCommands(context, &context->batchResources);
+        pending->opCount = 0;
+    } else {
+        bool hazard = containsBuffer(pending->writes, write) || containsBuffer(pending->reads, write);
+        for (int i = 0; i < readCount && !hazard; i++) {
+            hazard = containsBuffer(pending->writes, reads[i]);
+        }
+
+        if (hazard) {
+            recordGlobalBarrier(pending->commandBuffer);
+            pending->writes.clear();
+            pending->reads.clear();
+        }
+    }
+
+    for (int i = 0; i < readCount; i++) {
+        pending->reads.push_back(reads[i]);
+    }
+    pending->writes.push_back(write);
+
+    return pending->commandBuffer;
+}
+
+// Finish recording an op. Returns the serial that marks its completion; in lazy
+// mode that is the serial the pending batch will be submitted with.
+uint64_t endBatchedCommands(VulkanContext* context, VkCommandBuffer commandBuffer) {
+    // The pending batch, not lazyMode, says which path began this op: another
+    // thread may have switched modes in between
+    context->mutex.lock();
+    PendingBatch* pending = &context->pending;
+    if (commandBuffer != pending->commandBuffer) {
+        context->mutex.unlock();
+        return endSingleTimeCommands(context, commandBuffer);
+    }
+
+    pending->opCount++;
+
+    uint64_t serial = context->nextSerial;
+    if (pending->opCount >= context->lazyBatchSize) {
+        flushPendingCommands(context);
+    }
+
+    // Once for this call and once for beginBatchedCommands
+    context->mutex.unlock();
+    context->mutex.unlock();
+    return serial;
+}
+
+// Submit the lazy batch, if there is one
+void flushPendingCommands(VulkanContext* context) {
+    std::lock_guard<std::recursive_mutex> lock(context->mutex);
+    PendingBatch* pending = &context->pending;
+    if (pending->commandBuffer == VK_NULL_HANDLE) {
+        return;
+    }
+
+    VkCommandBuffer commandBuffer = pending->commandBuffer;
+    pending->commandBuffer = VK_NULL_HANDLE;
+    pending->writes.clear();
+    pending->reads.clear();
+    pending->opCount = 0;
+
+    recordHostReadBarrier(context, commandBuffer);
+    vkEndCommandBuffer(commandBuffer);
+    uint64_t serial = submitCommandBuffer(context, commandBuffer, &context->batchResources);
+    if (!context->asyncMode) {
+        waitForSerial(context, serial);
+    }
+}
+
+// Serial of the most recent work, including a lazy batch that is not yet submitted
+uint64_t latestSerial(VulkanContext* context) {
+    std::lock_guard<std::recursive_mutex> lock(context->mutex);
+    return context->pending.commandBuffer != VK_NULL_HANDLE ? context->nextSerial.load() : context->nextSerial - 1;
+}
+
+// Order this command buffer after everything submitted before it on the queue.
+// Without it, a kernel could read a buffer an earlier submission is still writing.
+// A queue that only does transfers gets a barrier over the transfer stage alone.
+void recordGlobalBarrier(VkCommandBuffer commandBuffer, bool transferOnly) {
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    VkPipelineStageFlags stages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    if (!transferOnly) {
+        barrier.srcAccessMask |= VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask |= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        stages |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    }
+
+    vkCmdPipelineBarrier(commandBuffer, stages, stages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+static VkSemaphore acquireSemaphore(VulkanContext* context) {
+    std::lock_guard<std::recursive_mutex> lock(context->mutex);
+    if (!context->freeSemaphores.empty()) {
+        VkSemaphore semaphore = context->freeSemaphores.back();
+        context->freeSemaphores.pop_back();
+        return semaphore;
+    }
+
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    VkSemaphore semaphore;
+    if (vkCreateSemaphore(context->device, &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create semaphore\n");
+        exit(1);
+    }
+    return semaphore;
+}
+
+// Make the next transfer submission wait for every kernel submitted so far, so a
+// download reads what they wrote. An empty batch on the compute queue signals
+// once everything before it there has finished.
+static void orderTransferAfterCompute(VulkanContext* context) {
+    std::lock_guard<std::recursive_mutex> lock(context->mutex);
+    if (!context->separateTransferQueue || context->computeSignal != VK_NULL_HANDLE) {
+        return;
+    }
+
+    flushPendingCommands(context);
+    retireSubmissions(context);
+    bool computeBusy = false;
+    for (const Submission& submission : context->inflight) {
+        computeBusy = computeBusy || !submission.transfer;
+    }
+    if (!computeBusy) {
+        return;
+    }
+
+    VkSemaphore semaphore = acquireSemaphore(context);
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &semaphore;
+    if (vkQueueSubmit(context->queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to submit command buffer\n");
+        exit(1);
+    }
+    context->computeSignal = semaphore;
+}
+
+// Submit a recorded command buffer with a fence and track it until it retires.
+// Transfers go to the transfer queue; each signals a semaphore that the next
+// submission on either queue waits for, so kernels see every earlier upload.
+// The command buffer is freed to owner's pool on retire unless owner is NULL.
+// Queues need external synchronization, so this is the one step all threads
+// take in turn; it only submits what they recorded in parallel.
+uint64_t submitCommandBuffer(VulkanContext* context, VkCommandBuffer commandBuffer, ThreadResources* owner, bool transfer) {
+    std::lock_guard<std::recursive_mutex> lock(context->mutex);
+
+    // Ops recorded lazily come first in program order, so they go first on the queue
+    flushPendingCommands(context);
+
+    // Keep the queue bounded so async callers cannot run arbitrarily far ahead
+    if (context->inflight.size() >= MAX_INFLIGHT_SUBMISSIONS) {
+        waitForSerial(context, context->inflight.front().serial);
+    }
+
+    VkFence fence;
+    if (!context->freeFences.empty()) {
+        fence = context->freeFences.back();
+        context->freeFences.pop_back();
+    } else {
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        if (vkCreateFence(context->device, &fenceInfo, nullptr, &fence) != VK_SUCCESS) {
+            fprintf(stderr, "Failed to create fence\n");
+            exit(1);
+        }
+    }
+
+    Submission submission{};
+    transfer = transfer && context->separateTransferQueue;
+    VkSemaphore signal = VK_NULL_HANDLE;
+    std::vector<VkPipelineStageFlags> waitStages;
+    if (context->separateTransferQueue) {
+        // Step 1: Wait for the latest transfer, and for the kernels a transfer must follow
+        VkPipelineStageFlags stages = transfer ? VK_PIPELINE_STAGE_TRANSFER_BIT
+                                               : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+        if (context->transferSignal != VK_NULL_HANDLE) {
+            submission.semaphores.push_back(context->transferSignal);
+            context->transferSignal = VK_NULL_HANDLE;
+        }
+        if (transfer && context->computeSignal != VK_NULL_HANDLE) {
+            submission.semaphores.push_back(context->computeSignal);
+            context->computeSignal = VK_NULL_HANDLE;
+        }
+        waitStages.assign(submission.semaphores.size(), stages);
+
+        // Step 2: Signal for whatever runs next on the other queue
+        if (transfer) {
+            signal = acquireSemaphore(context);
+        }
+    }
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.waitSemaphoreCount = (uint32_t)submission.semaphores.size();
+    submitInfo.pWaitSemaphores = submission.semaphores.data();
+    submitInfo.pWaitDstStageMask = waitStages.data();
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &commandBuffer;
+    submitInfo.signalSemaphoreCount = signal != VK_NULL_HANDLE ? 1 : 0;
+    submitInfo.pSignalSemaphores = &signal;
+
+    if (vkQueueSubmit(transfer ? context->transferQueue : context->queue, 1, &submitInfo, fence) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to submit command buffer\n");
+        exit(1);
+    }
+    if (signal != VK_NULL_HANDLE) {
+        context->transferSignal = signal;
+    }
+
+    submission.serial = context->nextSerial++;
+    submission.fence = fence;
+    submission.transfer = transfer;
+    submission.commandBuffer = owner != NULL ? commandBuffer : VK_NULL_HANDLE;
+    submission.owner = owner;
+    context->inflight.push_back(submission);
+
+    return submission.serial;
+}
+
+// Release everything owned by submissions whose fences have signaled. Each queue
+// finishes in submission order, but the two queues run independently, so a
+// transfer may retire while an earlier kernel is still running.
+void retireSubmissions(VulkanContext* context) {
+    std::lock_guard<std::recursive_mutex> lock(context->mutex);
+
+    // Fences retired while another thread waited on them are reset once nobody waits
+    if (context->fenceWaiters == 0 && !context->signaledFences.empty()) {
+        vkResetFences(context->device, (uint32_t)context->signaledFences.size(), context->signaledFences.data());
+        context->freeFences.insert(context->freeFences.end(), context->signaledFences.begin(), context->signaledFences.end());
+        context->signaledFences.clear();
+    }
 
-    vkQueueSubmit(context->queue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(context->queue);
+    bool blocked[2] = {false, false};  // Indexed by Submission::transfer
+    for (auto it = context->inflight.begin(); it != context->inflight.end();) {
+        Submission& submission = *it;
+        if (blocked[submission.transfer] || vkGetFenceStatus(context->device, submission.fence) != VK_SUCCESS) {
+            blocked[submission.transfer] = true;
+            ++it;
+            continue;
+        }
 
-    vkFreeCommandBuffers(context->device, context->commandPool, 1, &commandBuffer);
+        if (context->fenceWaiters > 0) {
+            context->signaledFences.push_back(submission.fence);
+        } else {
+            vkResetFences(context->device, 1, &submission.fence);
+            context->freeFences.push_back(submission.fence);
+        }
+        if (submission.commandBuffer != VK_NULL_HANDLE) {
+            std::lock_guard<std::mutex> ownerLock(submission.owner->mutex);
+            vkFreeCommandBuffers(context->device, submission.owner->commandPool, 1, &submission.commandBuffer);
+        }
+        for (VkSemaphore semaphore : submission.semaphores) {
+            context->freeSemaphores.push_back(semaphore);
+        }
+
+        it = context->inflight.erase(it);
+    }
+    context->completedSerial = context->inflight.empty() ? context->nextSerial - 1 : context->inflight.front().serial - 1;
+    profilerCollectGpu(context->completedSerial);
+    recycleDescriptorPools(&context->descriptors, context->device, context->completedSerial);
+
+    // Buffers freed while in use can now go back to the cache or the allocator
+    for (size_t i = 0; i < context->deferredFrees.size();) {
+        DeferredFree& deferred = context->deferredFrees[i];
+        if (deferred.serial <= context->completedSerial && deferred.cache) {
+            putCachedBuffer(&context->bufferCache, deferred.buffer, deferred.allocation);
+            deferred = context->deferredFrees.back();
+            context->deferredFrees.pop_back();
+        } else if (deferred.serial <= context->completedSerial) {
+            vkDestroyBuffer(context->device, deferred.buffer, nullptr);
+            freeDeviceMemory(&context->allocator, context->device, &deferred.allocation);
+            free(deferred.hostMemory);
+            deferred = context->deferredFrees.back();
+            context->deferredFrees.pop_back();
+        } else {
+            i++;
+        }
+    }
+}
+
+// Block until the submission with the given serial (and all before it) has finished
+void waitForSerial(VulkanContext* context, uint64_t serial) {
+    std::unique_lock<std::recursive_mutex> lock(context->mutex);
+    if (serial >= context->nextSerial) {
+        flushPendingCommands(context);
+    }
+
+    while (context->completedSerial < serial && !context->inflight.empty()) {
+        // Other threads keep submitting while this one sleeps. Retiring leaves
+        // the fence alone until every waiter is done with it.
+        VkFence fence = context->inflight.front().fence;
+        context->fenceWaiters++;
+        lock.unlock();
+        vkWaitForFences(context->device, 1, &fence, VK_TRUE, UINT64_MAX);
+        lock.lock();
+        context->fenceWaiters--;
+        retireSubmissions(context);
+    }
 }
 
+void waitForIdle(VulkanContext* context) {
+    waitForSerial(context, latestSerial(context));
+}
 
 // Clean up Vulkan resources for a tensor
 void cleanup_tensor_vulkan(Tensor* tensor) {
-    VulkanContext* context = getVulkanContext();
     if (tensor->device != NULL && strcmp(tensor->device, "vulkan") == 0) {
-        vkDestroyBuffer(context->device, tensor->buffer, nullptr);
-        vkFreeMemory(context->device, tensor->memory, nullptr);
+        release_storage(tensor->storage);
+        tensor->storage = NULL;
         tensor->buffer = VK_NULL_HANDLE;
-        tensor->memory = VK_NULL_HANDLE;
+        free(tensor->device);
         tensor->device = NULL;
 
         printf("Tensor Vulkan resources cleaned up.\n");
     }
 }
 
-// Create a buffer and allocate memory
-VkResult createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+// Create a buffer, not yet bound to memory
+static VkResult createBufferHandle(VulkanContext* context, VkDeviceSize size, VkBufferUsageFlags usage, const void* pNext, VkBuffer& buffer) {
     VkBufferCreateInfo bufferInfo{};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.pNext = pNext;
     bufferInfo.size = size;
     bufferInfo.usage = usage;
     bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-    if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+    // Tensors move between the compute and transfer families freely, with
+    // semaphores ordering the accesses, instead of by ownership transfers
+    uint32_t families[2] = {context->queueFamilyIndex, context->transferFamilyIndex};
+    if (families[0] != families[1]) {
+        bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufferInfo.queueFamilyIndexCount = 2;
+        bufferInfo.pQueueFamilyIndices = families;
+    }
+
+    if (vkCreateBuffer(context->device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+        return VK_ERROR_INITIALIZATION_FAILED;
+    }
+    return VK_SUCCESS;
+}
+
+// Create a buffer and bind it to a sub-allocation from the context's allocator
+VkResult createBuffer(VulkanContext* context, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, DeviceAllocation& allocation) {
+    ProfileScope scope("createBuffer", "alloc", size);
+    if (createBufferHandle(context, size, usage, nullptr, buffer) != VK_SUCCESS) {
         return VK_ERROR_INITIALIZATION_FAILED;
     }
 
     VkMemoryRequirements memRequirements;
-    vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+    vkGetBufferMemoryRequirements(context->device, buffer, &memRequirements);
 
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(physicalDevice, memRequirements.memoryTypeBits, properties);
+    uint32_t memoryTypeIndex = findMemoryType(context->physicalDevice, memRequirements.memoryTypeBits, properties);
+    bool hostVisible = (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
 
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
+    if (allocateDeviceMemory(&context->allocator, context->device, memRequirements, memoryTypeIndex, hostVisible, &allocation) != VK_SUCCESS) {
+        vkDestroyBuffer(context->device, buffer, nullptr);
+        buffer = VK_NULL_HANDLE;
         return VK_ERROR_OUT_OF_DEVICE_MEMORY;
     }
 
-    vkBindBufferMemory(device, buffer, bufferMemory, 0);
+    vkBindBufferMemory(context->device, buffer, allocation.memory, allocation.offset);
 
     return VK_SUCCESS;
 }
 
-// Copy data from one buffer to another
-void copyBuffer(VkDevice device, VkCommandPool commandPool, VkQueue queue, VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+// Destroy a buffer and return its memory to the allocator. If work is still in
+// flight the buffer may be in use, so it is released once that work retires.
+// hostMemory, if given, is what allocation imports; it is freed right after.
+void destroyBuffer(VulkanContext* context, VkBuffer& buffer, DeviceAllocation& allocation, void* hostMemory) {
+    std::lock_guard<std::recursive_mutex> lock(context->mutex);
+    retireSubmissions(context);
+
+    // Cached descriptor sets must not outlive the buffer, nor be found again
+    // once its handle is reused
+    releaseDescriptorSets(&context->descriptors, buffer);
+
+    if (!context->inflight.empty() || context->pending.commandBuffer != VK_NULL_HANDLE) {
+        DeferredFree deferred{};
+        deferred.serial = latestSerial(context);
+        deferred.buffer = buffer;
+        deferred.allocation = allocation;
+        deferred.hostMemory = hostMemory;
+        context->deferredFrees.push_back(deferred);
+
+        buffer = VK_NULL_HANDLE;
+        memset(&allocation, 0, sizeof(DeviceAllocation));
+        return;
+    }
+
+    if (buffer != VK_NULL_HANDLE) {
+        vkDestroyBuffer(context->device, buffer, nullptr);
+        buffer = VK_NULL_HANDLE;
+    }
+    freeDeviceMemory(&context->allocator, context->device, &allocation);
+    free(hostMemory);
+}
+
+// Import host memory as a buffer, if the device supports it and pointer has the
+// alignment it requires. The size is rounded up to that alignment, which stays
+// within the last page pointer covers as long as the alignment is at most a page.
+VkResult importHostBuffer(VulkanContext* context, void* pointer, VkDeviceSize size, VkBuffer& buffer, DeviceAllocation& allocation) {
+    VkDeviceSize alignment = context->hostImportAlignment;
+    if (!context->hostImport || (uintptr_t)pointer % alignment != 0) {
+        return VK_ERROR_FEATURE_NOT_PRESENT;
+    }
+    VkDeviceSize rounded = (size + alignment - 1) / alignment * alignment;
+    if (rounded != size && alignment > (VkDeviceSize)sysconf(_SC_PAGESIZE)) {
+        return VK_ERROR_FEATURE_NOT_PRESENT;
+    }
+
+    // Step 1: Memory types the pointer can be imported as
+    VkMemoryHostPointerPropertiesEXT hostProperties{};
+    hostProperties.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+    VkResult result = context->getMemoryHostPointerProperties(context->device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+                                                              pointer, &hostProperties);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    // Step 2: A buffer that may be bound to it, in a coherent type so the host
+    // side needs no flushes
+    VkExternalMemoryBufferCreateInfo externalInfo{};
+    externalInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+    externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    result = createBufferHandle(context, rounded, usage, &externalInfo, buffer);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(context->device, buffer, &requirements);
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(context->physicalDevice, &memProperties);
+    uint32_t memoryTypeIndex = UINT32_MAX;
+    for (uint32_t i = 0; i < memProperties.memoryTypeCount && requirements.size <= rounded; i++) {
+        if ((requirements.memoryTypeBits & hostProperties.memoryTypeBits & (1u << i)) &&
+            (memProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+            memoryTypeIndex = i;
+            break;
+        }
+    }
+
+    // Step 3: Import the memory and bind the buffer to all of it
+    if (memoryTypeIndex == UINT32_MAX) {
+        result = VK_ERROR_FEATURE_NOT_PRESENT;
+    } else {
+        result = importHostMemory(context->device, pointer, rounded, memoryTypeIndex, &allocation);
+    }
+    if (result != VK_SUCCESS) {
+        vkDestroyBuffer(context->device, buffer, nullptr);
+        buffer = VK_NULL_HANDLE;
+        return result;
+    }
+    vkBindBufferMemory(context->device, buffer, allocation.memory, 0);
+    return VK_SUCCESS;
+}
+
+// Create a device-local buffer for a tensor, host-visible too on unified memory.
+// With the buffer cache on, the size is rounded up to its bucket and a cached
+// buffer of that bucket is reused if there is one. Running out of memory empties
+// the cache and tries once more.
+VkResult createTensorBuffer(VulkanContext* context, VkDeviceSize size, VkBuffer& buffer, DeviceAllocation& allocation) {
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (!context->bufferCache.enabled) {
+        return createBuffer(context, size, usage, context->tensorMemoryProperties, buffer, allocation);
+    }
+
+    VkDeviceSize bucket = bufferCacheBucket(size);
+    if (takeCachedBuffer(&context->bufferCache, bucket, buffer, allocation)) {
+        return VK_SUCCESS;
+    }
+
+    VkResult result = createBuffer(context, bucket, usage, context->tensorMemoryProperties, buffer, allocation);
+    if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY) {
+        // Buffers still in flight are cached once they retire, so wait for them first
+        waitForIdle(context);
+        emptyBufferCache(context);
+        result = createBuffer(context, bucket, usage, context->tensorMemoryProperties, buffer, allocation);
+    }
+    if (result == VK_SUCCESS) {
+        trackCachedBuffer(&context->bufferCache, buffer, bucket);
+    }
+    return result;
+}
+
+// Free a buffer made by createTensorBuffer. A cached buffer goes back to its
+// bucket once the work already submitted is done with it; it stays alive, so the
+// descriptor sets cached for it remain valid.
+void destroyTensorBuffer(VulkanContext* context, VkBuffer& buffer, DeviceAllocation& allocation) {
+    if (!context->bufferCache.enabled) {
+        destroyBuffer(context, buffer, allocation);
+        return;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(context->mutex);
+    retireSubmissions(context);
+    if (!context->inflight.empty() || context->pending.commandBuffer != VK_NULL_HANDLE) {
+        DeferredFree deferred{};
+        deferred.serial = latestSerial(context);
+        deferred.buffer = buffer;
+        deferred.allocation = allocation;
+        deferred.cache = true;
+        context->deferredFrees.push_back(deferred);
+    } else {
+        putCachedBuffer(&context->bufferCache, buffer, allocation);
+    }
+    buffer = VK_NULL_HANDLE;
+    memset(&allocation, 0, sizeof(DeviceAllocation));
+}
+
+// Destroy every cached buffer, returning its memory to the allocator
+void emptyBufferCache(VulkanContext* context) {
+    std::lock_guard<std::recursive_mutex> lock(context->mutex);
+    for (CachedBuffer& cached : drainBufferCache(&context->bufferCache)) {
+        destroyBuffer(context, cached.buffer, cached.allocation);
+    }
+}
+
+// Allocate the staging buffer and the per-chunk command buffers
+void createStagingRing(VulkanContext* context) {
+    StagingRing* ring = &context->staging;
+
+    if (createBuffer(context, STAGING_CHUNK_SIZE * STAGING_CHUNK_COUNT,
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     ring->buffer, ring->allocation) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create staging buffer\n");
+        exit(1);
+    }
+
     VkCommandBufferAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = commandPool;
-    allocInfo.commandBufferCount = 1;
+    allocInfo.commandPool = context->transferPool;
+    allocInfo.commandBufferCount = STAGING_CHUNK_COUNT;
+    vkAllocateCommandBuffers(context->device, &allocInfo, ring->commandBuffers);
 
-    VkCommandBuffer commandBuffer;
-    vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+    for (int i = 0; i < STAGING_CHUNK_COUNT; i++) {
+        ring->serials[i] = 0;
+    }
+    ring->next = 0;
+}
+
+// Wait until a staging chunk is free, then record a copy into its command buffer
+static VkCommandBuffer beginStagingChunk(VulkanContext* context, uint32_t slot) {
+    StagingRing* ring = &context->staging;
+
+    waitForSerial(context, ring->serials[slot]);
+    vkResetCommandBuffer(ring->commandBuffers[slot], 0);
 
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(ring->commandBuffers[slot], &beginInfo);
+    recordGlobalBarrier(ring->commandBuffers[slot], context->transferFamilyIndex != context->queueFamilyIndex);
 
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    return ring->commandBuffers[slot];
+}
+
+// The profiler's queries are set up for the compute family, which a dedicated
+// transfer family may not share timestamp support with
+static uint32_t beginStagingTiming(VulkanContext* context, VkCommandBuffer commandBuffer) {
+    return context->transferFamilyIndex == context->queueFamilyIndex ? profilerBeginGpu(commandBuffer) : PROFILER_NO_QUERY;
+}
+
+static void submitStagingChunk(VulkanContext* context, uint32_t slot) {
+    StagingRing* ring = &context->staging;
+
+    vkEndCommandBuffer(ring->commandBuffers[slot]);
+    ring->serials[slot] = submitCommandBuffer(context, ring->commandBuffers[slot], NULL, true);
+}
+
+// Copy host memory into a device buffer, one staging chunk at a time. The ring
+// serves one transfer at a time; concurrent callers take turns.
+void uploadToBuffer(VulkanContext* context, VkBuffer dstBuffer, VkDeviceSize dstOffset, const void* src, VkDeviceSize size) {
+    std::lock_guard<std::mutex> lock(context->stagingMutex);
+    StagingRing* ring = &context->staging;
+
+    for (VkDeviceSize done = 0; done < size; done += STAGING_CHUNK_SIZE) {
+        VkDeviceSize chunk = size - done < STAGING_CHUNK_SIZE ? size - done : STAGING_CHUNK_SIZE;
+        uint32_t slot = ring->next;
+        ring->next = (ring->next + 1) % STAGING_CHUNK_COUNT;
+
+        // The previous chunks are still copying on the GPU while this memcpy runs
+        VkCommandBuffer commandBuffer = beginStagingChunk(context, slot);
+        memcpy((char*)ring->allocation.mapped + slot * STAGING_CHUNK_SIZE, (const char*)src + done, chunk);
+
+        VkBufferCopy copyRegion{};
+        copyRegion.srcOffset = slot * STAGING_CHUNK_SIZE;
+        copyRegion.dstOffset = dstOffset + done;
+        copyRegion.size = chunk;
+        uint32_t query = beginStagingTiming(context, commandBuffer);
+        vkCmdCopyBuffer(commandBuffer, ring->buffer, dstBuffer, 1, &copyRegion);
+        profilerEndGpu(commandBuffer, query);
+
+        submitStagingChunk(context, slot);
+        profilerRecordGpu(query, "upload", "transfer", chunk, ring->serials[slot]);
+    }
+
+    // The source may be reused as soon as we return; only the GPU side is still
+    // pending, which async callers track through the last chunk's serial
+    if (!context->asyncMode) {
+        waitForIdle(context);
+    }
+}
+
+// Copy a device buffer into host memory, keeping every staging chunk busy
+void downloadFromBuffer(VulkanContext* context, VkBuffer srcBuffer, VkDeviceSize srcOffset, void* dst, VkDeviceSize size) {
+    std::lock_guard<std::mutex> lock(context->stagingMutex);
+    StagingRing* ring = &context->staging;
+    VkDeviceSize chunkCount = (size + STAGING_CHUNK_SIZE - 1) / STAGING_CHUNK_SIZE;
+    uint32_t firstSlot = ring->next;
+
+    // The source was written by kernels on the other queue
+    orderTransferAfterCompute(context);
+
+    auto submitChunk = [&](VkDeviceSize index) {
+        uint32_t slot = (firstSlot + index) % STAGING_CHUNK_COUNT;
+        VkDeviceSize offset = index * STAGING_CHUNK_SIZE;
+
+        VkCommandBuffer commandBuffer = beginStagingChunk(context, slot);
+
+        VkBufferCopy copyRegion{};
+        copyRegion.srcOffset = srcOffset + offset;
+        copyRegion.dstOffset = slot * STAGING_CHUNK_SIZE;
+        copyRegion.size = size - offset < STAGING_CHUNK_SIZE ? size - offset : STAGING_CHUNK_SIZE;
+        uint32_t query = beginStagingTiming(context, commandBuffer);
+        vkCmdCopyBuffer(commandBuffer, srcBuffer, ring->buffer, 1, &copyRegion);
+        profilerEndGpu(commandBuffer, query);
+
+        // Make the copied bytes visible to the host once the fence signals
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        submitStagingChunk(context, slot);
+        profilerRecordGpu(query, "download", "transfer", copyRegion.size, ring->serials[slot]);
+    };
+
+    // Step 1: Fill the ring with copies
+    for (VkDeviceSize index = 0; index < chunkCount && index < STAGING_CHUNK_COUNT; index++) {
+        submitChunk(index);
+    }
+
+    // Step 2: Drain chunks in order, refilling each slot as soon as it is read
+    for (VkDeviceSize index = 0; index < chunkCount; index++) {
+        uint32_t slot = (firstSlot + index) % STAGING_CHUNK_COUNT;
+        VkDeviceSize offset = index * STAGING_CHUNK_SIZE;
+        VkDeviceSize chunk = size - offset < STAGING_CHUNK_SIZE ? size - offset : STAGING_CHUNK_SIZE;
+
+        waitForSerial(context, ring->serials[slot]);
+        memcpy((char*)dst + offset, (char*)ring->allocation.mapped + slot * STAGING_CHUNK_SIZE, chunk);
+
+        if (index + STAGING_CHUNK_COUNT < chunkCount) {
+            submitChunk(index + STAGING_CHUNK_COUNT);
+        }
+    }
+
+    ring->next = (firstSlot + chunkCount) % STAGING_CHUNK_COUNT;
+}
+
+// Copy host memory into a tensor buffer that no submitted work uses yet. Mapped
+// buffers take a plain memcpy, which submissions made afterwards see. Returns the
+// serial of the GPU copy still pending, 0 if there is none.
+uint64_t writeTensorBuffer(VulkanContext* context, VkBuffer buffer, const DeviceAllocation& allocation, const void* src, VkDeviceSize size) {
+    if (allocation.mapped != NULL) {
+        memcpy(allocation.mapped, src, size);
+        return 0;
+    }
+
+    uploadToBuffer(context, buffer, 0, src, size);
+    return context->nextSerial - 1;
+}
+
+// Copy bytes out of a tensor buffer. A mapped buffer is read in place; views of the
+// storage may have written it through their own serials, so all work up to now is
+// waited for first, as a staged download would.
+void readTensorBuffer(VulkanContext* context, VkBuffer buffer, const DeviceAllocation& allocation, VkDeviceSize offset, void* dst, VkDeviceSize size) {
+    if (allocation.mapped == NULL) {
+        downloadFromBuffer(context, buffer, offset, dst, size);
+        return;
+    }
+
+    waitForSerial(context, latestSerial(context));
+    memcpy(dst, (const char*)allocation.mapped + offset, size);
+}
+
+// Copy data from one buffer to another
+uint64_t copyBuffer(VulkanContext* context, VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(context);
 
     VkBufferCopy copyRegion{};
     copyRegion.srcOffset = 0;
     copyRegion.dstOffset = 0;
     copyRegion.size = size;
+    uint32_t query = profilerBeginGpu(commandBuffer);
     vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+    profilerEndGpu(commandBuffer, query);
 
-    vkEndCommandBuffer(commandBuffer);
-
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-
-    vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(queue);
+    uint64_t serial = endSingleTimeCommands(context, commandBuffer);
+    profilerRecordGpu(query, "copyBuffer", "transfer", size * 2, serial);
+    return serial;
+}
 
-    vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+// Fill a buffer with a repeated 32-bit pattern, batched like a dispatch
+uint64_t fillBuffer(VulkanContext* context, VkBuffer buffer, VkDeviceSize size, uint32_t pattern) {
+    VkCommandBuffer commandBuffer = beginBatchedCommands(context, NULL, 0, buffer);
+    uint32_t query = profilerBeginGpu(commandBuffer);
+    vkCmdFillBuffer(commandBuffer, buffer, 0, size, pattern);
+    profilerEndGpu(commandBuffer, query);
+    uint64_t serial = endBatchedCommands(context, commandBuffer);
+    profilerRecordGpu(query, "fillBuffer", "transfer", size, serial);
+    return serial;
 }
 
 // Find a memory type that fits the requirements
@@ -442,6 +1639,17 @@ uint32_t findMemoryType(VkPhysicalDevice physicalDevice, uint32_t typeFilter, Vk
     exit(1);
 }
 
+// Highest API version the loader supports; a Vulkan 1.0 loader lacks the query
+uint32_t getInstanceApiVersion() {
+    uint32_t version = VK_API_VERSION_1_0;
+    PFN_vkEnumerateInstanceVersion enumerateInstanceVersion =
+        (PFN_vkEnumerateInstanceVersion)vkGetInstanceProcAddr(NULL, "vkEnumerateInstanceVersion");
+    if (enumerateInstanceVersion != NULL) {
+        enumerateInstanceVersion(&version);
+    }
+    return version;
+}
+
 VkInstance createInstance() {
     VkApplicationInfo appInfo;
     memset(&appInfo, 0, sizeof(appInfo));
@@ -450,7 +1658,7 @@ VkInstance createInstance() {
     appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     appInfo.pEngineName = "No Engine";
     appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.apiVersion = VK_API_VERSION_1_0;
+    appInfo.apiVersion = getInstanceApiVersion() >= VK_API_VERSION_1_1 ? VK_API_VERSION_1_1 : VK_API_VERSION_1_0;  // 1.1 for subgroups
 
     // Instance creation info
     VkInstanceCreateInfo createInfo;
@@ -477,6 +1685,140 @@ VkInstance createInstance() {
     return instance;
 }
 
+// Subgroup arithmetic needs Vulkan 1.1 on the instance and the device, and must be
+// supported in compute shaders. VKGRAD_SUBGROUPS=0 turns it off.
+void querySubgroupSupport(VulkanContext* context) {
+    context->subgroupArithmetic = false;
+    context->subgroupSize = 1;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+    const char* enabled = getenv("VKGRAD_SUBGROUPS");
+    if (getInstanceApiVersion() < VK_API_VERSION_1_1 || properties.apiVersion < VK_API_VERSION_1_1 ||
+        (enabled != NULL && strcmp(enabled, "0") == 0)) {
+        return;
+    }
+
+    VkPhysicalDeviceSubgroupProperties subgroupProperties{};
+    subgroupProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties2{};
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties2.pNext = &subgroupProperties;
+    vkGetPhysicalDeviceProperties2(context->physicalDevice, &properties2);
+
+    context->subgroupSize = subgroupProperties.subgroupSize;
+    context->subgroupArithmetic = (subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+                                  (subgroupProperties.supportedOperations & VK_SUBGROUP_FEATURE_ARITHMETIC_BIT);
+}
+
+static bool hasDeviceExtension(VkPhysicalDevice physicalDevice, const char* name) {
+    uint32_t count = 0;
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &count, nullptr);
+    std::vector<VkExtensionProperties> extensions(count);
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &count, extensions.data());
+    for (const VkExtensionProperties& extension : extensions) {
+        if (strcmp(extension.extensionName, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 16-bit storage buffers are core in Vulkan 1.1; 8-bit ones need 1.2 or
+// VK_KHR_8bit_storage. Both are optional features, enabled at device creation
+// when present.
+void queryStorageSupport(VulkanContext* context) {
+    context->storage16Bit = false;
+    context->storage8Bit = false;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+    if (getInstanceApiVersion() < VK_API_VERSION_1_1 || properties.apiVersion < VK_API_VERSION_1_1) {
+        return;
+    }
+
+    VkPhysicalDevice8BitStorageFeatures storage8{};
+    storage8.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_8BIT_STORAGE_FEATURES;
+    VkPhysicalDevice16BitStorageFeatures storage16{};
+    storage16.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES;
+    bool has8Bit = properties.apiVersion >= VK_API_VERSION_1_2 ||
+                   hasDeviceExtension(context->physicalDevice, VK_KHR_8BIT_STORAGE_EXTENSION_NAME);
+    storage16.pNext = has8Bit ? &storage8 : nullptr;
+
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &storage16;
+    vkGetPhysicalDeviceFeatures2(context->physicalDevice, &features);
+
+    context->storage16Bit = storage16.storageBuffer16BitAccess;
+    context->storage8Bit = storage8.storageBuffer8BitAccess;
+}
+
+// Integrated GPUs and CPU implementations such as lavapipe share memory with the
+// host, and expose it as device-local and host-visible at once. Tensors go there,
+// in a host-cached type when there is one so that reads are fast. Discrete GPUs
+// with resizable BAR have such memory too, but reading it from the host crosses
+// PCIe, so they keep staging copies unless VKGRAD_UNIFIED_MEMORY=1.
+void queryUnifiedMemory(VulkanContext* context) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(context->physicalDevice, &memProperties);
+
+    VkMemoryPropertyFlags unified = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    bool found = false;
+    bool cached = false;
+    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+        VkMemoryPropertyFlags flags = memProperties.memoryTypes[i].propertyFlags;
+        if ((flags & unified) == unified) {
+            found = true;
+            cached = cached || (flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) != 0;
+        }
+    }
+
+    const char* setting = getenv("VKGRAD_UNIFIED_MEMORY");
+    bool shared = properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU || properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU;
+    if (setting != NULL) {
+        shared = strcmp(setting, "0") != 0;
+    }
+
+    context->unifiedMemory = found && shared;
+    context->tensorMemoryProperties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    if (context->unifiedMemory) {
+        context->tensorMemoryProperties = unified | (cached ? VK_MEMORY_PROPERTY_HOST_CACHED_BIT : 0);
+    }
+}
+
+// VK_EXT_external_memory_host needs Vulkan 1.1 for its external memory types.
+// Set VKGRAD_HOST_IMPORT=0 to copy every upload through mapped or staging memory.
+void queryHostImport(VulkanContext* context) {
+    context->hostImport = false;
+    context->hostImportAlignment = 0;
+    context->getMemoryHostPointerProperties = NULL;
+
+    const char* setting = getenv("VKGRAD_HOST_IMPORT");
+    if (setting != NULL && strcmp(setting, "0") == 0) {
+        return;
+    }
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+    if (getInstanceApiVersion() < VK_API_VERSION_1_1 || properties.apiVersion < VK_API_VERSION_1_1 ||
+        !hasDeviceExtension(context->physicalDevice, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)) {
+        return;
+    }
+
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProperties{};
+    hostProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+    VkPhysicalDeviceProperties2 properties2{};
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties2.pNext = &hostProperties;
+    vkGetPhysicalDeviceProperties2(context->physicalDevice, &properties2);
+
+    context->hostImport = hostProperties.minImportedHostPointerAlignment > 0;
+    context->hostImportAlignment = hostProperties.minImportedHostPointerAlignment;
+}
+
 VkPhysicalDevice pickPhysicalDevice(VkInstance instance) {
     uint32_t deviceCount = 0;
     vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
@@ -494,27 +1836,124 @@ VkPhysicalDevice pickPhysicalDevice(VkInstance instance) {
     return physicalDevice;
 }
 
-VkDevice createLogicalDevice(VkPhysicalDevice physicalDevice, VkQueue* queue) {
-    float queuePriority = 1.0f;
+// Pick the queue family kernels run on, preferring one without graphics, and a
+// queue for staging copies: a transfer-only family (the device's DMA engines)
+// if there is one, else a second queue of the compute family. Set
+// VKGRAD_TRANSFER_QUEUE=0 to keep copies on the compute queue.
+void selectQueueFamilies(VulkanContext* context) {
+    uint32_t familyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(context->physicalDevice, &familyCount, nullptr);
+    VkQueueFamilyProperties* families = (VkQueueFamilyProperties*)malloc(familyCount * sizeof(VkQueueFamilyProperties));
+    vkGetPhysicalDeviceQueueFamilyProperties(context->physicalDevice, &familyCount, families);
+
+    uint32_t compute = UINT32_MAX;
+    for (uint32_t i = 0; i < familyCount; i++) {
+        if ((families[i].queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+            (compute == UINT32_MAX || ((families[compute].queueFlags & VK_QUEUE_GRAPHICS_BIT) && !(families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)))) {
+            compute = i;
+        }
+    }
+    if (compute == UINT32_MAX) {
+        fprintf(stderr, "Failed to find a compute queue\n");
+        exit(1);
+    }
+
+    context->queueFamilyIndex = compute;
+    context->transferFamilyIndex = compute;
+    context->separateTransferQueue = false;
+
+    const char* setting = getenv("VKGRAD_TRANSFER_QUEUE");
+    if (setting == NULL || strcmp(setting, "0") != 0) {
+        for (uint32_t i = 0; i < familyCount; i++) {
+            VkQueueFlags flags = families[i].queueFlags;
+            if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_GRAPHICS_BIT))) {
+                context->transferFamilyIndex = i;
+                context->separateTransferQueue = true;
+                break;
+            }
+        }
+        if (!context->separateTransferQueue && families[compute].queueCount >= 2) {
+            context->separateTransferQueue = true;
+        }
+    }
 
-    VkDeviceQueueCreateInfo queueCreateInfo{};
-    queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queueCreateInfo.queueFamilyIndex = 0;  // Assuming 0 for simplicity
-    queueCreateInfo.queueCount = 1;
-    queueCreateInfo.pQueuePriorities = &queuePriority;
+    free(families);
+}
+
+// Create the device with the queues chosen by selectQueueFamilies
+VkDevice createLogicalDevice(VulkanContext* context) {
+    float queuePriorities[2] = {1.0f, 1.0f};
+
+    // Step 1: One queue of the compute family, plus the transfer queue from its
+    // own family or as a second queue of the compute family
+    VkDeviceQueueCreateInfo queueCreateInfos[2]{};
+    uint32_t queueCreateInfoCount = 1;
+    queueCreateInfos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueCreateInfos[0].queueFamilyIndex = context->queueFamilyIndex;
+    queueCreateInfos[0].queueCount = 1;
+    queueCreateInfos[0].pQueuePriorities = queuePriorities;
+    if (context->transferFamilyIndex != context->queueFamilyIndex) {
+        queueCreateInfos[1] = queueCreateInfos[0];
+        queueCreateInfos[1].queueFamilyIndex = context->transferFamilyIndex;
+        queueCreateInfoCount = 2;
+    } else if (context->separateTransferQueue) {
+        queueCreateInfos[0].queueCount = 2;
+    }
 
     VkDeviceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    createInfo.pQueueCreateInfos = &queueCreateInfo;
-    createInfo.queueCreateInfoCount = 1;
+    createInfo.pQueueCreateInfos = queueCreateInfos;
+    createInfo.queueCreateInfoCount = queueCreateInfoCount;
+
+    // Storage features for 16-bit and 8-bit tensors, found by queryStorageSupport
+    VkPhysicalDevice8BitStorageFeatures storage8{};
+    storage8.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_8BIT_STORAGE_FEATURES;
+    storage8.storageBuffer8BitAccess = VK_TRUE;
+    VkPhysicalDevice16BitStorageFeatures storage16{};
+    storage16.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES;
+    storage16.storageBuffer16BitAccess = context->storage16Bit;
+    storage16.pNext = context->storage8Bit ? &storage8 : nullptr;
+
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &storage16;
+    if (context->storage16Bit || context->storage8Bit) {
+        createInfo.pNext = &features;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+    std::vector<const char*> extensions;
+    if (context->storage8Bit && properties.apiVersion < VK_API_VERSION_1_2) {
+        extensions.push_back(VK_KHR_8BIT_STORAGE_EXTENSION_NAME);
+    }
+    if (context->hostImport) {
+        extensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+    }
+    createInfo.enabledExtensionCount = (uint32_t)extensions.size();
+    createInfo.ppEnabledExtensionNames = extensions.data();
 
     VkDevice device;
-    if (vkCreateDevice(physicalDevice, &createInfo, nullptr, &device) != VK_SUCCESS) {
+    if (vkCreateDevice(context->physicalDevice, &createInfo, nullptr, &device) != VK_SUCCESS) {
         fprintf(stderr, "Failed to create logical device\n");
         exit(1);
     }
 
-    vkGetDeviceQueue(device, 0, 0, queue);  // Get the device queue
+    // Step 2: Fetch the queues
+    vkGetDeviceQueue(device, context->queueFamilyIndex, 0, &context->queue);
+    context->transferQueue = context->queue;
+    if (context->transferFamilyIndex != context->queueFamilyIndex) {
+        vkGetDeviceQueue(device, context->transferFamilyIndex, 0, &context->transferQueue);
+    } else if (context->separateTransferQueue) {
+        vkGetDeviceQueue(device, context->queueFamilyIndex, 1, &context->transferQueue);
+    }
+
+    // Step 3: Extension entry points
+    if (context->hostImport) {
+        context->getMemoryHostPointerProperties =
+            (PFN_vkGetMemoryHostPointerPropertiesEXT)vkGetDeviceProcAddr(device, "vkGetMemoryHostPointerPropertiesEXT");
+        context->hostImport = context->getMemoryHostPointerProperties != NULL;
+    }
 
     return device;
 }
@@ -523,7 +1962,7 @@ VkCommandPool createCommandPool(VkDevice device, uint32_t queueFamilyIndex) {
     VkCommandPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     poolInfo.queueFamilyIndex = queueFamilyIndex;
-    poolInfo.flags = 0;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;  // Staging command buffers are re-recorded
 
     VkCommandPool commandPool;
     if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
@@ -2,37 +2,246 @@
 #define VULKAN_H
 
 #include "tensor.h"
+#include "descriptors.h"
+#include "buffer_cache.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Workgroup size and elements per invocation of a 1-D elementwise kernel, set
+// through specialization constants 0 and 1 when its pipeline is created
+typedef struct {
+    uint32_t workgroupSize;
+    uint32_t itemsPerThread;
+} KernelVariant;
+
+// Compiled compute shader and the layouts needed to dispatch it
+typedef struct {
+    VkShaderModule shaderModule;
+    VkDescriptorSetLayout descriptorSetLayout;
+    VkPipelineLayout pipelineLayout;
+    VkPipeline pipeline;
+    uint32_t bindingCount;
+    uint32_t pushConstantSize;
+    const char* name;  // Shader path, as keyed in the kernel cache
+    KernelVariant variant;  // {0, 0} when not specialized
+} ComputeKernel;
+
+#define STAGING_CHUNK_SIZE (4ull << 20)  // Bytes moved per staging submission
+#define STAGING_CHUNK_COUNT 4             // Chunks in flight at once
+
+#define MAX_INFLIGHT_SUBMISSIONS 256      // Submissions queued before the host waits
+#define LAZY_BATCH_SIZE 64                // Ops recorded before a lazy batch is submitted
+
+#define DEFAULT_WORKGROUP_SIZE 256        // Variant of elementwise kernels when not tuned
+#define TUNE_MIN_ELEMENTS (1u << 16)      // Smaller ops are bound by launch overhead and are not tuned
+#define TUNE_REPEATS 5                    // Timed runs per candidate variant; the fastest counts
+
+#define REDUCE_GROUP_SIZE 256             // local_size_x of reduce.comp
+#define REDUCE_ITEMS_PER_THREAD 8         // Elements each invocation folds before the workgroup combines
+
+// Persistently mapped host-visible buffer that transfers cycle through in chunks.
+// Each chunk has its own command buffer so the memcpy of one chunk overlaps the
+// GPU copy of the previous one.
+typedef struct {
+    VkBuffer buffer;
+    DeviceAllocation allocation;
+    VkCommandBuffer commandBuffers[STAGING_CHUNK_COUNT];
+    uint64_t serials[STAGING_CHUNK_COUNT];  // Submission that last used each chunk
+    uint32_t next;
+} StagingRing;
+
+// Command pool of one calling thread. A Vulkan pool must not be used by two
+// threads at once, so each thread records from its own; mutex is only contended
+// when a retiring submission hands back its command buffer.
+typedef struct {
+    std::mutex mutex;
+    VkCommandPool commandPool;
+} ThreadResources;
+
+// A command buffer on a queue and what to release once its fence signals
+typedef struct {
+    uint64_t serial;
+    VkFence fence;
+    bool transfer;                  // Submitted to the transfer queue
+    VkCommandBuffer commandBuffer;  // Freed to owner on retire
+    ThreadResources* owner;         // NULL if the command buffer is owned elsewhere
+    std::vector<VkSemaphore> semaphores;          // Waited on; reusable once it retires
+} Submission;
+
+// Ops recorded into one command buffer that has not been submitted yet.
+// It will be submitted with serial nextSerial, since any other submission
+// flushes it first.
+typedef struct {
+    VkCommandBuffer commandBuffer;  // VK_NULL_HANDLE when nothing is pending
+    uint32_t opCount;
+    std::vector<VkBuffer> writes;  // Buffers written since the last barrier
+    std::vector<VkBuffer> reads;   // Buffers read since the last barrier
+} PendingBatch;
+
+// A buffer destroyed while the GPU may still be using it
+typedef struct {
+    uint64_t serial;
+    VkBuffer buffer;
+    DeviceAllocation allocation;
+    bool cache;  // Goes back to the buffer cache rather than being destroyed
+    void* hostMemory;  // Imported into allocation and freed after it, NULL if none
+} DeferredFree;
 
 typedef struct {
     VkInstance instance;
     VkPhysicalDevice physicalDevice;
     VkDevice device;
     VkQueue queue;
-    VkCommandPool commandPool;
-    VkDescriptorPool descriptorPool;
+    uint32_t queueFamilyIndex;
+
+    // Any thread may call into the context. Recording uses per-thread command
+    // pools; mutex guards what the threads share, from submission
+    // through retirement, and is held while a thread appends to the lazy batch.
+    std::recursive_mutex mutex;
+    ThreadResources batchResources;       // Pool of the lazy batch, used under mutex
+    int fenceWaiters;                     // Threads waiting on a fence with mutex released
+    std::vector<VkFence> signaledFences;  // Retired while waited on; reset once nobody waits
+    std::mutex kernelMutex;               // Guards kernels
+    std::mutex stagingMutex;              // Held for a whole upload or download
+
+    // Staging copies go to a second queue when the device has one, so they run
+    // alongside kernels. Otherwise transferQueue is queue and these are unused.
+    VkQueue transferQueue;
+    uint32_t transferFamilyIndex;
+    bool separateTransferQueue;
+    VkCommandPool transferPool;
+    VkSemaphore transferSignal;  // Signaled by the latest transfer submission until a submission waits on it
+    VkSemaphore computeSignal;   // Signaled after the kernels the next transfer must follow
+    std::vector<VkSemaphore> freeSemaphores;
+
+    // Subgroup support, which the reduction kernels use when available
+    bool subgroupArithmetic;
+    uint32_t subgroupSize;
+
+    // Storage buffer access needed by 16-bit and 8-bit tensors
+    bool storage16Bit;
+    bool storage8Bit;
+
+    // On unified memory, tensor buffers are device-local and host-visible, and
+    // persistently mapped, so transfers are a memcpy instead of a staging copy
+    bool unifiedMemory;
+    VkMemoryPropertyFlags tensorMemoryProperties;
+
+    // With VK_EXT_external_memory_host, aligned host memory is imported as
+    // device memory: uploads from it are a single GPU copy, and on unified memory
+    // a tensor the host no longer shares keeps its memory as the buffer
+    bool hostImport;
+    VkDeviceSize hostImportAlignment;  // minImportedHostPointerAlignment
+    PFN_vkGetMemoryHostPointerPropertiesEXT getMemoryHostPointerProperties;
+
+    // Pipelines are compiled once per shader and reused for every dispatch
+    VkPipelineCache pipelineCache;
+    std::unordered_map<std::string, ComputeKernel> kernels;
+
+    // Winning variant of each tuned kernel per power-of-two size class, loaded
+    // from and appended to the tuning cache file
+    std::mutex tuneMutex;
+    bool tuningLoaded;
+    std::unordered_map<std::string, KernelVariant> tuning;
+
+    // Tensor buffers are sub-allocated from large VkDeviceMemory blocks, and
+    // kept for reuse once freed
+    DeviceAllocator allocator;
+    BufferCache bufferCache;
+
+    // Descriptor sets are written once per kernel and buffers, and reused
+    DescriptorAllocator descriptors;
+
+    // Host<->device transfers go through a fixed set of staging chunks
+    StagingRing staging;
+
+    // Every submission gets an increasing serial; a tensor is ready once the
+    // serial it was written by has retired. With two queues, completedSerial is
+    // the highest serial below which every submission on both has finished.
+    std::atomic<bool> asyncMode;
+    std::atomic<uint64_t> nextSerial;
+    std::atomic<uint64_t> completedSerial;
+    std::deque<Submission> inflight;
+    std::vector<VkFence> freeFences;
+    std::vector<DeferredFree> deferredFrees;
+
+    // In lazy mode ops are appended to one command buffer and submitted together
+    std::atomic<bool> lazyMode;
+    uint32_t lazyBatchSize;
+    PendingBatch pending;
 } VulkanContext;
 
 void add_tensor_vulkan(Tensor* tensor1, Tensor* tensor2, Tensor* result_data);
 void sub_tensor_vulkan(Tensor* tensor1, Tensor* tensor2, Tensor* result_data);
+void copy_tensor_vulkan(Tensor* src, Tensor* dst);
+void sum_to_vulkan(Tensor* src, Tensor* dst);
+void scale_tensor_vulkan(Tensor* src, Tensor* dst, float factor);
+void reduce_vulkan(ReduceOp op, Tensor* src, Tensor* dst, int rows, int length, float scale);
+void matmul_tensor_vulkan(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor, int batch, int m, int n, int k,
+                          bool trans_a, bool trans_b);
 
 // Function declarations
 VulkanContext* getVulkanContext();  // Returns a pointer to the global Vulkan context
 void cpu_to_vulkan(Tensor* tensor);
 void vulkan_to_cpu(Tensor* tensor);
-void cleanup_tensor_vulkan(Tensor* tensor, VulkanContext* context);
+void cleanup_tensor_vulkan(Tensor* tensor);
+VkDeviceSize tensorBufferSize(const Tensor* tensor);
 void compute_shader(Tensor* tensor1, Tensor* tensor2, Tensor* result_tensor, const char* shader_path);
 
 // Helper function declarations
-VkResult createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory);
-void copyBuffer(VkDevice device, VkCommandPool commandPool, VkQueue queue, VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+VkResult createBuffer(VulkanContext* context, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, DeviceAllocation& allocation);
+void destroyBuffer(VulkanContext* context, VkBuffer& buffer, DeviceAllocation& allocation, void* hostMemory = NULL);
+VkResult importHostBuffer(VulkanContext* context, void* pointer, VkDeviceSize size, VkBuffer& buffer, DeviceAllocation& allocation);
+VkResult createTensorBuffer(VulkanContext* context, VkDeviceSize size, VkBuffer& buffer, DeviceAllocation& allocation);
+void destroyTensorBuffer(VulkanContext* context, VkBuffer& buffer, DeviceAllocation& allocation);
+void emptyBufferCache(VulkanContext* context);
+void createStagingRing(VulkanContext* context);
+void uploadToBuffer(VulkanContext* context, VkBuffer dstBuffer, VkDeviceSize dstOffset, const void* src, VkDeviceSize size);
+void downloadFromBuffer(VulkanContext* context, VkBuffer srcBuffer, VkDeviceSize srcOffset, void* dst, VkDeviceSize size);
+uint64_t writeTensorBuffer(VulkanContext* context, VkBuffer buffer, const DeviceAllocation& allocation, const void* src, VkDeviceSize size);
+void readTensorBuffer(VulkanContext* context, VkBuffer buffer, const DeviceAllocation& allocation, VkDeviceSize offset, void* dst, VkDeviceSize size);
+uint64_t copyBuffer(VulkanContext* context, VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+uint64_t fillBuffer(VulkanContext* context, VkBuffer buffer, VkDeviceSize size, uint32_t pattern);
 uint32_t findMemoryType(VkPhysicalDevice physicalDevice, uint32_t typeFilter, VkMemoryPropertyFlags properties);
+uint32_t getInstanceApiVersion();
 VkInstance createInstance();
+void querySubgroupSupport(VulkanContext* context);
+void queryStorageSupport(VulkanContext* context);
+void queryUnifiedMemory(VulkanContext* context);
+void queryHostImport(VulkanContext* context);
 VkPhysicalDevice pickPhysicalDevice(VkInstance instance);
-VkDevice createLogicalDevice(VkPhysicalDevice physicalDevice, VkQueue* queue);
+void selectQueueFamilies(VulkanContext* context);
+VkDevice createLogicalDevice(VulkanContext* context);
 VkCommandPool createCommandPool(VkDevice device, uint32_t queueFamilyIndex);
-VkDescriptorPool createDescriptorPool(VkDevice device);
+ThreadResources* getThreadResources(VulkanContext* context);
 VkCommandBuffer beginSingleTimeCommands(VulkanContext* context);
-void endSingleTimeCommands(VulkanContext* context, VkCommandBuffer commandBuffer);
+uint64_t endSingleTimeCommands(VulkanContext* context, VkCommandBuffer commandBuffer);
+VkCommandBuffer beginBatchedCommands(VulkanContext* context, const VkBuffer* reads, int readCount, VkBuffer write);
+uint64_t endBatchedCommands(VulkanContext* context, VkCommandBuffer commandBuffer);
+void flushPendingCommands(VulkanContext* context);
+uint64_t latestSerial(VulkanContext* context);
+void recordGlobalBarrier(VkCommandBuffer commandBuffer, bool transferOnly = false);
+uint64_t submitCommandBuffer(VulkanContext* context, VkCommandBuffer commandBuffer, ThreadResources* owner, bool transfer = false);
+void retireSubmissions(VulkanContext* context);
+void waitForSerial(VulkanContext* context, uint64_t serial);
+void waitForIdle(VulkanContext* context);
 VkShaderModule loadShaderModule(VkDevice device, const char* filePath);
+ComputeKernel* getComputeKernel(VulkanContext* context, const char* shader_path, uint32_t bindingCount, uint32_t pushConstantSize = 0,
+                                const KernelVariant* variant = NULL);
+ComputeKernel* getTunedKernel(VulkanContext* context, const char* shader_path, uint32_t bindingCount, uint32_t pushConstantSize,
+                              const VkBuffer* buffers, const void* pushConstants, uint32_t count, VkDeviceSize outputBytes);
+uint32_t variantGroupCount(const ComputeKernel* kernel, uint32_t count);
+const char* getTuningCachePath();
+uint64_t dispatchKernel(VulkanContext* context, ComputeKernel* kernel, const VkBuffer* buffers, uint32_t bufferCount,
+                        const void* pushConstants, uint32_t groupCountX, uint32_t groupCountY = 1, uint32_t groupCountZ = 1,
+                        VkDeviceSize bytes = 0);
+void destroyComputeKernels(VulkanContext* context);
+const char* getPipelineCachePath();
+VkPipelineCache createPipelineCache(VkDevice device, const char* cachePath);
+void savePipelineCache(VulkanContext* context);
 
 #endif /* VULKAN_H */
\ No newline at end of file
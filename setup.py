@@ -1,45 +1,92 @@
-from setuptools import setup, find_packages, Extension
+from setuptools import setup, find_packages, Extension, Command
 from setuptools.command.build_ext import build_ext
 import subprocess
 from pathlib import Path
 
+# Extra builds of a shader with different defines, as name -> (source, flags).
+# The runtime picks a variant based on what the device supports.
+SHADER_VARIANTS = {
+    "reduce_subgroup": ("reduce.comp", ["--target-env", "vulkan1.1", "-DUSE_SUBGROUP"]),
+    "reduce_i32": ("reduce.comp", ["--target-env", "vulkan1.1", "-DINT32"]),
+    "reduce_subgroup_i32": ("reduce.comp", ["--target-env", "vulkan1.1", "-DUSE_SUBGROUP", "-DINT32"]),
+    "copy_tensor_16": ("copy_tensor.comp", ["--target-env", "vulkan1.1", "-DELEMENT_BITS=16"]),
+    "copy_tensor_8": ("copy_tensor.comp", ["--target-env", "vulkan1.1", "-DELEMENT_BITS=8"]),
+}
+
+# Storage dtypes as suffix -> DType value in tensor.h. Elementwise ops get a
+# variant per 16-bit float type and copies convert between every pair.
+DTYPES = {"f32": 0, "f16": 1, "bf16": 2, "i32": 3, "i8": 4}
+for op in ("add_tensor", "sub_tensor"):
+    for suffix in ("f16", "bf16"):
+        SHADER_VARIANTS[f"{op}_{suffix}"] = (f"{op}.comp", ["--target-env", "vulkan1.1", f"-DDTYPE={DTYPES[suffix]}"])
+for src_suffix, src_dtype in DTYPES.items():
+    for dst_suffix, dst_dtype in DTYPES.items():
+        if src_suffix != dst_suffix:
+            SHADER_VARIANTS[f"convert_{src_suffix}_{dst_suffix}"] = (
+                "copy_tensor.comp",
+                ["--target-env", "vulkan1.1", "-DCONVERT", f"-DSRC_DTYPE={src_dtype}", f"-DDST_DTYPE={dst_dtype}"],
+            )
+
+SOURCES = ["cpp/tensor.cpp", "cpp/vulkan.cpp", "cpp/cpu.cpp", "cpp/allocator.cpp", "cpp/buffer_cache.cpp", "cpp/descriptors.cpp", "cpp/fusion.cpp", "cpp/autograd.cpp", "cpp/threadpool.cpp", "cpp/profiler.cpp", "cpp/tensor_file.cpp"]
+
 class CustomBuildExt(build_ext):
     def run(self):
         # Run the original build_ext command to compile the C++ extension
         super().run()
 
         # Shader compilation
-        shader_out = []
         shader_src = list(Path("cpp").glob("*.comp"))
-        for path in shader_src:
-            shader_out.append(path.with_suffix(".spv"))
-        
-        for src, out in zip(shader_src, shader_out):
-            if not out.exists() or src.stat().st_mtime > out.stat().st_mtime:
+        shader_jobs = [(src, src.with_suffix(".spv"), []) for src in shader_src]
+        for name, (src, flags) in SHADER_VARIANTS.items():
+            shader_jobs.append((Path("cpp") / src, Path("cpp") / f"{name}.spv", flags))
+
+        # Every shader may include the shared storage type definitions
+        include_mtime = Path("cpp/storage.glsl").stat().st_mtime
+        for src, out, flags in shader_jobs:
+            if not out.exists() or max(src.stat().st_mtime, include_mtime) > out.stat().st_mtime:
                 print(f"Compiling {src} to {out}")
                 try:
                     # Run the glslangValidator command to compile the .comp file to .spv
                     subprocess.check_call([
-                        'glslangValidator', '-V', str(src), '-o', str(out)
+                        'glslangValidator', '-V', *flags, str(src), '-o', str(out)
                     ])
                 except subprocess.CalledProcessError as e:
                     print(f"Shader compilation failed: {e}")
                     raise
 
 
+class BuildBench(Command):
+    """Build bench/bench_suite against the same sources, after the shaders it dispatches."""
+    description = "build the C++ benchmark suite"
+    user_options = []
+
+    def initialize_options(self):
+        pass
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        self.run_command("build_ext")
+        subprocess.check_call([
+            "g++", "-O2", "-std=c++17", "-o", "bench/bench_suite", "bench/bench_suite.cpp", *SOURCES, "-lvulkan", "-pthread"
+        ])
+
+
 setup(
     name="vkgrad",
     packages=find_packages(),
     ext_modules=[
         Extension(
             name="vkgrad",
-            sources=["cpp/tensor.cpp", "cpp/vulkan.cpp", "cpp/cpu.cpp"],
+            sources=SOURCES,
             language="c++",
             extra_compile_args=["-g", "-std=c++17"],
-            extra_link_args=["-lvulkan"],
+            extra_link_args=["-lvulkan", "-pthread"],
         ),
     ],
     cmdclass={
         'build_ext': CustomBuildExt,  # Override build_ext with custom class
+        'build_bench': BuildBench,
     },
 )
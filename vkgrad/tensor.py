@@ -1,3 +1,4 @@
+import array
 import ctypes
 import os
 from pathlib import Path
@@ -5,46 +6,303 @@ from pathlib import Path
 
 class CTensor(ctypes.Structure):
     _fields_ = [
-        ('data', ctypes.POINTER(ctypes.c_float)),
+        ('data', ctypes.c_void_p),
         ('strides', ctypes.POINTER(ctypes.c_int)),
         ('shape', ctypes.POINTER(ctypes.c_int)),
         ('ndim', ctypes.c_int),
         ('size', ctypes.c_int),
+        ('offset', ctypes.c_int),
+        ('dtype', ctypes.c_int),
     ]
 
-class Tensor:
-    root_dir = Path(__file__).parent.parent
-    so_file_path = next(root_dir.glob('vkgrad*.so'), None)
+# Storage dtypes, as DType in tensor.h
+DTYPES = {"float32": 0, "float16": 1, "bfloat16": 2, "int32": 3, "int8": 4}
+DTYPE_SIZES = {"float32": 4, "float16": 2, "bfloat16": 2, "int32": 4, "int8": 1}
+
+# Element formats of the buffer protocol (struct module codes) and of the NumPy
+# array interface, per dtype. NumPy has no bfloat16.
+BUFFER_FORMATS = {"float32": "f", "float16": "e", "int32": "i", "int8": "b"}
+TYPESTRS = {"float32": "<f4", "float16": "<f2", "int32": "<i4", "int8": "|i1"}
+
+# DLPack type codes and devices (dlpack.h)
+DLPACK_DTYPES = {"float32": (2, 32), "float16": (2, 16), "bfloat16": (4, 16), "int32": (0, 32), "int8": (0, 8)}
+DLPACK_CPU = 1
+
+
+class DLDevice(ctypes.Structure):
+    _fields_ = [('device_type', ctypes.c_int), ('device_id', ctypes.c_int)]
+
+
+class DLDataType(ctypes.Structure):
+    _fields_ = [('code', ctypes.c_uint8), ('bits', ctypes.c_uint8), ('lanes', ctypes.c_uint16)]
+
+
+class DLTensor(ctypes.Structure):
+    _fields_ = [
+        ('data', ctypes.c_void_p),
+        ('device', DLDevice),
+        ('ndim', ctypes.c_int),
+        ('dtype', DLDataType),
+        ('shape', ctypes.POINTER(ctypes.c_int64)),
+        ('strides', ctypes.POINTER(ctypes.c_int64)),
+        ('byte_offset', ctypes.c_uint64),
+    ]
+
+
+class DLManagedTensor(ctypes.Structure):
+    pass
+
+
+DLManagedTensor._fields_ = [
+    ('dl_tensor', DLTensor),
+    ('manager_ctx', ctypes.c_void_p),
+    ('deleter', ctypes.CFUNCTYPE(None, ctypes.POINTER(DLManagedTensor))),
+]
+
+root_dir = Path(__file__).parent.parent
+so_file_path = next(root_dir.glob('vkgrad*.so'), None)
+
+if so_file_path is None:
+    raise FileNotFoundError("Shared object file not found.")
+
+_C = ctypes.CDLL(so_file_path)
+
+_TENSOR = ctypes.POINTER(CTensor)
+_INTS = ctypes.POINTER(ctypes.c_int)
+_INT = ctypes.c_int
+_HANDLE = ctypes.c_void_p
+
+# C API prototypes as name -> (argtypes, restype), bound once at import
+_PROTOTYPES = {
+    "create_tensor": ([ctypes.c_void_p, _INTS, _INT, ctypes.c_char_p], _TENSOR),
+    "wrap_tensor": ([ctypes.c_void_p, _INTS, _INTS, _INT, _INT], _TENSOR),
+    "free_tensor": ([_TENSOR], None),
+    "retain_tensor": ([_TENSOR], None),
+    "share_storage": ([_TENSOR], _TENSOR),
+    "get_item": ([_TENSOR, _INTS], ctypes.c_float),
+    "to_device": ([_TENSOR, ctypes.c_char_p], None),
+    "to_dtype": ([_TENSOR, _INT], _TENSOR),
+    "add_tensor": ([_TENSOR, _TENSOR], _TENSOR),
+    "sub_tensor": ([_TENSOR, _TENSOR], _TENSOR),
+    "add_": ([_TENSOR, _TENSOR], None),
+    "sub_": ([_TENSOR, _TENSOR], None),
+    "add_out": ([_TENSOR, _TENSOR, _TENSOR], None),
+    "sub_out": ([_TENSOR, _TENSOR, _TENSOR], None),
+    "matmul": ([_TENSOR, _TENSOR], _TENSOR),
+    "bmm": ([_TENSOR, _TENSOR], _TENSOR),
+    "sum_tensor": ([_TENSOR, _INTS, _INT, _INT], _TENSOR),
+    "mean_tensor": ([_TENSOR, _INTS, _INT, _INT], _TENSOR),
+    "max_tensor": ([_TENSOR, _INTS, _INT, _INT], _TENSOR),
+    "argmax_tensor": ([_TENSOR, _INT, _INT], _TENSOR),
+    "slice": ([_TENSOR, _INT, _INT, _INT, _INT], _TENSOR),
+    "transpose": ([_TENSOR, _INT, _INT], _TENSOR),
+    "permute": ([_TENSOR, _INTS], _TENSOR),
+    "reshape": ([_TENSOR, _INTS, _INT], _TENSOR),
+    "expand": ([_TENSOR, _INTS, _INT], _TENSOR),
+    "contiguous": ([_TENSOR], _TENSOR),
+    "is_contiguous": ([_TENSOR], _INT),
+    "fused_input": ([_TENSOR], _HANDLE),
+    "fused_add": ([_HANDLE, _HANDLE], _HANDLE),
+    "fused_sub": ([_HANDLE, _HANDLE], _HANDLE),
+    "fused_eval": ([_HANDLE], _TENSOR),
+    "fused_free": ([_HANDLE], None),
+    "set_requires_grad": ([_TENSOR, _INT], None),
+    "backward": ([_TENSOR], None),
+    "get_grad": ([_TENSOR], _TENSOR),
+    "zero_grad": ([_TENSOR], None),
+    "tensor_ready": ([_TENSOR], _INT),
+    "set_async": ([_INT], None),
+    "set_lazy": ([_INT], None),
+    "set_grad_enabled": ([_INT], None),
+    "synchronize": ([], None),
+    "empty_cache": ([], None),
+    "profiler_enable": ([_INT], None),
+    "profiler_reset": ([], None),
+    "profiler_export_trace": ([ctypes.c_char_p], None),
+    "profiler_print_summary": ([ctypes.c_char_p], None),
+    "save_tensors": ([ctypes.c_char_p, ctypes.POINTER(_TENSOR), ctypes.POINTER(ctypes.c_char_p), _INT], _INT),
+    "open_tensor_file": ([ctypes.c_char_p], _HANDLE),
+    "tensor_file_count": ([_HANDLE], _INT),
+    "tensor_file_name": ([_HANDLE, _INT], ctypes.c_char_p),
+    "load_tensor": ([_HANDLE, _INT, ctypes.c_char_p], _TENSOR),
+    "close_tensor_file": ([_HANDLE], None),
+}
+
+for name, (argtypes, restype) in _PROTOTYPES.items():
+    fn = getattr(_C, name)
+    fn.argtypes = argtypes
+    fn.restype = restype
+
+_CAPSULE_DESTRUCTOR = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+_PyCapsule_New = ctypes.pythonapi.PyCapsule_New
+_PyCapsule_New.argtypes = [ctypes.c_void_p, ctypes.c_char_p, _CAPSULE_DESTRUCTOR]
+_PyCapsule_New.restype = ctypes.py_object
+_PyCapsule_IsValid = ctypes.pythonapi.PyCapsule_IsValid
+_PyCapsule_IsValid.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+_PyCapsule_IsValid.restype = ctypes.c_int
+_PyCapsule_GetPointer = ctypes.pythonapi.PyCapsule_GetPointer
+_PyCapsule_GetPointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+_PyCapsule_GetPointer.restype = ctypes.c_void_p
+_PyCapsule_GetPointer_raw = ctypes.CFUNCTYPE(ctypes.c_void_p, ctypes.c_void_p, ctypes.c_char_p)(
+    ('PyCapsule_GetPointer', ctypes.pythonapi))
+_PyCapsule_SetName = ctypes.pythonapi.PyCapsule_SetName
+_PyCapsule_SetName.argtypes = [ctypes.py_object, ctypes.c_char_p]
+_PyCapsule_SetName.restype = ctypes.c_int
+
+# Tensors exported through DLPack, kept alive until the consumer calls the deleter
+_dlpack_exports = {}
+
+
+@ctypes.CFUNCTYPE(None, ctypes.POINTER(DLManagedTensor))
+def _dlpack_deleter(managed):
+    _dlpack_exports.pop(ctypes.addressof(managed.contents), None)
+
+
+@_CAPSULE_DESTRUCTOR
+def _dlpack_capsule_destructor(capsule):
+    # A capsule that was never consumed still owns its tensor
+    if _PyCapsule_IsValid(capsule, b"dltensor"):
+        managed = ctypes.cast(_PyCapsule_GetPointer_raw(capsule, b"dltensor"), ctypes.POINTER(DLManagedTensor))
+        managed.contents.deleter(managed)
+
+
+class _DLPackOwner:
+    """Holds an imported DLPack tensor and returns it to its producer when released."""
+
+    def __init__(self, managed):
+        self.managed = managed
+
+    def __del__(self):
+        if self.managed.contents.deleter:
+            self.managed.contents.deleter(self.managed)
+
+
+class _Export:
+    """Reference to a CPU tensor's storage held by memory handed out by an
+    exporter, which stays valid even if the tensor moves to another device.
+    Memory the tensor borrows is kept alive through the wrapper."""
+
+    def __init__(self, source):
+        self.source = source
+        self.tensor = Tensor._C.share_storage(source.tensor)
+
+    def __del__(self):
+        Tensor._C.free_tensor(self.tensor)
 
-    if so_file_path is None:
-        raise FileNotFoundError("Shared object file not found.")
-    
-    _C = ctypes.CDLL(so_file_path)
 
-    def __init__(self, data=None, device="cpu"):
+class Tensor:
+    _C = _C
+
+    def __init__(self, data=None, device="cpu", requires_grad=False, dtype=None):
         if data is None:
             self.tensor = None,
             self.shape = None,
             self.ndim = None,
             self.device = None
         else:
+            # NumPy arrays, DLPack producers and buffer-protocol objects are wrapped
+            # without copying and keep their dtype unless another is given; the
+            # tensor keeps them alive. Python lists are packed into a float32 buffer.
             if isinstance(data, (float, int)):
                 data = [data]
-
-            data, shape = self.flatten(data)
-            self.data_ctype = (ctypes.c_float * len(data))(*data)
-            self.shape_ctype = (ctypes.c_int * len(shape))(*shape)
-            self.ndim_ctype = ctypes.c_int(len(shape))
-            self.device_ctype = device.encode("utf-8")
-
-            self.shape = shape
-            self.ndim = len(shape)
-            self.device = device
-
-            Tensor._C.create_tensor.argtypes = [ctypes.POINTER(ctypes.c_float), ctypes.POINTER(ctypes.c_int), ctypes.c_int, ctypes.c_char_p]
-            Tensor._C.create_tensor.restype = ctypes.POINTER(CTensor)
-
-            self.tensor = Tensor._C.create_tensor(self.data_ctype, self.shape_ctype, self.ndim_ctype, self.device_ctype)
+            if isinstance(data, list):
+                flat, shape = self.flatten(data)
+                data = memoryview(array.array("f", flat)).cast("B").cast("f", shape) if shape else array.array("f", flat)
+
+            if hasattr(data, "__array_interface__"):
+                self._wrap_array_interface(data)
+            elif hasattr(data, "__dlpack__"):
+                self._wrap_dlpack(data)
+            else:
+                self._wrap_buffer(data)
+
+            if dtype is not None and dtype != self.dtype:
+                converted = self._to_dtype(dtype)
+                Tensor._C.free_tensor(self.tensor)
+                self.tensor, converted.tensor = converted.tensor, None
+            if device != "cpu":
+                self.to(device)
+
+            if requires_grad:
+                self.requires_grad_(True)
+
+    def __del__(self):
+        # Each wrapper holds one reference to its C tensor. Storage shared with
+        # views and tensors that autograd still reads outlive it.
+        if isinstance(getattr(self, "tensor", None), _TENSOR):
+            Tensor._C.free_tensor(self.tensor)
+
+    def _wrap(self, address, shape, strides, dtype, owner):
+        if any(stride < 0 for stride in strides):
+            raise ValueError("Negative strides are not supported")
+
+        self.shape = list(shape)
+        self.ndim = len(shape)
+        self.device = "cpu"
+        self.owner = owner
+        self.tensor = Tensor._C.wrap_tensor(address, (ctypes.c_int * max(self.ndim, 1))(*shape),
+                                            (ctypes.c_int * max(self.ndim, 1))(*strides), self.ndim, DTYPES[dtype])
+
+    def _wrap_array_interface(self, data):
+        interface = data.__array_interface__
+        dtype = next((name for name, typestr in TYPESTRS.items() if typestr == interface["typestr"]), None)
+        if dtype is None:
+            # Other NumPy dtypes (e.g. float64) are converted to float32
+            import numpy
+            data = numpy.asarray(data, dtype=numpy.float32)
+            interface = data.__array_interface__
+            dtype = "float32"
+
+        shape = interface["shape"]
+        itemsize = DTYPE_SIZES[dtype]
+        strides = interface.get("strides")
+        if strides is None:
+            strides = [1] * len(shape)
+            for i in range(len(shape) - 2, -1, -1):
+                strides[i] = strides[i + 1] * shape[i + 1]
+        else:
+            if any(stride % itemsize for stride in strides):
+                raise ValueError("Strides must be whole elements")
+            strides = [stride // itemsize for stride in strides]
+        self._wrap(interface["data"][0], shape, strides, dtype, data)
+
+    def _wrap_dlpack(self, data):
+        capsule = data.__dlpack__()
+        managed = ctypes.cast(_PyCapsule_GetPointer(capsule, b"dltensor"), ctypes.POINTER(DLManagedTensor))
+        dl = managed.contents.dl_tensor
+        if dl.device.device_type != DLPACK_CPU:
+            raise BufferError("Only CPU DLPack tensors can be imported")
+        dtype = next((name for name, code in DLPACK_DTYPES.items() if code == (dl.dtype.code, dl.dtype.bits)), None)
+        if dtype is None or dl.dtype.lanes != 1:
+            raise TypeError(f"Unsupported DLPack dtype code {dl.dtype.code} with {dl.dtype.bits} bits")
+
+        shape = [dl.shape[i] for i in range(dl.ndim)]
+        if dl.strides:
+            strides = [dl.strides[i] for i in range(dl.ndim)]
+        else:
+            strides = [1] * dl.ndim
+            for i in range(dl.ndim - 2, -1, -1):
+                strides[i] = strides[i + 1] * shape[i + 1]
+
+        # The capsule is consumed; the producer's deleter runs when this tensor goes away
+        _PyCapsule_SetName(capsule, b"used_dltensor")
+        self._wrap((dl.data or 0) + dl.byte_offset, shape, strides, dtype, _DLPackOwner(managed))
+
+    def _wrap_buffer(self, data):
+        view = memoryview(data)
+        fmt = view.format.lstrip("@=<")
+        dtype = next((name for name, code in BUFFER_FORMATS.items() if code == fmt and view.itemsize == DTYPE_SIZES[name]), None)
+        if dtype is None:
+            raise TypeError(f"Unsupported buffer format {view.format!r}")
+
+        # ctypes can only take the address of a writable contiguous buffer, so other
+        # buffers are copied
+        if view.readonly or not view.c_contiguous:
+            view = memoryview(bytearray(view.tobytes())).cast(fmt, view.shape)
+        address = ctypes.addressof(ctypes.c_char.from_buffer(view))
+
+        strides = [stride // view.itemsize for stride in view.strides]
+        self._wrap(address, view.shape, strides, dtype, view)
 
     def flatten(self, nested_list):
         def recursive_flatten(nested_list):
@@ -64,45 +322,242 @@ class Tensor:
         return flat_data, shape
 
     def __getitem__(self, indices):
+        if not isinstance(indices, tuple):
+            indices = (indices,)
+
+        # Slices give a view; integer indices read one element
+        if any(isinstance(index, slice) for index in indices):
+            result = self
+            for dim, index in enumerate(indices):
+                if isinstance(index, int):
+                    index = slice(index, index + 1 if index != -1 else None)
+                start, stop, step = index.start, index.stop, index.step
+                start = 0 if start is None else start
+                stop = result.shape[dim] if stop is None else stop
+                step = 1 if step is None else step
+                result = result._view("slice", dim, start, stop, step)
+            return result
+
         if len(indices) != self.ndim:
             raise ValueError("Number of indices must match the number of dimensions")
 
-        Tensor._C.get_item.argtypes = [ctypes.POINTER(CTensor), ctypes.POINTER(ctypes.c_int)]
-        Tensor._C.get_item.restype = ctypes.c_float
-
         indices = (ctypes.c_int * len(indices))(*indices)
         value = Tensor._C.get_item(self.tensor, indices)
         return value
 
 
+    def _binary(self, other, name):
+        fn = getattr(Tensor._C, name)
+
+        # The result has the broadcast shape of both operands
+        result_data = Tensor()
+        result_data.tensor = fn(self.tensor, other.tensor)
+        contents = result_data.tensor.contents
+        result_data.shape = [contents.shape[i] for i in range(contents.ndim)]
+        result_data.ndim = contents.ndim
+        result_data.device = self.device
+
+        return result_data
+
     def __add__(self, other):
-        if self.shape != other.shape:
-            raise ValueError("Tensors must have the same shape for addition")
+        return self._binary(other, "add_tensor")
+
+    def __sub__(self, other):
+        return self._binary(other, "sub_tensor")
+
+    def add(self, other, out=None):
+        if out is None:
+            return self + other
+        Tensor._C.add_out(self.tensor, other.tensor, out.tensor)
+        return out
+
+    def sub(self, other, out=None):
+        if out is None:
+            return self - other
+        Tensor._C.sub_out(self.tensor, other.tensor, out.tensor)
+        return out
+
+    # In place, into this tensor's memory; other broadcasts to this tensor's shape
+    def add_(self, other):
+        Tensor._C.add_(self.tensor, other.tensor)
+        return self
+
+    def sub_(self, other):
+        Tensor._C.sub_(self.tensor, other.tensor)
+        return self
+
+    __iadd__ = add_
+    __isub__ = sub_
 
-        Tensor._C.add_tensor.argtypes = [ctypes.POINTER(CTensor), ctypes.POINTER(CTensor)]
-        Tensor._C.add_tensor.restype = ctypes.POINTER(CTensor)
+    def __matmul__(self, other):
+        if self.ndim not in (2, 3) or other.ndim != self.ndim:
+            raise ValueError("matmul expects two 2-D or two 3-D tensors")
+        if self.shape[-1] != other.shape[-2]:
+            raise ValueError("Inner dimensions must match for matmul")
 
-        result_tensor_ptr = Tensor._C.add_tensor(self.tensor, other.tensor)
+        # 3-D tensors are batches of matrices
+        fn = Tensor._C.matmul if self.ndim == 2 else Tensor._C.bmm
 
         result_data = Tensor()
-        result_data.tensor = result_tensor_ptr
-        result_data.shape = self.shape.copy()
+        result_data.tensor = fn(self.tensor, other.tensor)
+        result_data.shape = self.shape[:-1] + [other.shape[-1]]
         result_data.ndim = self.ndim
         result_data.device = self.device
 
         return result_data
 
-    def __sub__(self, other):
-        if self.shape != other.shape:
-            raise ValueError("Tensors must have the same shape for addition") 
+    def _reduce(self, name, dims, keepdim):
+        fn = getattr(Tensor._C, name)
+
+        # No dims reduces over every dimension
+        if dims is None:
+            dims = ()
+        elif isinstance(dims, int):
+            dims = (dims,)
+
+        result_data = Tensor()
+        result_data.tensor = fn(self.tensor, (ctypes.c_int * max(len(dims), 1))(*dims), len(dims), int(keepdim))
+        contents = result_data.tensor.contents
+        result_data.shape = [contents.shape[i] for i in range(contents.ndim)]
+        result_data.ndim = contents.ndim
+        result_data.device = self.device
+
+        return result_data
+
+    def sum(self, dim=None, keepdim=False):
+        return self._reduce("sum_tensor", dim, keepdim)
+
+    def mean(self, dim=None, keepdim=False):
+        return self._reduce("mean_tensor", dim, keepdim)
+
+    def max(self, dim=None, keepdim=False):
+        return self._reduce("max_tensor", dim, keepdim)
+
+    def argmax(self, dim=None, keepdim=False):
+        # Without a dim the index is into the flattened tensor
+        if dim is None:
+            return self.reshape(-1).argmax(0, keepdim)
 
-        Tensor._C.sub_tensor.argtypes = [ctypes.POINTER(CTensor), ctypes.POINTER(CTensor)]
-        Tensor._C.sub_tensor.restype = ctypes.POINTER(CTensor)
+        result_data = Tensor()
+        result_data.tensor = Tensor._C.argmax_tensor(self.tensor, dim, int(keepdim))
+        contents = result_data.tensor.contents
+        result_data.shape = [contents.shape[i] for i in range(contents.ndim)]
+        result_data.ndim = contents.ndim
+        result_data.device = self.device
+
+        return result_data
 
-        result_tensor_ptr = Tensor._C.sub_tensor(self.tensor, other.tensor)
+    def _view(self, name, *args):
+        fn = getattr(Tensor._C, name)
 
         result_data = Tensor()
-        result_data.tensor = result_tensor_ptr
+        result_data.tensor = fn(self.tensor, *args)
+        contents = result_data.tensor.contents
+        result_data.shape = [contents.shape[i] for i in range(contents.ndim)]
+        result_data.ndim = contents.ndim
+        result_data.device = self.device
+        result_data.source = self  # Keeps wrapped host memory alive; device storage is refcounted
+
+        return result_data
+
+    def transpose(self, dim0, dim1):
+        return self._view("transpose", dim0, dim1)
+
+    def permute(self, *dims):
+        return self._view("permute", (ctypes.c_int * len(dims))(*dims))
+
+    def reshape(self, *shape):
+        return self._view("reshape", (ctypes.c_int * len(shape))(*shape), len(shape))
+
+    def expand(self, *shape):
+        return self._view("expand", (ctypes.c_int * len(shape))(*shape), len(shape))
+
+    def contiguous(self):
+        return self._view("contiguous")
+
+    def is_contiguous(self):
+        return bool(Tensor._C.is_contiguous(self.tensor))
+
+    @property
+    def T(self):
+        return self.transpose(-2, -1)
+
+    @property
+    def dtype(self):
+        return next(name for name, value in DTYPES.items() if value == self.tensor.contents.dtype)
+
+    @property
+    def data_ptr(self):
+        """Address of the first element of a CPU tensor."""
+        if self.device != "cpu":
+            raise BufferError("Only CPU tensors expose their data; move the tensor with to('cpu') first")
+        contents = self.tensor.contents
+        return (contents.data or 0) + contents.offset * DTYPE_SIZES[self.dtype]
+
+    @property
+    def strides(self):
+        """Element strides, which are 0 along expanded dimensions."""
+        contents = self.tensor.contents
+        return [contents.strides[i] for i in range(contents.ndim)]
+
+    # Exporters. Each one holds its own reference to the tensor's storage, so the
+    # memory stays valid as long as the exported object does.
+
+    def _exported_memory(self, nbytes):
+        memory = (ctypes.c_char * nbytes).from_address(self.data_ptr)
+        memory.owner = _Export(self)
+        return memory
+
+    @property
+    def __array_interface__(self):
+        if self.dtype not in TYPESTRS:
+            raise TypeError(f"NumPy has no {self.dtype} type; convert with to('float32') first")
+        itemsize = DTYPE_SIZES[self.dtype]
+        # Given a buffer rather than an address, NumPy keeps the buffer as the
+        # array's base, and with it the storage
+        extent = 0 if 0 in self.shape else 1 + sum((n - 1) * s for n, s in zip(self.shape, self.strides))
+        return {
+            "version": 3,
+            "shape": tuple(self.shape),
+            "typestr": TYPESTRS[self.dtype],
+            "data": memoryview(self._exported_memory(extent * itemsize)),
+            "strides": tuple(stride * itemsize for stride in self.strides),
+        }
+
+    def __buffer__(self, flags):
+        # Python 3.12+; memoryviews describe only C-contiguous layouts here
+        if self.dtype not in BUFFER_FORMATS or not self.is_contiguous():
+            raise BufferError("Only contiguous float32, float16, int32 and int8 tensors export a buffer")
+        nbytes = self.tensor.contents.size * DTYPE_SIZES[self.dtype]
+        return memoryview(self._exported_memory(nbytes)).cast("B").cast(BUFFER_FORMATS[self.dtype], self.shape)
+
+    def __dlpack_device__(self):
+        return (DLPACK_CPU, 0)
+
+    def __dlpack__(self, stream=None):
+        if self.device != "cpu":
+            raise BufferError("Only CPU tensors can be exported through DLPack")
+
+        managed = DLManagedTensor()
+        shape = (ctypes.c_int64 * max(self.ndim, 1))(*self.shape)
+        strides = (ctypes.c_int64 * max(self.ndim, 1))(*self.strides)
+        dl = managed.dl_tensor
+        dl.data = self.data_ptr
+        dl.device = DLDevice(DLPACK_CPU, 0)
+        dl.ndim = self.ndim
+        dl.dtype = DLDataType(*DLPACK_DTYPES[self.dtype], 1)
+        dl.shape = shape
+        dl.strides = strides
+        dl.byte_offset = 0
+        managed.deleter = _dlpack_deleter
+
+        # Everything the consumer reads stays referenced until it calls the deleter
+        _dlpack_exports[ctypes.addressof(managed)] = (managed, shape, strides, _Export(self))
+        return _PyCapsule_New(ctypes.addressof(managed), b"dltensor", _dlpack_capsule_destructor)
+
+    def _to_dtype(self, dtype):
+        result_data = Tensor()
+        result_data.tensor = Tensor._C.to_dtype(self.tensor, DTYPES[dtype])
         result_data.shape = self.shape.copy()
         result_data.ndim = self.ndim
         result_data.device = self.device
@@ -110,38 +565,164 @@ class Tensor:
         return result_data
 
     def to(self, device):
+        # A dtype name returns a converted copy; a device moves this tensor
+        if device in DTYPES:
+            return self._to_dtype(device)
+
         self.device = device
         self.device_ctype = self.device.encode("utf-8")
 
-        Tensor._C.to_device.argtypes = [ctypes.POINTER(CTensor), ctypes.c_char_p]
-        Tensor._C.to_device.restype = None
         Tensor._C.to_device(self.tensor, self.device_ctype)
     
         return self
 
-        
-tensor1 = Tensor([[1, 2, 3], [3, 2, 1]])
-tensor2 = Tensor([[3, 2, 1], [1, 2, 3]])
-tensor3 = tensor1 + tensor2
-print("hi", tensor1 - tensor2)
+    def expr(self):
+        """Start a fused elementwise expression from this tensor."""
+        return Expr(Tensor._C.fused_input(self.tensor), self)
+
+    def requires_grad_(self, requires_grad=True):
+        Tensor._C.set_requires_grad(self.tensor, int(requires_grad))
+
+        return self
+
+    def backward(self):
+        Tensor._C.backward(self.tensor)
+
+    @property
+    def grad(self):
+        grad_ptr = Tensor._C.get_grad(self.tensor)
+        if not grad_ptr:
+            return None
+
+        # The gradient stays valid after zero_grad drops the tensor's reference to it
+        Tensor._C.retain_tensor(grad_ptr)
+        result_data = Tensor()
+        result_data.tensor = grad_ptr
+        result_data.shape = self.shape.copy()
+        result_data.ndim = self.ndim
+        result_data.device = self.device
+
+        return result_data
+
+    def zero_grad(self):
+        Tensor._C.zero_grad(self.tensor)
+
+    def is_ready(self):
+        return bool(Tensor._C.tensor_ready(self.tensor))
+
+
+class Expr:
+    """Elementwise expression recorded as a DAG and evaluated by one fused kernel."""
+
+    def __init__(self, handle, like):
+        self.handle = handle
+        self.like = like  # Input that supplies the result's shape and device; also keeps it alive
+
+    def _binary(self, other, name):
+        if isinstance(other, Tensor):
+            other = other.expr()
+
+        fn = getattr(Tensor._C, name)
+
+        result = Expr(fn(self.handle, other.handle), self.like)
+        result.operands = (self, other)
+        return result
+
+    def __add__(self, other):
+        return self._binary(other, "fused_add")
+
+    def __sub__(self, other):
+        return self._binary(other, "fused_sub")
+
+    def eval(self):
+        result_data = Tensor()
+        result_data.tensor = Tensor._C.fused_eval(self.handle)
+        result_data.shape = self.like.shape.copy()
+        result_data.ndim = self.like.ndim
+        result_data.device = self.like.device
+
+        return result_data
+
+    def __del__(self):
+        Tensor._C.fused_free(self.handle)
+
+
+def from_dlpack(data):
+    """Wrap any object implementing __dlpack__ without copying."""
+    result_data = Tensor()
+    result_data._wrap_dlpack(data)
+    return result_data
+
+
+def save(path, tensors):
+    """Write a dict of name -> Tensor to a tensor file."""
+    names = list(tensors)
+    handles = (_TENSOR * max(len(names), 1))(*[tensors[name].tensor for name in names])
+    encoded = (ctypes.c_char_p * max(len(names), 1))(*[name.encode("utf-8") for name in names])
+    if Tensor._C.save_tensors(os.fsencode(path), handles, encoded, len(names)) != 0:
+        raise OSError(f"Failed to save tensors to {path}")
+
+
+def load(path, device="cpu"):
+    """Read a tensor file into a dict of name -> Tensor, in file order. CPU
+    tensors read the memory-mapped file in place, so nothing is copied until a
+    page is touched; Vulkan tensors are streamed into device buffers."""
+    handle = Tensor._C.open_tensor_file(os.fsencode(path))
+    if not handle:
+        raise OSError(f"Failed to load tensors from {path}")
+
+    try:
+        tensors = {}
+        for index in range(Tensor._C.tensor_file_count(handle)):
+            result_data = Tensor()
+            result_data.tensor = Tensor._C.load_tensor(handle, index, device.encode("utf-8"))
+            contents = result_data.tensor.contents
+            result_data.shape = [contents.shape[i] for i in range(contents.ndim)]
+            result_data.ndim = contents.ndim
+            result_data.device = device
+            tensors[Tensor._C.tensor_file_name(handle, index).decode("utf-8")] = result_data
+        return tensors
+    finally:
+        Tensor._C.close_tensor_file(handle)
+
+
+def set_async(enabled):
+    Tensor._C.set_async(int(enabled))
+
 
+def set_lazy(enabled):
+    Tensor._C.set_lazy(int(enabled))
 
-print(tensor1.shape)
-print(tensor1[0, 0])
-print(tensor3[0, 0])
-print(tensor1.device)
 
-tensor1.to("vulkan")
-tensor1.to("cpu")
+def set_grad_enabled(enabled):
+    Tensor._C.set_grad_enabled(int(enabled))
 
-tensor1.to("vulkan")
-tensor2.to("vulkan")
-tensor3 = tensor1 + tensor2
-tensor4 = tensor1 - tensor2
-tensor3.to("cpu")
-# tensor4.to("cpu")
-print(tensor3.tensor)
-# print(tensor3[0, 0])
+
+def synchronize():
+    Tensor._C.synchronize()
+
+
+def empty_cache():
+    """Free the device buffers kept for reuse by tensors that have been freed."""
+    Tensor._C.empty_cache()
+
+
+def profiler_enable(enabled):
+    Tensor._C.profiler_enable(int(enabled))
+
+
+def profiler_reset():
+    Tensor._C.profiler_reset()
+
+
+def export_trace(path):
+    """Write the recorded events as Chrome trace JSON."""
+    Tensor._C.profiler_export_trace(path.encode("utf-8"))
+
+
+def print_summary(path=None):
+    """Print per-op counts, total time, p50/p99 and bytes moved."""
+    Tensor._C.profiler_print_summary(path.encode("utf-8") if path is not None else None)
 
 
 def print_data(self):
@@ -152,9 +733,31 @@ def print_data(self):
     # Iterate over the data using the size attribute to know how many elements to print
     print("Tensor data:")
     for i in range(self.tensor.contents.size):
-        print(self.tensor.contents.data[i])
-
-
-
-print_data(tensor3)
-print("tensor4", tensor4)
\ No newline at end of file
+        print(ctypes.cast(self.tensor.contents.data, ctypes.POINTER(ctypes.c_float))[i])
+
+
+if __name__ == "__main__":
+    tensor1 = Tensor([[1, 2, 3], [3, 2, 1]])
+    tensor2 = Tensor([[3, 2, 1], [1, 2, 3]])
+    tensor3 = tensor1 + tensor2
+    print("hi", tensor1 - tensor2)
+
+    print(tensor1.shape)
+    print(tensor1[0, 0])
+    print(tensor3[0, 0])
+    print(tensor1.device)
+
+    tensor1.to("vulkan")
+    tensor1.to("cpu")
+
+    tensor1.to("vulkan")
+    tensor2.to("vulkan")
+    tensor3 = tensor1 + tensor2
+    tensor4 = tensor1 - tensor2
+    tensor3.to("cpu")
+    # tensor4.to("cpu")
+    print(tensor3.tensor)
+    # print(tensor3[0, 0])
+
+    print_data(tensor3)
+    print("tensor4", tensor4)